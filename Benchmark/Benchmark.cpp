@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../SimpleKVS/CacheGeometry.h"
+#include "../SimpleKVS/InputParser.h"
+#include "../SimpleKVS/OrderedMap.h"
+
+using Clock = std::chrono::steady_clock;
+
+// Branching factors tried by the sweep, the tuned value is added to these
+const std::vector<size_t> SWEEP = { 4, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512 };
+
+// Compile-time branching factors compared against runtime-sized nodes
+template<size_t... N>
+struct FixedFactors {};
+using FIXED = FixedFactors<8, 16, 32, 64, 128>;
+
+struct Timing
+{
+    double insert;
+    double lookup;
+    double scan;
+};
+
+double nanosPerOp(Clock::time_point start, size_t ops)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / ops;
+}
+
+template<typename K>
+K makeKey(uint64_t n);
+
+template<>
+int64_t makeKey<int64_t>(uint64_t n) { return (int64_t)n; }
+
+template<>
+std::string makeKey<std::string>(uint64_t n) { return "user" + std::to_string(n * 2654435761ULL % 1000000007ULL); }
+
+template<typename K, typename V, size_t N = 0>
+Timing run(size_t branchingFactor, const std::vector<K>& keys, const std::vector<K>& lookups)
+{
+    Timing timing;
+    OrderedMap<K, V, N> map(branchingFactor);
+
+    auto start = Clock::now();
+    for (const auto& key : keys) {
+        map.set(key, V());
+    }
+    timing.insert = nanosPerOp(start, keys.size());
+
+    bool isDeleted;
+    size_t found = 0;
+    start = Clock::now();
+    for (const auto& key : lookups) {
+        map.at(key, &isDeleted);
+        found++;
+    }
+    timing.lookup = nanosPerOp(start, found);
+
+    size_t scanned = 0;
+    start = Clock::now();
+    for (auto it = map.begin(); it != map.end(); ++it) {
+        scanned += !it->isDeleted;
+    }
+    timing.scan = nanosPerOp(start, std::max(scanned, (size_t)1));
+    return timing;
+}
+
+template<typename K, typename V, size_t... N>
+void compareFixed(FixedFactors<N...>, const std::vector<K>& keys, const std::vector<K>& lookups)
+{
+    std::printf("\nRuntime-sized nodes against inline nodes of OrderedMap<K, V, N>\n");
+    std::printf("%8s %12s %12s %12s %12s %12s %12s\n", "factor", "insert(ns)", "N insert", "lookup(ns)", "N lookup", "scan(ns)", "N scan");
+    auto compare = [&](size_t factor, Timing runtime, Timing fixed) {
+        std::printf("%8zu %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f\n", factor, runtime.insert, fixed.insert,
+            runtime.lookup, fixed.lookup, runtime.scan, fixed.scan);
+    };
+    (compare(N, run<K, V>(N, keys, lookups), run<K, V, N>(N, keys, lookups)), ...);
+}
+
+double lookupNanos(const OrderedMap<int64_t, int64_t>& map, const std::vector<int64_t>& lookups)
+{
+    bool isDeleted;
+    auto start = Clock::now();
+    for (const auto& key : lookups) {
+        map.at(key, &isDeleted);
+    }
+    return nanosPerOp(start, lookups.size());
+}
+
+// Descending the tree against the learned index over its leaves, for keys
+// from `makeKey`
+template<typename F>
+void compareLearned(const char* name, size_t records, size_t lookupCount, F&& makeKey)
+{
+    std::mt19937_64 random(42);
+    std::vector<int64_t> keys;
+    keys.reserve(records);
+    for (uint64_t i = 0; i < records; i++) {
+        keys.push_back(makeKey(i, random));
+    }
+    std::shuffle(keys.begin(), keys.end(), random);
+    std::vector<int64_t> lookups;
+    lookups.reserve(lookupCount);
+    std::uniform_int_distribution<size_t> pick(0, records - 1);
+    for (size_t i = 0; i < lookupCount; i++) {
+        lookups.push_back(keys[pick(random)]);
+    }
+
+    size_t factor = tuned_branching_factor<int64_t, int64_t>();
+    OrderedMap<int64_t, int64_t> map(factor);
+    for (const auto& key : keys) {
+        map.set(key, 0);
+    }
+    // Everything above the leaves, which is what the learned index replaces
+    size_t leaves = 0;
+    for (auto leaf = map.begin().parent; leaf; leaf = leaf->mNext) leaves++;
+    size_t treeBytes = map.memory_usage();
+    size_t branchBytes = treeBytes - leaves * OrderedMapNode<int64_t, int64_t>::node_bytes(factor, true);
+
+    // The inner nodes stay when the index is learned, so it costs memory on
+    // top of the whole tree
+    std::printf("\nLearned index over %s, %zu records, branching factor %zu\n", name, records, factor);
+    std::printf("%10s %12s %12s %12s %12s\n", "max error", "segments", "index bytes", "total bytes", "lookup(ns)");
+    std::printf("%10s %12s %12zu %12zu %12.1f\n", "tree", "", branchBytes, treeBytes, lookupNanos(map, lookups));
+    for (size_t maxError : { 0, 4, 8, 32, 128 }) {
+        map.learn(maxError);
+        std::printf("%10zu %12zu %12zu %12zu %12.1f\n", maxError, map.learned()->segments(),
+            map.memory_usage() - treeBytes, map.memory_usage(), lookupNanos(map, lookups));
+    }
+
+    // Keys past the largest only split the last leaf, which extends the index
+    int64_t last = *std::max_element(keys.begin(), keys.end());
+    for (size_t i = 1; i <= records / 10; i++) {
+        map.set(last + (int64_t)i, 0);
+    }
+    if (map.learned()) {
+        std::printf("%10s %12zu %12zu %12zu\n", "+10% tail", map.learned()->segments(),
+            map.learned()->memory_usage(), map.memory_usage());
+    }
+}
+
+template<typename K, typename V>
+void sweep(const char* name, size_t records, size_t lookupCount)
+{
+    std::mt19937_64 random(42);
+    std::vector<K> keys;
+    keys.reserve(records);
+    for (uint64_t i = 0; i < records; i++) {
+        keys.push_back(makeKey<K>(i));
+    }
+    std::shuffle(keys.begin(), keys.end(), random);
+
+    std::vector<K> lookups;
+    lookups.reserve(lookupCount);
+    std::uniform_int_distribution<size_t> pick(0, records - 1);
+    for (size_t i = 0; i < lookupCount; i++) {
+        lookups.push_back(keys[pick(random)]);
+    }
+
+    size_t tuned = tuned_branching_factor<K, V>();
+    std::vector<size_t> factors = SWEEP;
+    factors.push_back(tuned);
+    std::sort(factors.begin(), factors.end());
+    factors.erase(std::unique(factors.begin(), factors.end()), factors.end());
+
+    std::printf("\n%s, %zu records, %zu lookups, tuned branching factor %zu\n", name, records, lookupCount, tuned);
+    std::printf("%8s %12s %12s %12s\n", "factor", "insert(ns)", "lookup(ns)", "scan(ns)");
+    for (size_t factor : factors) {
+        Timing timing = run<K, V>(factor, keys, lookups);
+        std::printf("%8zu %12.1f %12.1f %12.1f%s\n", factor, timing.insert, timing.lookup, timing.scan,
+            factor == tuned ? "  <- tuned" : "");
+    }
+
+    compareFixed<K, V>(FIXED(), keys, lookups);
+}
+
+int main(int argc, char* argv[])
+{
+    InputParser input(argc, argv);
+    size_t records = 1'000'000;
+    size_t lookups = 1'000'000;
+    try {
+        if (input.cmdOptionExists("-n"))
+            records = std::stoull(input.getCmdOption("-n"));
+        if (input.cmdOptionExists("-l"))
+            lookups = std::stoull(input.getCmdOption("-l"));
+    } catch (std::exception&) {
+        std::cerr << "Usage: Benchmark [-n records] [-l lookups]" << std::endl;
+        return 1;
+    }
+
+    const CacheGeometry& cache = CacheGeometry::host();
+    std::printf("Cache line %zu bytes, L1d %zu KB, L2 %zu KB\n", cache.lineSize, cache.l1Size / 1024, cache.l2Size / 1024);
+
+    sweep<int64_t, int64_t>("int64_t -> int64_t", records, lookups);
+    // What collections hold, see Collection::Value
+    sweep<std::string, std::shared_ptr<const std::string>>("std::string -> shared value", records, lookups);
+    compareLearned("sequential keys", records, lookups, [](uint64_t i, auto& random) { return (int64_t)i; });
+    compareLearned("random keys", records, lookups, [](uint64_t i, auto& random) { return (int64_t)(random() >> 1); });
+    return 0;
+}
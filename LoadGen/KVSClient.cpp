@@ -0,0 +1,250 @@
+#include "KVSClient.h"
+
+#include <memory>
+
+void ClientConnection::connect(const tcp::resolver::results_type& endpoints, ConnectHandler onConnect)
+{
+    auto self = shared_from_this();
+    boost::asio::async_connect(
+        mSocket,
+        endpoints,
+        [self, onConnect](const boost::system::error_code& error, const tcp::endpoint& endpoint) {
+            if (!error) {
+                self->mIsConnected = true;
+                self->mSocket.set_option(tcp::no_delay(true));
+                self->doWrite();
+                self->doRead();
+            }
+            onConnect(error);
+        }
+    );
+}
+
+void ClientConnection::send(const Request& request, Callback callback)
+{
+    if (mFraming == Framing::Binary) {
+        encodeBinaryRequest(request, mNextOpaque++, mPendingWrite);
+    }
+    else {
+        formatRequest(request, mPendingWrite);
+    }
+    mCallbacks.push_back(std::move(callback));
+    doWrite();
+}
+
+void ClientConnection::close()
+{
+    boost::system::error_code ignored;
+    mSocket.shutdown(tcp::socket::shutdown_both, ignored);
+    mSocket.close(ignored);
+    mIsConnected = false;
+}
+
+void ClientConnection::doRead()
+{
+    auto self = shared_from_this();
+    boost::asio::async_read(
+        mSocket,
+        mReadBuffer,
+        boost::asio::transfer_at_least(1),
+        [self](const boost::system::error_code& error, size_t bytes_transferred) {
+            if (error) {
+                self->fail(error.message());
+                return;
+            }
+            self->processBuffer();
+            self->doRead();
+        }
+    );
+}
+
+void ClientConnection::doWrite()
+{
+    if (!mIsConnected || mWriteInProgress || mPendingWrite.empty()) return;
+
+    mWriteInProgress = true;
+    std::swap(mWriteMessage, mPendingWrite);
+    mPendingWrite.clear();
+
+    auto self = shared_from_this();
+    boost::asio::async_write(
+        mSocket,
+        boost::asio::buffer(mWriteMessage),
+        [self](const boost::system::error_code& error, size_t bytes_transferred) {
+            self->mWriteInProgress = false;
+            if (error) {
+                self->fail(error.message());
+                return;
+            }
+            self->doWrite();
+        }
+    );
+}
+
+void ClientConnection::processBuffer()
+{
+    // A single read usually carries several pipelined responses
+    auto data = mReadBuffer.data();
+    std::string_view buffered(static_cast<const char*>(data.data()), data.size());
+    size_t start = 0;
+    size_t end;
+
+    if (!mHasGreeting) {
+        // The first line on every connection is the server's MOTD
+        if ((end = buffered.find('\n')) == std::string_view::npos) return;
+        mHasGreeting = true;
+        start = end + 1;
+    }
+
+    if (mFraming == Framing::Text) {
+        while ((end = buffered.find('\n', start)) != std::string_view::npos) {
+            handleLine(buffered.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+    else {
+        while (buffered.size() - start >= BINARY_HEADER_SIZE) {
+            BinaryHeader header = decodeBinaryHeader(buffered.data() + start);
+            size_t frame = BINARY_HEADER_SIZE + header.valueLength;
+            if (buffered.size() - start < frame) break;
+            handleFrame(header, buffered.substr(start + BINARY_HEADER_SIZE, header.valueLength));
+            start += frame;
+        }
+    }
+    mReadBuffer.consume(start);
+}
+
+void ClientConnection::handleLine(std::string_view line)
+{
+    if (!mParser.feed(line)) return;
+    complete(mParser.response());
+    mParser.reset();
+}
+
+void ClientConnection::handleFrame(const BinaryHeader& header, std::string_view payload)
+{
+    if (header.magic != BINARY_RESPONSE_MAGIC || !decodeBinaryResponse(header, payload, mBinaryResponse)) {
+        mBinaryResponse = Response::error("Malformed response");
+    }
+    complete(mBinaryResponse);
+}
+
+void ClientConnection::complete(Response& response)
+{
+    if (mCallbacks.empty()) return;
+
+    Callback callback = std::move(mCallbacks.front());
+    mCallbacks.pop_front();
+    callback(response);
+}
+
+void ClientConnection::fail(const std::string& reason)
+{
+    close();
+
+    std::deque<Callback> callbacks;
+    std::swap(callbacks, mCallbacks);
+    for (auto& callback : callbacks) {
+        Response response = Response::error(reason);
+        callback(response);
+    }
+}
+
+KVSClient::KVSClient(boost::asio::io_context& io_context, size_t poolSize, Framing framing) :
+    mIoContext(io_context)
+{
+    for (size_t i = 0; i < std::max<size_t>(poolSize, 1); i++) {
+        mConnections.push_back(boost::shared_ptr<ClientConnection>(new ClientConnection(io_context, framing)));
+    }
+}
+
+void KVSClient::connect(const std::string& host, const std::string& port, ConnectHandler onConnect)
+{
+    auto resolver = std::make_shared<tcp::resolver>(mIoContext);
+    resolver->async_resolve(
+        host,
+        port,
+        [this, resolver, onConnect](const boost::system::error_code& error, tcp::resolver::results_type results) {
+            if (error) {
+                onConnect(error);
+                return;
+            }
+
+            auto remaining = std::make_shared<size_t>(mConnections.size());
+            auto failed = std::make_shared<bool>(false);
+            for (auto& connection : mConnections) {
+                connection->connect(results, [remaining, failed, onConnect](const boost::system::error_code& error) {
+                    if (*failed) return;
+                    if (error) {
+                        *failed = true;
+                        onConnect(error);
+                    }
+                    else if (--*remaining == 0) {
+                        onConnect(error);
+                    }
+                });
+            }
+        }
+    );
+}
+
+void KVSClient::close()
+{
+    for (auto& connection : mConnections) {
+        connection->close();
+    }
+}
+
+void KVSClient::send(const Request& request, Callback callback)
+{
+    // Least outstanding requests wins, ties are broken round-robin
+    size_t best = mNextConnection;
+    for (size_t i = 0; i < mConnections.size(); i++) {
+        size_t candidate = (mNextConnection + i) % mConnections.size();
+        if (mConnections[candidate]->outstanding() < mConnections[best]->outstanding()) {
+            best = candidate;
+        }
+    }
+    mNextConnection = (best + 1) % mConnections.size();
+    mConnections[best]->send(request, std::move(callback));
+}
+
+void KVSClient::get(const std::string& collection, const std::string& key, Callback callback)
+{
+    send({ Opcode::Get, collection, { key } }, std::move(callback));
+}
+
+void KVSClient::set(const std::string& collection, const std::string& key, const std::string& value, Callback callback)
+{
+    send({ Opcode::Set, collection, { key, value } }, std::move(callback));
+}
+
+void KVSClient::del(const std::string& collection, const std::string& key, Callback callback)
+{
+    send({ Opcode::Del, collection, { key } }, std::move(callback));
+}
+
+void KVSClient::mget(const std::string& collection, const std::vector<std::string>& keys, Callback callback)
+{
+    send({ Opcode::MGet, collection, keys }, std::move(callback));
+}
+
+void KVSClient::mset(const std::string& collection, const std::vector<std::pair<std::string, std::string>>& pairs, Callback callback)
+{
+    Request request{ Opcode::MSet, collection, {} };
+    request.args.reserve(pairs.size() * 2);
+    for (const auto& [key, value] : pairs) {
+        request.args.push_back(key);
+        request.args.push_back(value);
+    }
+    send(request, std::move(callback));
+}
+
+size_t KVSClient::outstanding() const
+{
+    size_t total = 0;
+    for (const auto& connection : mConnections) {
+        total += connection->outstanding();
+    }
+    return total;
+}
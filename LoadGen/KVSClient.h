@@ -0,0 +1,96 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../SimpleKVS/Protocol.h"
+
+using boost::asio::ip::tcp;
+
+// Asynchronous client for the SimpleKVS protocol, in either framing.
+//
+// Requests are pipelined: send() never waits for earlier responses, and
+// callbacks fire in request order once each response has been read.
+// A connection and its callbacks belong to a single io_context, which
+// must only be run by one thread.
+class ClientConnection : public boost::enable_shared_from_this<ClientConnection>
+{
+public:
+    using Callback = std::function<void(Response&)>;
+    using ConnectHandler = std::function<void(const boost::system::error_code&)>;
+
+    ClientConnection(boost::asio::io_context& io_context, Framing framing = Framing::Text) :
+        mSocket(io_context),
+        mFraming(framing)
+    {}
+
+    void connect(const tcp::resolver::results_type& endpoints, ConnectHandler onConnect);
+    void send(const Request& request, Callback callback);
+    void close();
+
+    // Number of requests that are still waiting for a response
+    size_t outstanding() const { return mCallbacks.size(); }
+    bool isConnected() const { return mIsConnected; }
+
+private:
+    void doRead();
+    void doWrite();
+    // Consumes every complete response in the read buffer
+    void processBuffer();
+    void handleLine(std::string_view line);
+    void handleFrame(const BinaryHeader& header, std::string_view payload);
+    void complete(Response& response);
+    void fail(const std::string& reason);
+
+    tcp::socket mSocket;
+    Framing mFraming;
+    boost::asio::streambuf mReadBuffer;
+    std::string mWriteMessage;
+    std::string mPendingWrite;
+    std::deque<Callback> mCallbacks;
+    ResponseParser mParser;
+    Response mBinaryResponse;
+    uint32_t mNextOpaque = 0;
+    bool mIsConnected = false;
+    bool mHasGreeting = false;
+    bool mWriteInProgress = false;
+};
+
+// A pool of pipelined connections to one server.
+// Each request goes to the connection with the fewest outstanding requests.
+class KVSClient
+{
+public:
+    using Callback = ClientConnection::Callback;
+    using ConnectHandler = ClientConnection::ConnectHandler;
+
+    KVSClient(boost::asio::io_context& io_context, size_t poolSize = 1, Framing framing = Framing::Text);
+
+    // Opens every connection in the pool. `onConnect` is called once, after
+    // all connections are up or as soon as one of them fails.
+    void connect(const std::string& host, const std::string& port, ConnectHandler onConnect);
+    void close();
+
+    void send(const Request& request, Callback callback);
+
+    void get(const std::string& collection, const std::string& key, Callback callback);
+    void set(const std::string& collection, const std::string& key, const std::string& value, Callback callback);
+    void del(const std::string& collection, const std::string& key, Callback callback);
+    void mget(const std::string& collection, const std::vector<std::string>& keys, Callback callback);
+    void mset(const std::string& collection, const std::vector<std::pair<std::string, std::string>>& pairs, Callback callback);
+
+    size_t size() const { return mConnections.size(); }
+    ClientConnection& connection(size_t i) { return *mConnections[i]; }
+    size_t outstanding() const;
+
+private:
+    boost::asio::io_context& mIoContext;
+    std::vector<boost::shared_ptr<ClientConnection>> mConnections;
+    size_t mNextConnection = 0;
+};
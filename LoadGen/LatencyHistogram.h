@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+// Log-linear latency histogram in the spirit of HdrHistogram.
+// Every power of two is split into 128 linear sub-buckets, so recorded
+// values keep better than 1% relative precision across the full range
+// while recording stays a couple of integer operations.
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 7;
+    static constexpr uint64_t SUB_BUCKETS = 1ull << SUB_BUCKET_BITS;
+
+    LatencyHistogram() :
+        mCounts((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS, 0)
+    {}
+
+    void record(uint64_t value)
+    {
+        mCounts[bucketOf(value)]++;
+        mTotal++;
+        mMax = std::max(mMax, value);
+    }
+
+    void merge(const LatencyHistogram& other)
+    {
+        for (size_t i = 0; i < mCounts.size(); i++) {
+            mCounts[i] += other.mCounts[i];
+        }
+        mTotal += other.mTotal;
+        mMax = std::max(mMax, other.mMax);
+    }
+
+    // Returns the value below which `quantile` (0.0 - 1.0) of recordings fall
+    uint64_t percentile(double quantile) const
+    {
+        if (mTotal == 0) return 0;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)(quantile * (double)mTotal + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < mCounts.size(); i++) {
+            seen += mCounts[i];
+            if (seen >= target) return std::min(upperBoundOf(i), mMax);
+        }
+        return mMax;
+    }
+
+    uint64_t count() const { return mTotal; }
+    uint64_t max() const { return mMax; }
+
+private:
+    static size_t bucketOf(uint64_t value)
+    {
+        if (value < SUB_BUCKETS) return (size_t)value;
+        unsigned exponent = (63 - std::countl_zero(value)) - SUB_BUCKET_BITS;
+        return (size_t)(exponent * SUB_BUCKETS + (value >> exponent));
+    }
+
+    static uint64_t upperBoundOf(size_t bucket)
+    {
+        if (bucket < 2 * SUB_BUCKETS) return bucket;
+        unsigned exponent = (unsigned)(bucket / SUB_BUCKETS) - 1;
+        uint64_t mantissa = bucket - exponent * SUB_BUCKETS;
+        return ((mantissa + 1) << exponent) - 1;
+    }
+
+    std::vector<uint64_t> mCounts;
+    uint64_t mTotal = 0;
+    uint64_t mMax = 0;
+};
@@ -0,0 +1,460 @@
+#define _WIN32_WINNT 0x0601
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../SimpleKVS/InputParser.h"
+#include "KVSClient.h"
+#include "LatencyHistogram.h"
+#include "Workload.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t LOAD_BATCH_SIZE = 100;
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    std::string port = "6278";
+    std::string collection = "bench";
+    std::string workload = "a";
+    WorkloadMix mix;
+    size_t threads = 1;
+    // Connections per thread
+    size_t connections = 4;
+    // Outstanding requests per connection in closed-loop mode
+    size_t depth = 16;
+    // Keys per read/update request, values above 1 use MGET/MSET
+    size_t batch = 1;
+    uint64_t records = 100'000;
+    size_t valueSize = 100;
+    double theta = ZipfianGenerator::DEFAULT_THETA;
+    // Requests per second across all threads, 0 runs a closed loop
+    double rate = 0;
+    double duration = 10;
+    bool load = true;
+    Framing framing = Framing::Text;
+};
+
+struct Stats
+{
+    static constexpr size_t OPERATIONS = 4;
+
+    LatencyHistogram latency[OPERATIONS];
+    LatencyHistogram all;
+    uint64_t errors = 0;
+    uint64_t keys = 0;
+    size_t maxOutstanding = 0;
+    double seconds = 0;
+
+    void merge(const Stats& other)
+    {
+        for (size_t i = 0; i < OPERATIONS; i++) {
+            latency[i].merge(other.latency[i]);
+        }
+        all.merge(other.all);
+        errors += other.errors;
+        keys += other.keys;
+        maxOutstanding = std::max(maxOutstanding, other.maxOutstanding);
+        seconds = std::max(seconds, other.seconds);
+    }
+};
+
+// Drives one io_context and connection pool from a single thread.
+class Worker
+{
+public:
+    Worker(const Options& options, size_t id, std::atomic<uint64_t>& inserted) :
+        mOptions{ options },
+        mId{ id },
+        mInserted{ inserted },
+        mClient(mIoContext, options.connections, options.framing),
+        mTimer(mIoContext),
+        mRandom{ 0x5eed + id },
+        mKeys(options.mix.distribution, options.records, options.theta),
+        mValue(options.valueSize, 'x')
+    {
+        for (auto& c : mValue) {
+            c = (char)('a' + mRandom() % 26);
+        }
+    }
+
+    bool connect()
+    {
+        bool done = false;
+        boost::system::error_code result;
+        mClient.connect(mOptions.host, mOptions.port, [&](const boost::system::error_code& error) {
+            done = true;
+            result = error;
+        });
+        while (!done && mIoContext.run_one() > 0);
+        if (result) {
+            std::cerr << "Connection failed: " << result.message() << std::endl;
+        }
+        return !result;
+    }
+
+    void close()
+    {
+        mClient.close();
+        mIoContext.restart();
+        mIoContext.poll();
+    }
+
+    // Inserts this worker's share of the initial records.
+    void load()
+    {
+        mNextRecord = mOptions.records * mId / mOptions.threads;
+        mLastRecord = mOptions.records * (mId + 1) / mOptions.threads;
+
+        Clock::time_point start = Clock::now();
+        size_t window = mOptions.connections * mOptions.depth;
+        for (size_t i = 0; i < window && mNextRecord < mLastRecord; i++) {
+            loadBatch();
+        }
+        if (mInFlight > 0) runUntilStopped();
+        mLoadStats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // Runs the configured workload for the configured duration.
+    void run()
+    {
+        mStart = Clock::now();
+        mDeadline = mStart + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(mOptions.duration));
+
+        if (mOptions.rate > 0) {
+            mInterval = std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>((double)mOptions.threads / mOptions.rate));
+            mNextIntended = mStart;
+            tick();
+        }
+        else {
+            size_t window = mOptions.connections * mOptions.depth;
+            for (size_t i = 0; i < window; i++) {
+                issue(Clock::now());
+            }
+        }
+        runUntilStopped();
+        mStats.seconds = std::chrono::duration<double>(Clock::now() - mStart).count();
+    }
+
+    const Stats& stats() const { return mStats; }
+    const Stats& loadStats() const { return mLoadStats; }
+
+private:
+    void runUntilStopped()
+    {
+        mIoContext.restart();
+        mIoContext.run();
+    }
+
+    void loadBatch()
+    {
+        std::vector<std::pair<std::string, std::string>> pairs;
+        for (size_t i = 0; i < LOAD_BATCH_SIZE && mNextRecord < mLastRecord; i++) {
+            pairs.emplace_back(KeyChooser::keyName(mNextRecord++), mValue);
+        }
+        size_t count = pairs.size();
+        Clock::time_point start = Clock::now();
+
+        mInFlight++;
+        mClient.mset(mOptions.collection, pairs, [this, count, start](Response& response) {
+            mInFlight--;
+            mLoadStats.all.record(elapsedSince(start));
+            mLoadStats.keys += count;
+            countErrors(response, mLoadStats);
+
+            if (mNextRecord < mLastRecord) loadBatch();
+            else if (mInFlight == 0) mIoContext.stop();
+        });
+    }
+
+    // Open loop: requests are issued on a fixed schedule regardless of how
+    // many are still in flight, and latency is measured from the time each
+    // request was meant to be sent so that queueing isn't hidden.
+    void tick()
+    {
+        Clock::time_point now = Clock::now();
+        while (mNextIntended <= now && mNextIntended < mDeadline) {
+            issue(mNextIntended);
+            mNextIntended += mInterval;
+        }
+
+        if (mNextIntended >= mDeadline) {
+            mIsDone = true;
+            if (mInFlight == 0) mIoContext.stop();
+            return;
+        }
+
+        mTimer.expires_at(mNextIntended);
+        mTimer.async_wait([this](const boost::system::error_code& error) {
+            if (!error) tick();
+        });
+    }
+
+    void issue(Clock::time_point intended)
+    {
+        Operation op = mOptions.mix.next(mRandom);
+        auto onComplete = [this, op, intended](Response& response) {
+            complete(op, intended, response);
+        };
+
+        mInFlight++;
+        mStats.maxOutstanding = std::max(mStats.maxOutstanding, mInFlight);
+
+        switch (op) {
+        case Operation::Read:
+            if (mOptions.batch > 1) {
+                std::vector<std::string> keys;
+                for (size_t i = 0; i < mOptions.batch; i++) keys.push_back(nextKey());
+                mClient.mget(mOptions.collection, keys, onComplete);
+            }
+            else {
+                mClient.get(mOptions.collection, nextKey(), onComplete);
+            }
+            break;
+        case Operation::Update:
+            if (mOptions.batch > 1) {
+                std::vector<std::pair<std::string, std::string>> pairs;
+                for (size_t i = 0; i < mOptions.batch; i++) pairs.emplace_back(nextKey(), mValue);
+                mClient.mset(mOptions.collection, pairs, onComplete);
+            }
+            else {
+                mClient.set(mOptions.collection, nextKey(), mValue, onComplete);
+            }
+            break;
+        case Operation::Insert:
+            mClient.set(mOptions.collection, KeyChooser::keyName(mInserted.fetch_add(1)), mValue, onComplete);
+            break;
+        case Operation::ReadModifyWrite:
+        {
+            std::string key = nextKey();
+            mClient.get(mOptions.collection, key, [this, key, onComplete](Response& response) {
+                mClient.set(mOptions.collection, key, mValue, onComplete);
+            });
+            break;
+        }
+        }
+    }
+
+    void complete(Operation op, Clock::time_point intended, Response& response)
+    {
+        mInFlight--;
+        uint64_t latency = elapsedSince(intended);
+        mStats.latency[(size_t)op].record(latency);
+        mStats.all.record(latency);
+        mStats.keys += response.results.size();
+        countErrors(response, mStats);
+
+        Clock::time_point now = Clock::now();
+        if (mOptions.rate > 0) {
+            if (mIsDone && mInFlight == 0) mIoContext.stop();
+        }
+        else if (now < mDeadline) {
+            issue(now);
+        }
+        else if (mInFlight == 0) {
+            mIoContext.stop();
+        }
+    }
+
+    std::string nextKey()
+    {
+        return KeyChooser::keyName(mKeys.next(mRandom, mInserted.load(std::memory_order_relaxed)));
+    }
+
+    static void countErrors(const Response& response, Stats& stats)
+    {
+        for (const auto& result : response.results) {
+            if (result.status == Status::Error) stats.errors++;
+        }
+    }
+
+    static uint64_t elapsedSince(Clock::time_point start)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    const Options& mOptions;
+    size_t mId;
+    std::atomic<uint64_t>& mInserted;
+    boost::asio::io_context mIoContext;
+    KVSClient mClient;
+    boost::asio::steady_timer mTimer;
+    Random mRandom;
+    KeyChooser mKeys;
+    std::string mValue;
+
+    Stats mStats;
+    Stats mLoadStats;
+    size_t mInFlight = 0;
+    uint64_t mNextRecord = 0;
+    uint64_t mLastRecord = 0;
+    Clock::time_point mStart;
+    Clock::time_point mDeadline;
+    Clock::time_point mNextIntended;
+    Clock::duration mInterval{};
+    bool mIsDone = false;
+};
+
+void printHistogram(const char* name, const LatencyHistogram& histogram)
+{
+    if (histogram.count() == 0) return;
+    auto us = [](uint64_t ns) { return (double)ns / 1000.0; };
+    std::printf("%-8s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+        name,
+        (unsigned long long)histogram.count(),
+        us(histogram.percentile(0.5)),
+        us(histogram.percentile(0.99)),
+        us(histogram.percentile(0.999)),
+        us(histogram.percentile(0.9999)),
+        us(histogram.max()));
+}
+
+void printStats(const Stats& stats)
+{
+    double requests = (double)stats.all.count();
+    std::printf("%.2fs, %.0f requests (%.0f req/s, %.0f keys/s), %llu errors, %zu max in flight\n",
+        stats.seconds,
+        requests,
+        requests / stats.seconds,
+        (double)stats.keys / stats.seconds,
+        (unsigned long long)stats.errors,
+        stats.maxOutstanding);
+    std::printf("%-8s %12s %10s %10s %10s %10s %10s\n", "op", "count", "p50(us)", "p99(us)", "p999(us)", "p9999(us)", "max(us)");
+    const char* names[Stats::OPERATIONS] = { "READ", "UPDATE", "INSERT", "RMW" };
+    for (size_t i = 0; i < Stats::OPERATIONS; i++) {
+        printHistogram(names[i], stats.latency[i]);
+    }
+    printHistogram("ALL", stats.all);
+}
+
+template<typename F>
+void runWorkers(std::vector<std::unique_ptr<Worker>>& workers, F f)
+{
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker, &f] { f(*worker); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void printUsage()
+{
+    std::cout <<
+        "Usage: LoadGen [options]\n"
+        "  -host <host>        server address (127.0.0.1)\n"
+        "  -p <port>           server port (6278)\n"
+        "  -collection <name>  collection to use (bench)\n"
+        "  -w <a|b|c|d|f>      YCSB core workload (a)\n"
+        "  -dist <uniform|zipfian|latest>  override the workload's key distribution\n"
+        "  -z <theta>          zipfian skew (0.99)\n"
+        "  -n <records>        records in the initial load (100000)\n"
+        "  -v <bytes>          value size (100)\n"
+        "  -threads <n>        client threads (1)\n"
+        "  -c <n>              connections per thread (4)\n"
+        "  -d <n>              requests in flight per connection, closed loop (16)\n"
+        "  -b <n>              keys per read/update, uses MGET/MSET above 1 (1)\n"
+        "  -r <req/s>          open-loop request rate over all threads, 0 for closed loop (0)\n"
+        "  -t <seconds>        run duration (10)\n"
+        "  -skipload           don't load the initial records\n"
+        "  -binary             use the binary protocol instead of text\n";
+}
+
+int main(int argc, char* argv[]) {
+    InputParser input(argc, argv);
+    if (input.cmdOptionExists("-h")) {
+        printUsage();
+        return 0;
+    }
+
+    Options options;
+    try {
+        auto option = [&](const char* name, auto& value) {
+            const std::string& text = input.getCmdOption(name);
+            if (text.empty()) return;
+            using T = std::decay_t<decltype(value)>;
+            if constexpr (std::is_same_v<T, std::string>) value = text;
+            else if constexpr (std::is_floating_point_v<T>) value = std::stod(text);
+            else value = (T)std::stoull(text);
+        };
+        option("-host", options.host);
+        option("-p", options.port);
+        option("-collection", options.collection);
+        option("-w", options.workload);
+        option("-z", options.theta);
+        option("-n", options.records);
+        option("-v", options.valueSize);
+        option("-threads", options.threads);
+        option("-c", options.connections);
+        option("-d", options.depth);
+        option("-b", options.batch);
+        option("-r", options.rate);
+        option("-t", options.duration);
+    }
+    catch (const std::exception&) {
+        printUsage();
+        return 1;
+    }
+    options.load = !input.cmdOptionExists("-skipload");
+    if (input.cmdOptionExists("-binary")) options.framing = Framing::Binary;
+    options.threads = std::max<size_t>(options.threads, 1);
+    options.records = std::max<uint64_t>(options.records, 1);
+
+    if (!WorkloadMix::fromName(options.workload, options.mix)) {
+        std::cerr << "Unsupported workload " << options.workload << std::endl;
+        return 1;
+    }
+    const std::string& dist = input.getCmdOption("-dist");
+    if (dist == "uniform") options.mix.distribution = KeyDistribution::Uniform;
+    else if (dist == "zipfian") options.mix.distribution = KeyDistribution::Zipfian;
+    else if (dist == "latest") options.mix.distribution = KeyDistribution::Latest;
+
+    std::atomic<uint64_t> inserted{ options.records };
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t i = 0; i < options.threads; i++) {
+        workers.push_back(std::make_unique<Worker>(options, i, inserted));
+    }
+
+    std::atomic<bool> connected{ true };
+    runWorkers(workers, [&](Worker& worker) {
+        if (!worker.connect()) connected = false;
+    });
+    if (!connected) return 1;
+
+    if (options.load) {
+        runWorkers(workers, [](Worker& worker) { worker.load(); });
+        Stats load;
+        for (auto& worker : workers) load.merge(worker->loadStats());
+        std::printf("Load: ");
+        printStats(load);
+        std::printf("\n");
+    }
+
+    std::printf("Workload %s over %s, %zu threads x %zu connections, %s\n",
+        options.workload.c_str(),
+        options.framing == Framing::Binary ? "binary" : "text",
+        options.threads,
+        options.connections,
+        options.rate > 0
+            ? ("open loop at " + std::to_string((uint64_t)options.rate) + " req/s").c_str()
+            : ("closed loop, " + std::to_string(options.depth) + " in flight per connection").c_str());
+
+    runWorkers(workers, [](Worker& worker) { worker.run(); });
+    Stats total;
+    for (auto& worker : workers) {
+        total.merge(worker->stats());
+        worker->close();
+    }
+    printStats(total);
+    return total.errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,169 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+
+using Random = std::mt19937_64;
+
+// Zipfian distribution over [0, items), item 0 being the most popular.
+// Uses the constant-time sampling method from Gray et al., "Quickly
+// Generating Billion-Record Synthetic Databases", same as YCSB.
+class ZipfianGenerator
+{
+public:
+    static constexpr double DEFAULT_THETA = 0.99;
+
+    ZipfianGenerator(uint64_t items, double theta = DEFAULT_THETA) :
+        mItems{ std::max<uint64_t>(items, 1) },
+        mTheta{ theta }
+    {
+        mZetaN = zeta(mItems, mTheta);
+        double zeta2 = zeta(2, mTheta);
+        mAlpha = 1.0 / (1.0 - mTheta);
+        mEta = (1.0 - std::pow(2.0 / (double)mItems, 1.0 - mTheta)) / (1.0 - zeta2 / mZetaN);
+        mHalfPowTheta = 1.0 + std::pow(0.5, mTheta);
+    }
+
+    uint64_t next(Random& random)
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        double uz = u * mZetaN;
+        if (uz < 1.0) return 0;
+        if (uz < mHalfPowTheta) return 1;
+        uint64_t item = (uint64_t)((double)mItems * std::pow(mEta * u - mEta + 1.0, mAlpha));
+        return std::min(item, mItems - 1);
+    }
+
+    uint64_t items() const { return mItems; }
+
+private:
+    static double zeta(uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) {
+            sum += 1.0 / std::pow((double)i, theta);
+        }
+        return sum;
+    }
+
+    uint64_t mItems;
+    double mTheta;
+    double mZetaN;
+    double mAlpha;
+    double mEta;
+    double mHalfPowTheta;
+};
+
+enum class KeyDistribution {
+    Uniform,
+    // Zipfian with the popular items scattered across the key space
+    Zipfian,
+    // Zipfian over recency, the most recently inserted items are the most popular
+    Latest,
+};
+
+enum class Operation {
+    Read,
+    Update,
+    Insert,
+    ReadModifyWrite,
+};
+
+// Operation mix of one of the YCSB core workloads.
+struct WorkloadMix
+{
+    double read = 0;
+    double update = 0;
+    double insert = 0;
+    double readModifyWrite = 0;
+    KeyDistribution distribution = KeyDistribution::Zipfian;
+
+    // A, B, C, D and F are supported. E needs range scans, which the
+    // protocol doesn't have yet.
+    static bool fromName(const std::string& name, WorkloadMix& mix)
+    {
+        mix = WorkloadMix();
+        if (name == "a" || name == "A") {
+            mix.read = 0.5;
+            mix.update = 0.5;
+        }
+        else if (name == "b" || name == "B") {
+            mix.read = 0.95;
+            mix.update = 0.05;
+        }
+        else if (name == "c" || name == "C") {
+            mix.read = 1.0;
+        }
+        else if (name == "d" || name == "D") {
+            mix.read = 0.95;
+            mix.insert = 0.05;
+            mix.distribution = KeyDistribution::Latest;
+        }
+        else if (name == "f" || name == "F") {
+            mix.read = 0.5;
+            mix.readModifyWrite = 0.5;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    Operation next(Random& random) const
+    {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+        if ((u -= read) < 0) return Operation::Read;
+        if ((u -= update) < 0) return Operation::Update;
+        if ((u -= insert) < 0) return Operation::Insert;
+        return Operation::ReadModifyWrite;
+    }
+};
+
+// Picks existing record numbers according to a KeyDistribution.
+class KeyChooser
+{
+public:
+    KeyChooser(KeyDistribution distribution, uint64_t records, double theta) :
+        mDistribution{ distribution },
+        mRecords{ records },
+        mZipfian(records, theta)
+    {}
+
+    // `inserted` is the number of records that exist right now, which only
+    // grows past the initial record count for insert-heavy workloads.
+    uint64_t next(Random& random, uint64_t inserted)
+    {
+        switch (mDistribution) {
+        case KeyDistribution::Uniform:
+            return std::uniform_int_distribution<uint64_t>(0, inserted - 1)(random);
+        case KeyDistribution::Zipfian:
+            return scramble(mZipfian.next(random)) % mRecords;
+        case KeyDistribution::Latest:
+            return inserted - 1 - std::min(mZipfian.next(random), inserted - 1);
+        }
+        return 0;
+    }
+
+    static std::string keyName(uint64_t record)
+    {
+        return "user" + std::to_string(record);
+    }
+
+private:
+    // FNV-1a over the bytes of the item, keeps hot items from clustering
+    static uint64_t scramble(uint64_t item)
+    {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (int i = 0; i < 8; i++) {
+            hash ^= (item >> (i * 8)) & 0xff;
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    KeyDistribution mDistribution;
+    uint64_t mRecords;
+    ZipfianGenerator mZipfian;
+};
@@ -0,0 +1,39 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+// Per-thread free list of reusable objects, used for connection buffers so
+// that accept/close churn doesn't go through the allocator every time.
+// T must provide `bool reset()`, which clears the object for reuse and
+// returns false if it has grown too large to be worth keeping.
+template<typename T>
+class BufferPool
+{
+public:
+	static constexpr size_t MAX_POOLED = 256;
+
+	// The pool of the calling thread
+	static BufferPool& local()
+	{
+		thread_local BufferPool pool;
+		return pool;
+	}
+
+	std::unique_ptr<T> acquire()
+	{
+		if (mFree.empty()) return std::make_unique<T>();
+		std::unique_ptr<T> object = std::move(mFree.back());
+		mFree.pop_back();
+		return object;
+	}
+
+	void release(std::unique_ptr<T> object)
+	{
+		if (!object || !object->reset() || mFree.size() >= MAX_POOLED) return;
+		mFree.push_back(std::move(object));
+	}
+
+	size_t size() const { return mFree.size(); }
+private:
+	std::vector<std::unique_ptr<T>> mFree;
+};
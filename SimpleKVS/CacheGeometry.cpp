@@ -0,0 +1,77 @@
+#include "CacheGeometry.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <vector>
+#else
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#endif
+
+namespace {
+#if defined(_WIN32)
+	CacheGeometry detect()
+	{
+		CacheGeometry cache;
+		DWORD length = 0;
+		GetLogicalProcessorInformation(nullptr, &length);
+		std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+		if (info.empty() || !GetLogicalProcessorInformation(info.data(), &length)) return cache;
+
+		for (const auto& entry : info) {
+			if (entry.Relationship != RelationCache) continue;
+			const CACHE_DESCRIPTOR& descriptor = entry.Cache;
+			if (descriptor.Level == 1 && descriptor.Type != CacheInstruction) {
+				cache.l1Size = descriptor.Size;
+				cache.lineSize = descriptor.LineSize;
+			}
+			else if (descriptor.Level == 2) {
+				cache.l2Size = descriptor.Size;
+			}
+		}
+		return cache;
+	}
+#else
+	// Reads a size like "48K" from sysfs, 0 if it isn't there
+	size_t readSysfsSize(const std::string& path)
+	{
+		std::ifstream file(path);
+		size_t value = 0;
+		std::string suffix;
+		if (!(file >> value)) return 0;
+		file >> suffix;
+		if (suffix == "K") value *= 1024;
+		else if (suffix == "M") value *= 1024 * 1024;
+		return value;
+	}
+
+	CacheGeometry detect()
+	{
+		CacheGeometry cache;
+		long lineSize = 0, l1Size = 0, l2Size = 0;
+#if defined(_SC_LEVEL1_DCACHE_LINESIZE)
+		lineSize = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+		l1Size = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+		l2Size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+		// glibc reports 0 on some architectures, so fall back to sysfs
+		const std::string base = "/sys/devices/system/cpu/cpu0/cache/";
+		if (lineSize <= 0) lineSize = (long)readSysfsSize(base + "index0/coherency_line_size");
+		if (l1Size <= 0) l1Size = (long)readSysfsSize(base + "index0/size");
+		if (l2Size <= 0) l2Size = (long)readSysfsSize(base + "index2/size");
+
+		if (lineSize > 0) cache.lineSize = lineSize;
+		if (l1Size > 0) cache.l1Size = l1Size;
+		if (l2Size > 0) cache.l2Size = l2Size;
+		return cache;
+	}
+#endif
+}
+
+const CacheGeometry& CacheGeometry::host()
+{
+	static const CacheGeometry cache = detect();
+	return cache;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <cstddef>
+#include "OrderedMap.h"
+
+// Data cache sizes of the machine we're running on
+struct CacheGeometry {
+	size_t lineSize = ASSUMED_CACHE_LINE_SIZE;
+	size_t l1Size = ASSUMED_L1_CACHE_SIZE;
+	size_t l2Size = 1024 * 1024;
+
+	// Detected on first use. Anything the OS doesn't report keeps the default.
+	static const CacheGeometry& host();
+};
+
+// Branching factor for OrderedMap<K, V> sized to this machine's caches
+template<typename K, typename V>
+size_t tuned_branching_factor(const CacheGeometry& cache = CacheGeometry::host())
+{
+	return branching_factor_for<K, V>(cache.lineSize, cache.l1Size);
+}
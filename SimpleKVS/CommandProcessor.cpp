@@ -0,0 +1,332 @@
+#include "CommandProcessor.h"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/prefer.hpp>
+#include <charconv>
+#include <cstdint>
+#include <ios>
+
+namespace {
+	std::optional<size_t> parseNumber(const std::string& text)
+	{
+		size_t value = 0;
+		auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+		if (error != std::errc() || end != text.data() + text.size()) return std::nullopt;
+		return value;
+	}
+
+	std::optional<int64_t> parseInteger(const std::string& text)
+	{
+		int64_t value = 0;
+		auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+		if (error != std::errc() || end != text.data() + text.size()) return std::nullopt;
+		return value;
+	}
+}
+
+std::optional<Response> CommandProcessor::execute(Request& request, const ResponseHandler& done)
+{
+	try {
+		return dispatch(request, done);
+	}
+	catch (const std::ios_base::failure& e) {
+		return storageError(e);
+	}
+}
+
+std::optional<Response> CommandProcessor::dispatch(Request& request, const ResponseHandler& done)
+{
+	Response response;
+	auto& args = request.args;
+
+	// Only deletes can make room once the collections fill the budget
+	if (isWrite(request.op) && request.op != Opcode::Del && mDatabase.memoryExhausted()) {
+		return Response::error("Out of memory");
+	}
+
+	switch (request.op) {
+	case Opcode::Get:
+	case Opcode::MGet:
+		return lookup(request, done);
+	case Opcode::Set:
+	case Opcode::MSet:
+	{
+		Collection& collection = mDatabase.addCollection(request.collection);
+		for (size_t i = 0; i + 1 < args.size(); i += 2) {
+			collection.set(std::move(args[i]), std::move(args[i + 1]));
+		}
+		response.results.push_back({ Status::Ok, "" });
+		break;
+	}
+	case Opcode::Del:
+		try {
+			mDatabase.getCollection(request.collection).del(args[0]);
+		}
+		catch (const std::out_of_range&) {
+			// Deleting from a missing collection is a no-op
+		}
+		response.results.push_back({ Status::Ok, "" });
+		break;
+	case Opcode::Count:
+	case Opcode::Rank:
+	case Opcode::Select:
+		return orderStatistic(request, done);
+	case Opcode::Sum:
+	case Opcode::Histogram:
+		return aggregate(request, done);
+	case Opcode::TopKeys:
+		return topKeys(request);
+	case Opcode::Incr:
+	case Opcode::Append:
+	case Opcode::Cas:
+		return readModifyWrite(request);
+	default:
+		return Response::error("Unsupported command");
+	}
+
+	return response;
+}
+
+std::optional<Response> CommandProcessor::lookup(const Request& request, const ResponseHandler& done)
+{
+	bool isMulti = request.op == Opcode::MGet;
+	auto respond = [isMulti](std::vector<Collection::Value> values) {
+		Response response;
+		response.isMulti = isMulti;
+		response.results.reserve(values.size());
+		for (auto& value : values) {
+			if (value) response.results.push_back(Result::value(std::move(value)));
+			else response.results.push_back({ Status::NotFound, "" });
+		}
+		return response;
+	};
+
+	Collection* collection = find(request.collection);
+	if (!collection) return respond(std::vector<Collection::Value>(request.args.size()));
+	if (!collection->valueLog()) {
+		if (isMulti) return respond(collection->multiGet(request.args));
+		Response response;
+		response.results.push_back(get(*collection, request.args[0]));
+		return response;
+	}
+	// Already called on the context
+	auto values = collection->multiGet(request.args, mContext,
+		[done, respond](std::exception_ptr error, std::vector<Collection::Value> values) {
+			done(error ? storageError(error) : respond(std::move(values)));
+		});
+	if (!values) return std::nullopt;
+	return respond(std::move(*values));
+}
+
+Result CommandProcessor::get(Collection& collection, const std::string& key)
+{
+	try {
+		return Result::value(collection.get(key));
+	}
+	catch (const std::out_of_range&) {
+		return { Status::NotFound, "" };
+	}
+}
+
+std::optional<Response> CommandProcessor::orderStatistic(const Request& request, const ResponseHandler& done)
+{
+	const auto& args = request.args;
+	Collection* collection = find(request.collection);
+	Response response;
+
+	if (request.op == Opcode::Select) {
+		std::optional<size_t> offset = parseNumber(args[0]);
+		std::optional<size_t> limit = args.size() > 1 ? parseNumber(args[1]) : 1;
+		if (!offset || !limit) return Response::error("Expected a number");
+		if (*limit > MAX_SELECT_LIMIT) return Response::error("Limit too large");
+
+		auto respond = [](Collection::Entries entries) {
+			Response response;
+			response.isMulti = true;
+			for (auto& [key, value] : entries) {
+				response.results.push_back({ Status::Value, std::move(key) });
+				response.results.push_back(Result::value(std::move(value)));
+			}
+			return response;
+		};
+		if (!collection) return respond({});
+		if (!collection->valueLog()) return respond(collection->select(*offset, *limit));
+		auto entries = collection->select(*offset, *limit, mContext,
+			[done, respond](std::exception_ptr error, Collection::Entries entries) {
+				done(error ? storageError(error) : respond(std::move(entries)));
+			});
+		if (!entries) return std::nullopt;
+		return respond(std::move(*entries));
+	}
+
+	size_t result = 0;
+	if (collection && request.op == Opcode::Count) {
+		result = args.empty() ? collection->size() : collection->count(args[0], args[1]);
+	}
+	else if (collection) {
+		result = collection->rank(args[0]);
+	}
+	response.results.push_back({ Status::Value, std::to_string(result) });
+	return response;
+}
+
+std::optional<Response> CommandProcessor::aggregate(const Request& request, const ResponseHandler& done)
+{
+	const auto& args = request.args;
+	Collection* collection = find(request.collection);
+	Response response;
+
+	if (request.op == Opcode::Sum) {
+		if (!collection) {
+			response.results.push_back({ Status::Value, NumericSum().toString() });
+			return response;
+		}
+		auto reply = [this, done](std::exception_ptr error, NumericSum sum) {
+			if (error) {
+				complete(done, storageError(error));
+				return;
+			}
+			Response response;
+			response.results.push_back({ Status::Value, sum.toString() });
+			complete(done, std::move(response));
+		};
+		if (args.empty()) collection->sum(reply);
+		else collection->sum(args[0], args[1], reply);
+		return std::nullopt;
+	}
+
+	std::optional<size_t> prefixLength = parseNumber(args[0]);
+	if (!prefixLength) return Response::error("Expected a number");
+
+	response.isMulti = true;
+	if (!collection) return response;
+	auto reply = [this, done](std::exception_ptr error, Collection::Histogram histogram) {
+		if (error) {
+			complete(done, storageError(error));
+			return;
+		}
+		if (histogram.size() > MAX_HISTOGRAM_BUCKETS) {
+			complete(done, Response::error("Too many prefixes"));
+			return;
+		}
+		Response response;
+		response.isMulti = true;
+		for (auto& [prefix, count] : histogram) {
+			response.results.push_back({ Status::Value, std::move(prefix) });
+			response.results.push_back({ Status::Value, std::to_string(count) });
+		}
+		complete(done, std::move(response));
+	};
+	if (args.size() == 1) collection->histogram(*prefixLength, MAX_HISTOGRAM_BUCKETS, reply);
+	else collection->histogram(*prefixLength, MAX_HISTOGRAM_BUCKETS, args[1], args[2], reply);
+	return std::nullopt;
+}
+
+void CommandProcessor::complete(const ResponseHandler& done, Response response)
+{
+	// Tracked, so the context keeps running until the response is handled
+	auto executor = boost::asio::prefer(mContext.get_executor(), boost::asio::execution::outstanding_work.tracked);
+	boost::asio::post(executor, [done, response = std::move(response)]() mutable {
+		done(std::move(response));
+	});
+}
+
+Response CommandProcessor::storageError(const std::exception& e)
+{
+	// The value log couldn't be read or written
+	return Response::error(std::string("Storage error: ") + e.what());
+}
+
+Response CommandProcessor::storageError(std::exception_ptr error)
+{
+	try {
+		std::rethrow_exception(error);
+	}
+	catch (const std::exception& e) {
+		return storageError(e);
+	}
+	catch (...) {
+		return Response::error("Storage error");
+	}
+}
+
+Response CommandProcessor::topKeys(const Request& request)
+{
+	std::optional<size_t> count = request.args.empty() ? DEFAULT_TOP_KEYS : parseNumber(request.args[0]);
+	if (!count) return Response::error("Expected a number");
+	if (*count > HotKeyTracker::DEFAULT_CAPACITY) return Response::error("Count too large");
+
+	Response response;
+	response.isMulti = true;
+	Collection* collection = find(request.collection);
+	if (!collection) return response;
+	for (auto& [key, accesses] : collection->topKeys(*count)) {
+		response.results.push_back({ Status::Value, std::move(key) });
+		response.results.push_back({ Status::Value, std::to_string(accesses) });
+	}
+	return response;
+}
+
+Response CommandProcessor::readModifyWrite(Request& request)
+{
+	auto& args = request.args;
+	const std::string& key = args[0];
+	Response response;
+
+	if (request.op == Opcode::Incr) {
+		std::optional<int64_t> delta = args.size() > 1 ? parseInteger(args[1]) : 1;
+		if (!delta) return Response::error("Expected a number");
+		std::string error;
+		mDatabase.addCollection(request.collection).update(key, [&](std::string& value, bool exists) {
+			std::optional<int64_t> number = exists ? parseInteger(value) : 0;
+			if (!number) {
+				error = "Value is not an integer";
+				return false;
+			}
+			if (*delta > 0 ? *number > INT64_MAX - *delta : *number < INT64_MIN - *delta) {
+				error = "Increment would overflow";
+				return false;
+			}
+			value = std::to_string(*number + *delta);
+			response.results.push_back({ Status::Value, value });
+			return true;
+		});
+		if (!error.empty()) return Response::error(error);
+		return response;
+	}
+
+	if (request.op == Opcode::Append) {
+		mDatabase.addCollection(request.collection).update(key, [&](std::string& value, bool exists) {
+			value += args[1];
+			response.results.push_back({ Status::Value, std::to_string(value.size()) });
+			return true;
+		});
+		return response;
+	}
+
+	// CAS never creates a key, so there's nothing to do without the collection
+	Collection* collection = find(request.collection);
+	response.results.push_back({ Status::NotFound, "" });
+	if (!collection) return response;
+	collection->update(key, [&](std::string& value, bool exists) {
+		if (!exists) return false;
+		if (value != args[1]) {
+			response.results[0] = { Status::Value, value };
+			return false;
+		}
+		value = std::move(args[2]);
+		response.results[0] = { Status::Ok, "" };
+		return true;
+	});
+	return response;
+}
+
+Collection* CommandProcessor::find(const std::string& collection)
+{
+	try {
+		return &mDatabase.getCollection(collection);
+	}
+	catch (const std::out_of_range&) {
+		return nullptr;
+	}
+}
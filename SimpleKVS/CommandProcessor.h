@@ -0,0 +1,54 @@
+#pragma once
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/io_context.hpp>
+#include <exception>
+#include <functional>
+#include <optional>
+#include "Database.h"
+#include "Protocol.h"
+
+// Executes decoded requests against a Database.
+// Independent of the wire encoding so every protocol shares one code path.
+class CommandProcessor
+{
+public:
+	// Most entries a single SELECT returns
+	static constexpr size_t MAX_SELECT_LIMIT = 10000;
+	// Most prefixes a HISTOGRAM returns
+	static constexpr size_t MAX_HISTOGRAM_BUCKETS = 10000;
+	// Keys TOPKEYS returns unless asked for a number
+	static constexpr size_t DEFAULT_TOP_KEYS = 10;
+
+	using ResponseHandler = std::function<void(Response response)>;
+
+	// Responses finished in the background are handed back on `context`
+	CommandProcessor(Database& database, boost::asio::io_context& context) :
+		mDatabase{ database },
+		mContext{ context }
+	{}
+
+	// The response, or nullopt if the request runs in the background, see
+	// Collection::sum. `done` gets the response on the context then.
+	std::optional<Response> execute(Request& request, const ResponseHandler& done);
+private:
+	std::optional<Response> dispatch(Request& request, const ResponseHandler& done);
+	// GET and MGET, which read values in a value log in the background
+	std::optional<Response> lookup(const Request& request, const ResponseHandler& done);
+	Result get(Collection& collection, const std::string& key);
+	std::optional<Response> orderStatistic(const Request& request, const ResponseHandler& done);
+	// SUM and HISTOGRAM, which scan the range on the workers
+	std::optional<Response> aggregate(const Request& request, const ResponseHandler& done);
+	// Passes the response to `done` on the context, from a worker
+	void complete(const ResponseHandler& done, Response response);
+	static Response storageError(const std::exception& e);
+	// Same for an exception passed to a handler, which must be a storage error
+	static Response storageError(std::exception_ptr error);
+	Response topKeys(const Request& request);
+	// INCR, APPEND and CAS, which change the value where it is
+	Response readModifyWrite(Request& request);
+	// The collection, or nullptr if it doesn't exist
+	Collection* find(const std::string& collection);
+
+	Database& mDatabase;
+	boost::asio::io_context& mContext;
+};
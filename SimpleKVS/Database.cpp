@@ -1,26 +1,917 @@
 #include "Database.h"
 
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <ios>
+#include <iostream>
+
+namespace {
+	// Tags of stored values when there's a value log
+	constexpr char INLINE_VALUE = 0;
+	constexpr char SEPARATED_VALUE = 1;
+
+	// Collection names come from clients, keep them from escaping the data
+	// directory
+	std::string fileStem(const std::string& collection)
+	{
+		std::string name;
+		for (char c : collection.substr(0, 64)) {
+			name += isalnum((unsigned char)c) || c == '-' || c == '_' ? c : '_';
+		}
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), "-%016llx", (unsigned long long)std::hash<std::string>{}(collection));
+		return name + suffix;
+	}
+
+	// Starts an aggregation with `start`, which takes its handler, and waits
+	// for the result
+	template<typename T, typename Start>
+	T wait(Start start)
+	{
+		auto result = std::make_shared<std::promise<T>>();
+		auto future = result->get_future();
+		start([result](std::exception_ptr error, T value) {
+			if (error) result->set_exception(error);
+			else result->set_value(std::move(value));
+		});
+		return future.get();
+	}
+
+	std::string runFileName(const std::string& collection, uint64_t sequence)
+	{
+		char suffix[32];
+		snprintf(suffix, sizeof(suffix), ".%06llu.run", (unsigned long long)sequence);
+		return fileStem(collection) + suffix;
+	}
+
+	void putU32(std::string& out, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++) {
+			out += (char)(value >> (8 * i));
+		}
+	}
+
+	uint32_t getU32(const char* in)
+	{
+		uint32_t value = 0;
+		for (int i = 0; i < 4; i++) {
+			value |= (uint32_t)(uint8_t)in[i] << (8 * i);
+		}
+		return value;
+	}
+
+	uint64_t getU64(const char* in)
+	{
+		uint64_t value = 0;
+		for (int i = 0; i < 8; i++) {
+			value |= (uint64_t)(uint8_t)in[i] << (8 * i);
+		}
+		return value;
+	}
+
+	std::string encodePointer(const ValuePointer& pointer)
+	{
+		std::string stored(1, SEPARATED_VALUE);
+		putU32(stored, pointer.segment);
+		putU32(stored, pointer.length);
+		putU32(stored, (uint32_t)pointer.offset);
+		putU32(stored, (uint32_t)(pointer.offset >> 32));
+		return stored;
+	}
+
+	ValuePointer decodePointer(const std::string& stored)
+	{
+		uint64_t low = getU64(stored.data() + 1);
+		return { (uint32_t)low, (uint32_t)(low >> 32), getU64(stored.data() + 9) };
+	}
+
+	bool isSeparated(const std::string& stored)
+	{
+		return !stored.empty() && stored[0] == SEPARATED_VALUE;
+	}
+
+	// Held by deleted keys in write buffers
+	const Collection::Value& emptyValue()
+	{
+		static const Collection::Value empty = std::make_shared<const std::string>();
+		return empty;
+	}
+
+	// Starts every run, followed by the collection name's length as a
+	// little-endian u32 and the name
+	constexpr char RUN_MAGIC[] = "SKVSRUN1";
+	constexpr size_t RUN_MAGIC_SIZE = sizeof(RUN_MAGIC) - 1;
+	constexpr size_t RUN_RECORD_HEADER_SIZE = 9;
+
+	// Writes a run to a temporary file, which only takes the run's name once
+	// it's complete, so a run on disk is never partial
+	class RunWriter
+	{
+	public:
+		RunWriter(std::filesystem::path path, const std::string& collection) :
+			mPath { std::move(path) },
+			mFile(temporary(), std::ios::binary | std::ios::trunc)
+		{
+			mFile.exceptions(std::ios::failbit | std::ios::badbit);
+			mRecord.assign(RUN_MAGIC, RUN_MAGIC_SIZE);
+			putU32(mRecord, (uint32_t)collection.size());
+			mRecord += collection;
+			mFile.write(mRecord.data(), mRecord.size());
+		}
+
+		void write(bool isDeleted, const std::string& key, const std::string& value)
+		{
+			mRecord.clear();
+			mRecord += (char)isDeleted;
+			putU32(mRecord, (uint32_t)key.size());
+			putU32(mRecord, (uint32_t)value.size());
+			mRecord += key;
+			mRecord += value;
+			mFile.write(mRecord.data(), mRecord.size());
+		}
+
+		void commit()
+		{
+			mFile.close();
+			std::filesystem::rename(temporary(), mPath);
+		}
+	private:
+		std::filesystem::path temporary() const
+		{
+			auto path = mPath;
+			return path.replace_extension(".tmp");
+		}
+
+		std::filesystem::path mPath;
+		std::ofstream mFile;
+		std::string mRecord;
+	};
+
+	// Reads a run back one entry at a time
+	class RunReader
+	{
+	public:
+		RunReader(const std::filesystem::path& path) :
+			mFile(path, std::ios::binary)
+		{
+			char header[RUN_MAGIC_SIZE + 4];
+			if (!mFile.read(header, sizeof(header)) || memcmp(header, RUN_MAGIC, RUN_MAGIC_SIZE) != 0) return;
+			mCollection.resize(getU32(header + RUN_MAGIC_SIZE));
+			mIsValid = (bool)mFile.read(mCollection.data(), mCollection.size());
+		}
+
+		// False if the file isn't a run
+		bool isValid() const { return mIsValid; }
+		const std::string& collection() const { return mCollection; }
+
+		// Moves to the next entry. False at the end of the run.
+		bool next()
+		{
+			char header[RUN_RECORD_HEADER_SIZE];
+			if (!mFile.read(header, sizeof(header))) return false;
+			isDeleted = header[0] != 0;
+			key.resize(getU32(header + 1));
+			value.resize(getU32(header + 5));
+			return mFile.read(key.data(), key.size()) && mFile.read(value.data(), value.size());
+		}
+
+		bool isDeleted = false;
+		std::string key;
+		std::string value;
+	private:
+		std::ifstream mFile;
+		std::string mCollection;
+		bool mIsValid = false;
+	};
+
+	// The sequence number of a run file, or nullopt if it isn't one
+	std::optional<uint64_t> runSequence(const std::filesystem::path& path)
+	{
+		if (path.extension() != ".run") return std::nullopt;
+		std::string stem = path.stem().string();
+		size_t dot = stem.rfind('.');
+		if (dot == std::string::npos) return std::nullopt;
+		uint64_t sequence = 0;
+		auto [end, error] = std::from_chars(stem.data() + dot + 1, stem.data() + stem.size(), sequence);
+		if (error != std::errc() || end != stem.data() + stem.size()) return std::nullopt;
+		return sequence;
+	}
+}
+
+void NumericSum::add(std::string_view value) {
+	const char* end = value.data() + value.size();
+	int64_t number = 0;
+	auto parsed = std::from_chars(value.data(), end, number);
+	if (parsed.ec == std::errc() && parsed.ptr == end) {
+		bool overflows = number > 0 ? integer > INT64_MAX - number : integer < INT64_MIN - number;
+		if (!overflows) {
+			integer += number;
+			values++;
+			return;
+		}
+	}
+	// Not an integer, or too large to add exactly
+	double real = 0;
+	parsed = std::from_chars(value.data(), end, real);
+	if (parsed.ec != std::errc() || parsed.ptr != end || !std::isfinite(real)) return;
+	this->real += real;
+	isReal = true;
+	values++;
+}
+
+void NumericSum::add(const NumericSum& other) {
+	bool overflows = other.integer > 0 ? integer > INT64_MAX - other.integer : integer < INT64_MIN - other.integer;
+	if (overflows) {
+		real += (double)other.integer;
+		isReal = true;
+	}
+	else {
+		integer += other.integer;
+	}
+	real += other.real;
+	isReal = isReal || other.isReal;
+	values += other.values;
+}
+
+std::string NumericSum::toString() const {
+	if (!isReal) return std::to_string(integer);
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.17g", (double)integer + real);
+	return buffer;
+}
+
+Collection::Map& Collection::writeBuffer() {
+	if (!mWriteBuffer) {
+		mWriteBuffer = new Map(mOptions.branching_factor());
+	}
+	return *mWriteBuffer;
+}
+
+void Collection::openValueLog() {
+	mValueLog = std::make_unique<ValueLog>(mOptions.valueLogDirectory, fileStem(mName), mEngine, mOptions.valueLogSegmentSize);
+}
+
+std::string Collection::store(const std::string& key, std::string value) {
+	if (value.size() < mOptions.valueLogThreshold) {
+		value.insert(value.begin(), INLINE_VALUE);
+		return value;
+	}
+	return encodePointer(mValueLog->append(key, value));
+}
+
+std::string Collection::load(const std::string& stored) const {
+	if (!mValueLog) return stored;
+	if (isSeparated(stored)) return mValueLog->read(decodePointer(stored));
+	return stored.substr(1);
+}
+
+Collection::Value Collection::load(const Value& stored) const {
+	// Only values under the value log threshold are copied out of their tag
+	if (!mValueLog) return stored;
+	return std::make_shared<const std::string>(load(*stored));
+}
+
+void Collection::release(const std::string& stored) {
+	if (isSeparated(stored)) mValueLog->release(decodePointer(stored));
+}
+
+const std::string* Collection::stored(const std::string& key) const {
+	Leaf* leaf = mCache.find_leaf(key);
+	ptrdiff_t i = leaf ? leaf->leaf_position(key) : -1;
+	if (i < 0 || leaf->mChildren[i].value.isDeleted) return nullptr;
+	return leaf->mChildren[i].value.value.get();
+}
+
+uint64_t Collection::collectGarbage() {
+	std::optional<uint32_t> segment = mValueLog ? mValueLog->collectable() : std::nullopt;
+	if (!segment) return 0;
+	uint64_t rewritten = 0;
+	bool isComplete = mValueLog->scan(*segment, [&](const std::string& key, const ValuePointer& pointer, std::string_view value) {
+		std::lock_guard<std::mutex> lock(mMutex);
+		// The workers read the values out of mCache
+		if (scanning()) return false;
+		const std::string* current = stored(key);
+		if (!current || !isSeparated(*current) || decodePointer(*current) != pointer) return true;
+		// Also logged, so the runs follow the value to its new place
+		auto moved = std::make_shared<const std::string>(encodePointer(mValueLog->append(key, value)));
+		mValueLog->release(pointer);
+		rewritten += ValueLog::RECORD_HEADER_SIZE + key.size() + value.size();
+		mCache.update(key, [&](Value& entry, bool exists) { entry = moved; return true; });
+		writeBuffer().set(key, std::move(moved));
+		if (mWriteBuffer->memory_usage() >= mOptions.writeBufferSize) sealBuffer();
+		track();
+		return true;
+	});
+	if (!isComplete) return 0;
+
+	// Runs written so far may still point into the segment, for the values
+	// that moved and for keys whose later writes aren't flushed yet. Once the
+	// last buffer sealed now is flushed, none do.
+	std::lock_guard<std::mutex> lock(mMutex);
+	sealBuffer();
+	uint64_t size = mValueLog->retire(*segment);
+	bool isFlushed;
+	{
+		std::lock_guard<std::mutex> sealedLock(mSealedMutex);
+		isFlushed = mSealedBuffers.empty();
+		if (!isFlushed) mRetireAfter = mSealedBuffers.back();
+	}
+	if (isFlushed) mValueLog->dropRetired();
+	return size - (std::min)(rewritten, size);
+}
+
+void Collection::syncValueLog() {
+	if (mValueLog) mValueLog->sync();
+}
+
+void Collection::recountGarbage() {
+	if (!mValueLog) return;
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::unordered_map<uint32_t, uint64_t> live;
+	for (auto it = mCache.begin(); it != mCache.end(); ++it) {
+		if (it->isDeleted || !isSeparated(*it->second)) continue;
+		ValuePointer pointer = decodePointer(*it->second);
+		live[pointer.segment] += pointer.length;
+	}
+	mValueLog->recount(live);
+}
+
 void Collection::set(std::string key, std::string value) {
-	if (mWriteBuffers.size() == 0) {
-		mWriteBuffers.push_back(new OrderedMap<std::string, std::string>());
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mHotKeys) mHotKeys->record(key);
+	if (mValueLog) {
+		if (auto old = stored(key)) release(*old);
+		value = store(key, std::move(value));
+	}
+	auto shared = std::make_shared<const std::string>(std::move(value));
+	writeBuffer().set(key, shared);
+	if (mWriteBuffer->memory_usage() >= mOptions.writeBufferSize) sealBuffer();
+	if (!mIndex) {
+		mCache.set(std::move(key), std::move(shared));
+	}
+	else {
+		Leaf* splitLeaf = nullptr;
+		Leaf* leaf = mCache.set(key, std::move(shared), false, &splitLeaf);
+		index(key, leaf, splitLeaf);
+	}
+	track();
+}
+
+void Collection::index(const std::string& key, Leaf* leaf, Leaf* splitLeaf) {
+	mIndex->insert(hash(key), leaf);
+	if (!splitLeaf) return;
+	// Keys that moved to the new leaf still point at the old one
+	for (size_t i = 0; i < splitLeaf->mSize; i++) {
+		mIndex->insert(hash(splitLeaf->mKeys[i]), splitLeaf);
 	}
-	mWriteBuffers.back()->set(key, value);
-	mCache.set(key, value);
 }
 
-const std::string Collection::get(std::string value) {
+Collection::Value Collection::get(std::string value) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mHotKeys) mHotKeys->record(value);
 	bool isDeleted = false;
-	std::string result = mCache.at(value, &isDeleted);
+	Value result;
+	if (mIndex) {
+		Leaf** leaf = mIndex->find(hash(value));
+		if (!leaf) {
+			throw std::out_of_range("Key not found");
+		}
+		ptrdiff_t i = (*leaf)->leaf_position(value);
+		if (i >= 0) {
+			isDeleted = (*leaf)->mChildren[i].value.isDeleted;
+			result = (*leaf)->mChildren[i].value.value;
+		}
+		else {
+			// Another key with the same hash owns the entry
+			result = mCache.at(value, &isDeleted);
+		}
+	}
+	else {
+		result = mCache.at(value, &isDeleted);
+	}
 	if (isDeleted) {
 		throw std::out_of_range("Key has been deleted");
 	}
-	return result;
+	return load(result);
+}
+
+std::vector<Collection::Value> Collection::multiGet(const std::vector<std::string>& keys) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::vector<Value> values = findStored(keys);
+	for (auto& value : values) {
+		if (value) value = load(value);
+	}
+	return values;
+}
+
+std::optional<std::vector<Collection::Value>> Collection::multiGet(const std::vector<std::string>& keys,
+	boost::asio::io_context& context, ValuesHandler done) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return loadAsync(findStored(keys), context, std::move(done));
+}
+
+std::optional<std::vector<Collection::Value>> Collection::loadAsync(std::vector<Value> values,
+	boost::asio::io_context& context, ValuesHandler done) const {
+	std::vector<size_t> separated;
+	for (size_t i = 0; i < values.size(); i++) {
+		if (!values[i]) continue;
+		if (mValueLog && isSeparated(*values[i])) separated.push_back(i);
+		else values[i] = load(values[i]);
+	}
+	if (separated.empty()) return values;
+
+	// Shared by the reads, the last one to finish passes the values on
+	struct Reads {
+		std::vector<Value> values;
+		ValuesHandler done;
+		std::atomic<size_t> remaining;
+		std::mutex errorMutex;
+		std::exception_ptr error;
+	};
+	auto reads = std::make_shared<Reads>();
+	reads->values = std::move(values);
+	reads->done = std::move(done);
+	reads->remaining = separated.size();
+	for (size_t i : separated) {
+		mValueLog->read(decodePointer(*reads->values[i]), context,
+			[reads, i](const boost::system::error_code& error, std::string value) {
+				if (error) {
+					std::lock_guard<std::mutex> lock(reads->errorMutex);
+					if (!reads->error) {
+						reads->error = std::make_exception_ptr(std::ios_base::failure("Reading the value log failed: " + error.message()));
+					}
+				}
+				else {
+					reads->values[i] = std::make_shared<const std::string>(std::move(value));
+				}
+				if (reads->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+				reads->done(reads->error, std::move(reads->values));
+			});
+	}
+	mValueLog->submit();
+	return std::nullopt;
+}
+
+std::vector<Collection::Value> Collection::findStored(const std::vector<std::string>& keys) {
+	std::vector<Value> values(keys.size());
+	auto resolve = [&](size_t i, const OrderedMapNodeValue<Value>* entry) {
+		if (entry && !entry->isDeleted) values[i] = entry->value;
+	};
+	if (mHotKeys) {
+		for (const auto& key : keys) mHotKeys->record(key);
+	}
+
+	if (mIndex) {
+		// Interleaved: every probe's buckets are fetched before the first is
+		// read, and every leaf before the first is searched
+		std::vector<uint64_t> hashes(keys.size());
+		for (size_t i = 0; i < keys.size(); i++) {
+			hashes[i] = hash(keys[i]);
+			mIndex->prefetch(hashes[i]);
+		}
+		std::vector<Leaf*> leaves(keys.size());
+		for (size_t i = 0; i < keys.size(); i++) {
+			Leaf** leaf = mIndex->find(hashes[i]);
+			leaves[i] = leaf ? *leaf : nullptr;
+			if (leaves[i]) leaves[i]->prefetch_entries();
+		}
+		for (size_t i = 0; i < keys.size(); i++) {
+			if (!leaves[i]) continue;
+			ptrdiff_t position = leaves[i]->leaf_position(keys[i]);
+			// Otherwise another key with the same hash owns the entry
+			if (position < 0) leaves[i] = mCache.find_leaf(keys[i]);
+			position = leaves[i] ? leaves[i]->leaf_position(keys[i]) : -1;
+			if (position >= 0) resolve(i, &leaves[i]->mChildren[position].value);
+		}
+		return values;
+	}
+
+	std::vector<size_t> order(keys.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+	std::vector<const std::string*> sorted(keys.size());
+	for (size_t i = 0; i < order.size(); i++) sorted[i] = &keys[order[i]];
+	mCache.find_sorted(sorted.data(), sorted.size(), [&](size_t i, const OrderedMapNodeValue<Value>* entry) {
+		resolve(order[i], entry);
+	});
+	return values;
 }
 
 void Collection::del(std::string key) {
-	mCache.del(key);
-	bool isDeleted = mWriteBuffers.back()->del(key);
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mValueLog) {
+		if (auto old = stored(key)) release(*old);
+	}
+	// The value is dropped too, so deletes free memory
+	if (mCache.del(key)) mCache.set(key, emptyValue(), true);
+	bool isDeleted = writeBuffer().del(key);
 	if (!isDeleted) {
-		mWriteBuffers.back()->set(key, "", true);
+		mWriteBuffer->set(key, emptyValue(), true);
+		if (mWriteBuffer->memory_usage() >= mOptions.writeBufferSize) sealBuffer();
+	}
+	track();
+}
+
+bool Collection::update(const std::string& key, const std::function<bool(std::string& value, bool exists)>& modify) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mHotKeys) mHotKeys->record(key);
+	// The write buffer gets the result rather than the operation, since the
+	// cache already resolves it. Values are shared, so the change is made on
+	// a copy that replaces it.
+	Value result;
+	bool inserted = false;
+	auto apply = [&](Value& value, bool exists) {
+		std::string modified = exists ? load(*value) : std::string();
+		if (!modify(modified, exists)) return false;
+		if (mValueLog) {
+			if (exists) release(*value);
+			modified = store(key, std::move(modified));
+		}
+		value = std::make_shared<const std::string>(std::move(modified));
+		result = value;
+		inserted = !exists;
+		return true;
+	};
+	Leaf* splitLeaf = nullptr;
+	Leaf* leaf = mCache.update(key, apply, mIndex ? &splitLeaf : nullptr);
+	if (!leaf) return false;
+	// Keys that were already live haven't moved
+	if (mIndex && inserted) index(key, leaf, splitLeaf);
+
+	writeBuffer().set(key, std::move(result));
+	if (mWriteBuffer->memory_usage() >= mOptions.writeBufferSize) sealBuffer();
+	track();
+	return true;
+}
+
+void Collection::replay(std::string key, std::string value, bool isDeleted) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mValueLog) {
+		if (auto old = stored(key)) release(*old);
+	}
+	if (isDeleted) {
+		if (mCache.del(key)) mCache.set(key, emptyValue(), true);
+	}
+	else if (!mIndex) {
+		mCache.set(std::move(key), std::make_shared<const std::string>(std::move(value)));
+	}
+	else {
+		Leaf* splitLeaf = nullptr;
+		Leaf* leaf = mCache.set(key, std::make_shared<const std::string>(std::move(value)), false, &splitLeaf);
+		index(key, leaf, splitLeaf);
+	}
+	track();
+}
+
+Collection::Entries Collection::select(size_t n, size_t limit) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	Entries entries;
+	for (auto it = mCache.select(n); it != mCache.end() && entries.size() < limit; ++it) {
+		if (it->isDeleted) continue;
+		entries.emplace_back(it->first, load(it->second));
+	}
+	return entries;
+}
+
+std::optional<Collection::Entries> Collection::select(size_t n, size_t limit, boost::asio::io_context& context,
+	EntriesHandler done) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::vector<std::string> keys;
+	std::vector<Value> values;
+	for (auto it = mCache.select(n); it != mCache.end() && keys.size() < limit; ++it) {
+		if (it->isDeleted) continue;
+		keys.push_back(it->first);
+		values.push_back(it->second);
+	}
+	auto entries = [](std::vector<std::string> keys, std::vector<Value> values) {
+		Entries entries;
+		entries.reserve(keys.size());
+		for (size_t i = 0; i < keys.size(); i++) {
+			entries.emplace_back(std::move(keys[i]), std::move(values[i]));
+		}
+		return entries;
+	};
+	auto loaded = loadAsync(std::move(values), context,
+		[keys, entries, done = std::move(done)](std::exception_ptr error, std::vector<Value> values) {
+			done(error, error ? Entries() : entries(keys, std::move(values)));
+		});
+	if (!loaded) return std::nullopt;
+	return entries(std::move(keys), std::move(*loaded));
+}
+
+NumericSum Collection::sum() const {
+	return wait<NumericSum>([this](SumHandler done) { sum(std::move(done)); });
+}
+
+NumericSum Collection::sum(const std::string& lo, const std::string& hi) const {
+	return wait<NumericSum>([&](SumHandler done) { sum(lo, hi, std::move(done)); });
+}
+
+Collection::Histogram Collection::histogram(size_t prefixLength, size_t maxBuckets) const {
+	return wait<Histogram>([&](HistogramHandler done) { histogram(prefixLength, maxBuckets, std::move(done)); });
+}
+
+Collection::Histogram Collection::histogram(size_t prefixLength, size_t maxBuckets, const std::string& lo, const std::string& hi) const {
+	return wait<Histogram>([&](HistogramHandler done) { histogram(prefixLength, maxBuckets, lo, hi, std::move(done)); });
+}
+
+void Collection::sumRange(size_t first, size_t total, SumHandler done) const {
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mScans++;
+	}
+	parallel_reduce_async(mCache, first, total, mOptions.scan_threads(), NumericSum(),
+		[this](NumericSum& sum, const std::string& key, const Value& value) {
+			if (!mValueLog) sum.add(*value);
+			else if (!isSeparated(*value)) sum.add(std::string_view(*value).substr(1));
+			else sum.add(load(*value));
+		},
+		[](NumericSum& sum, NumericSum&& partial) { sum.add(partial); },
+		[this, done = std::move(done)](std::exception_ptr error, NumericSum&& sum) {
+			mScans--;
+			done(error, std::move(sum));
+		});
+}
+
+void Collection::histogramRange(size_t prefixLength, size_t maxBuckets, size_t first, size_t total, HistogramHandler done) const {
+	// Keys sharing a prefix are adjacent, so a run only ever extends its last
+	// bucket or starts a new one
+	auto add = [prefixLength, maxBuckets](Histogram& histogram, std::string_view prefix, size_t count) {
+		if (!histogram.empty() && histogram.back().first == prefix) {
+			histogram.back().second += count;
+		}
+		else if (histogram.size() <= maxBuckets) {
+			histogram.emplace_back(prefix, count);
+		}
+	};
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mScans++;
+	}
+	parallel_reduce_async(mCache, first, total, mOptions.scan_threads(), Histogram(),
+		[add, prefixLength](Histogram& histogram, const std::string& key, const Value& value) {
+			add(histogram, std::string_view(key).substr(0, prefixLength), 1);
+		},
+		[add](Histogram& histogram, Histogram&& partial) {
+			for (auto& [prefix, count] : partial) {
+				add(histogram, prefix, count);
+			}
+		},
+		[this, done = std::move(done)](std::exception_ptr error, Histogram&& histogram) {
+			mScans--;
+			done(error, std::move(histogram));
+		});
+}
+
+size_t Collection::memoryUsage() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	size_t bytes = residentBytes();
+	std::lock_guard<std::mutex> sealedLock(mSealedMutex);
+	for (auto b : mSealedBuffers) {
+		bytes += b->memory_usage();
+	}
+	return bytes;
+}
+
+size_t Collection::residentMemoryUsage() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return residentBytes();
+}
+
+size_t Collection::residentBytes() const {
+	size_t bytes = mCache.memory_usage();
+	if (mWriteBuffer) bytes += mWriteBuffer->memory_usage();
+	if (mIndex) bytes += mIndex->capacity() * (1 + sizeof(uint64_t) + sizeof(Leaf*));
+	return bytes;
+}
+
+void Collection::track() {
+	if (!mBudget) return;
+	size_t resident = residentBytes();
+	mBudget->resize(mResident, resident);
+	mResident = resident;
+}
+
+size_t Collection::sealedBuffers() const {
+	std::lock_guard<std::mutex> lock(mSealedMutex);
+	return mSealedBuffers.size();
+}
+
+void Collection::seal() {
+	std::lock_guard<std::mutex> lock(mMutex);
+	sealBuffer();
+}
+
+void Collection::sealBuffer() {
+	if (!mWriteBuffer || mWriteBuffer->begin() == mWriteBuffer->end()) return;
+	if (mBudget) mBudget->seal(mWriteBuffer->memory_usage());
+	{
+		std::lock_guard<std::mutex> lock(mSealedMutex);
+		mSealedBuffers.push_back(mWriteBuffer);
+	}
+	mWriteBuffer = nullptr;
+	track();
+	if (mOnSeal) mOnSeal(*this);
+}
+
+bool Collection::flush(const std::function<void(const Map&)>& sink) {
+	Map* buffer;
+	{
+		std::lock_guard<std::mutex> lock(mSealedMutex);
+		if (mSealedBuffers.empty()) return false;
+		buffer = mSealedBuffers.front();
+	}
+	if (sink) sink(*buffer);
+	bool dropsRetired;
+	{
+		std::lock_guard<std::mutex> lock(mSealedMutex);
+		mSealedBuffers.pop_front();
+		dropsRetired = buffer == mRetireAfter;
+		if (dropsRetired) mRetireAfter = nullptr;
+	}
+	// No run points into the retired segments anymore
+	if (dropsRetired) mValueLog->dropRetired();
+	if (mBudget) mBudget->release(buffer->memory_usage());
+	delete buffer;
+	return true;
+}
+
+Database::Database(DatabaseOptions options) :
+	mOptions { std::move(options) },
+	mBudget { mOptions.memoryBudget }
+{
+	auto& defaults = mOptions.collectionDefaults;
+	if (defaults.valueLogDirectory.empty()) defaults.valueLogDirectory = mOptions.dataDirectory;
+	if (defaults.valueLogThreshold && !defaults.valueLogDirectory.empty()) mEngine = IOEngine::create();
+	if (!mOptions.dataDirectory.empty()) {
+		std::filesystem::create_directories(mOptions.dataDirectory);
+		recover();
+	}
+	mFlusher = std::thread([this]() { runFlushes(); });
+}
+
+Database::~Database() {
+	// The active write buffers are flushed too, so every write is in a run
+	for (auto& [name, collection] : mCollections) {
+		collection.seal();
+	}
+	{
+		std::lock_guard<std::mutex> lock(mFlushMutex);
+		mStopping = true;
+	}
+	mFlushReady.notify_one();
+	mFlusher.join();
+}
+
+void Database::scheduleFlush(Collection& collection) {
+	{
+		std::lock_guard<std::mutex> lock(mFlushMutex);
+		mFlushQueue.push_back(&collection);
+	}
+	mFlushReady.notify_one();
+}
+
+void Database::waitForFlushes() {
+	std::unique_lock<std::mutex> lock(mFlushMutex);
+	mFlushDone.wait(lock, [this]() { return mFlushQueue.empty(); });
+}
+
+void Database::runFlushes() {
+	std::unique_lock<std::mutex> lock(mFlushMutex);
+	for (;;) {
+		mFlushReady.wait(lock, [this]() { return mStopping || !mFlushQueue.empty(); });
+		// Finish what was sealed before stopping
+		if (mFlushQueue.empty()) return;
+		Collection* collection = mFlushQueue.front();
+		lock.unlock();
+
+		bool failed = false;
+		try {
+			collection->flush([&](const Collection::Map& buffer) {
+				// The run may only point at values that are on disk
+				collection->syncValueLog();
+				writeRun(*collection, buffer);
+			});
+			compactRuns(*collection);
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Flushing " << collection->name() << " failed: " << e.what() << std::endl;
+			failed = true;
+		}
+		try {
+			if (!failed) collection->collectGarbage();
+		}
+		catch (const std::exception& e) {
+			std::cerr << "Collecting garbage in " << collection->name() << " failed: " << e.what() << std::endl;
+		}
+
+		lock.lock();
+		if (failed && !mStopping) {
+			// The buffer stays sealed, and writes stall if this keeps up
+			mFlushReady.wait_for(lock, FLUSH_RETRY_DELAY, [this]() { return mStopping; });
+			continue;
+		}
+		mFlushQueue.pop_front();
+		if (mFlushQueue.empty()) mFlushDone.notify_all();
+	}
+}
+
+// A run starts with a header naming the collection, see RUN_MAGIC. Then come
+// the buffer's entries in key order, each as a deleted flag byte, the key
+// and value lengths as little-endian u32s, then the key and value. With a
+// value log, values are written as stored, see Collection::store.
+void Database::writeRun(const Collection& collection, const Collection::Map& buffer) {
+	if (mOptions.dataDirectory.empty()) return;
+
+	uint64_t sequence = mRunSequence++;
+	RunWriter run(std::filesystem::path(mOptions.dataDirectory) / runFileName(collection.name(), sequence), collection.name());
+	for (auto it = buffer.begin(); it != buffer.end(); ++it) {
+		run.write(it->isDeleted, it->first, *it->second);
+	}
+	run.commit();
+	mRuns[collection.name()].push_back(sequence);
+}
+
+void Database::compactRuns(const Collection& collection) {
+	auto& sequences = mRuns[collection.name()];
+	if (sequences.size() < COMPACTION_RUNS) return;
+
+	auto directory = std::filesystem::path(mOptions.dataDirectory);
+	std::vector<std::unique_ptr<RunReader>> runs;
+	std::vector<bool> hasEntry;
+	for (uint64_t sequence : sequences) {
+		runs.push_back(std::make_unique<RunReader>(directory / runFileName(collection.name(), sequence)));
+		if (!runs.back()->isValid()) throw std::ios_base::failure("Can't read run " + std::to_string(sequence));
+		hasEntry.push_back(runs.back()->next());
+	}
+
+	// Merged in key order. Of the entries for a key, the one from the newest
+	// run wins, and deleted keys are dropped since no older run is left.
+	uint64_t merged = mRunSequence++;
+	RunWriter output(directory / runFileName(collection.name(), merged), collection.name());
+	for (;;) {
+		const std::string* key = nullptr;
+		size_t newest = 0;
+		for (size_t i = 0; i < runs.size(); i++) {
+			if (hasEntry[i] && (!key || runs[i]->key <= *key)) {
+				key = &runs[i]->key;
+				newest = i;
+			}
+		}
+		if (!key) break;
+		std::string current = *key;
+		if (!runs[newest]->isDeleted) output.write(false, current, runs[newest]->value);
+		for (size_t i = 0; i < runs.size(); i++) {
+			if (hasEntry[i] && runs[i]->key == current) hasEntry[i] = runs[i]->next();
+		}
+	}
+	output.commit();
+	runs.clear();
+
+	// Loading the old runs too would still give the same result, so a crash
+	// between these leaves nothing wrong behind
+	for (uint64_t sequence : sequences) {
+		std::filesystem::remove(directory / runFileName(collection.name(), sequence));
+	}
+	sequences = { merged };
+}
+
+void Database::recover() {
+	std::vector<std::pair<uint64_t, std::filesystem::path>> runs;
+	for (const auto& entry : std::filesystem::directory_iterator(mOptions.dataDirectory)) {
+		const auto& path = entry.path();
+		if (path.extension() == ".tmp") {
+			// A run that was never completed
+			std::filesystem::remove(path);
+		}
+		else if (auto sequence = runSequence(path)) {
+			runs.emplace_back(*sequence, path);
+		}
+	}
+	std::sort(runs.begin(), runs.end());
+
+	for (const auto& [sequence, path] : runs) {
+		RunReader run(path);
+		if (!run.isValid()) {
+			std::cerr << "Skipping " << path.string() << ", it isn't a run" << std::endl;
+			continue;
+		}
+		Collection& collection = addCollection(run.collection());
+		while (run.next()) {
+			collection.replay(std::move(run.key), std::move(run.value), run.isDeleted);
+		}
+		mRuns[run.collection()].push_back(sequence);
+		mRunSequence = sequence + 1;
+	}
+	for (auto& [name, collection] : mCollections) {
+		collection.recountGarbage();
 	}
 }
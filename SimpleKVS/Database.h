@@ -1,14 +1,125 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+#include "CacheGeometry.h"
+#include "HashIndex.h"
+#include "HotKeys.h"
+#include "MemoryBudget.h"
 #include "OrderedMap.h"
+#include "ParallelScan.h"
+#include "ValueLog.h"
+
+struct CollectionOptions {
+	// Keep a hash index from keys to leaves, so point lookups skip the tree
+	// descent. Costs roughly 16 bytes per key.
+	bool hashIndex = false;
+	// Node capacity of the collection's trees, 0 picks one from the host's
+	// cache geometry
+	size_t branchingFactor = 0;
+	// Bytes the active write buffer may reach before it's sealed and queued
+	// for flushing
+	size_t writeBufferSize = 64 * 1024 * 1024;
+	// Threads an aggregation scans with, 0 uses one per core
+	size_t scanThreads = 0;
+	// One in this many reads and writes is sampled for TOPKEYS, 0 turns hot
+	// key tracking off
+	uint32_t hotKeySampling = 16;
+	// Values of at least this many bytes are kept in a value log in
+	// valueLogDirectory, and the trees only hold where they are. 0 keeps
+	// every value in the trees.
+	size_t valueLogThreshold = 0;
+	// Defaults to the database's data directory
+	std::string valueLogDirectory;
+	uint64_t valueLogSegmentSize = ValueLog::DEFAULT_SEGMENT_SIZE;
+
+	size_t branching_factor() const
+	{
+		return branchingFactor ? branchingFactor : tuned_branching_factor<std::string, std::shared_ptr<const std::string>>();
+	}
+
+	size_t scan_threads() const
+	{
+		return scanThreads ? scanThreads : (std::max)(std::thread::hardware_concurrency(), 1u);
+	}
+};
+
+// Sum of numeric values. Integers are added exactly while the total fits in
+// 64 bits, anything else is added as a double.
+struct NumericSum {
+	int64_t integer = 0;
+	double real = 0;
+	bool isReal = false;
+	// Number of values added
+	size_t values = 0;
+
+	// Adds the value if it's a number
+	void add(std::string_view value);
+	void add(const NumericSum& other);
+	std::string toString() const;
+};
+
+struct DatabaseOptions {
+	CollectionOptions collectionDefaults;
+	// Bytes the collections may hold in memory, see MemoryBudget. Writes slow
+	// down as sealed write buffers fill what's left, stall once they fill it,
+	// and fail once the trees alone do.
+	size_t memoryBudget = (size_t)1024 * 1024 * 1024;
+	// Flushed write buffers are saved here as sorted runs, which are loaded
+	// back when the database is opened. If empty, they're dropped, since
+	// every entry is also held by the collection's cache.
+	std::string dataDirectory;
+};
 
 class Collection
 {
 public:
-	Collection(std::string name = "") :
+	// Values are immutable and shared by the cache, the write buffer and
+	// the responses reading them, so each is stored once
+	using Value = std::shared_ptr<const std::string>;
+	using Map = OrderedMap<std::string, Value>;
+	using Leaf = OrderedMapNode<std::string, Value>;
+	using SealHandler = std::function<void(Collection&)>;
+	// Number of keys per key prefix, in key order
+	using Histogram = std::vector<std::pair<std::string, size_t>>;
+	// Receive the result of an aggregation, or the exception it failed with
+	using SumHandler = std::function<void(std::exception_ptr error, NumericSum sum)>;
+	using HistogramHandler = std::function<void(std::exception_ptr error, Histogram histogram)>;
+	using Entries = std::vector<std::pair<std::string, Value>>;
+	// Receive values read from the value log, or the exception a read failed
+	// with
+	using ValuesHandler = std::function<void(std::exception_ptr error, std::vector<Value> values)>;
+	using EntriesHandler = std::function<void(std::exception_ptr error, Entries entries)>;
+
+	// `onSeal` is called on the writing thread whenever a write buffer is
+	// sealed, to schedule its flush. The value log does its I/O through
+	// `engine`, or its own engine if that's nullptr.
+	Collection(std::string name = "", CollectionOptions options = CollectionOptions(),
+		MemoryBudget* budget = nullptr, SealHandler onSeal = nullptr, IOEngine* engine = nullptr) :
 		mName { name },
-		mCache(100)	// TODO determine buffer size based on system cache size
-	{}
+		mOptions { options },
+		mCache(mOptions.branching_factor()),
+		mEngine { engine },
+		mBudget { budget },
+		mOnSeal { std::move(onSeal) }
+	{
+		if (mOptions.hashIndex) mIndex = std::make_unique<HashIndex<Leaf*>>();
+		if (mOptions.hotKeySampling) mHotKeys = std::make_unique<HotKeyTracker>(mOptions.hotKeySampling);
+		if (mOptions.valueLogThreshold && !mOptions.valueLogDirectory.empty()) openValueLog();
+	}
 	Collection(const Collection& other) = delete;
 	Collection(Collection&& other) noexcept : Collection(other.mName)
 	{
@@ -22,45 +133,256 @@ public:
 	}
 
 	~Collection() {
-		for (auto b : mWriteBuffers) {
+		if (mBudget) mBudget->resize(mResident, 0);
+		delete mWriteBuffer;
+		for (auto b : mSealedBuffers) {
 			delete b;
 		}
 	};
 
+	// Not thread safe: the sealed buffers change hands without their mutex
 	friend void swap(Collection& a, Collection& b)
 	{
 		using std::swap;
 		swap(a.mName, b.mName);
-		swap(a.mWriteBuffers, b.mWriteBuffers);
+		swap(a.mOptions, b.mOptions);
+		swap(a.mWriteBuffer, b.mWriteBuffer);
+		swap(a.mSealedBuffers, b.mSealedBuffers);
 		swap(a.mCache, b.mCache);
+		swap(a.mIndex, b.mIndex);
+		swap(a.mHotKeys, b.mHotKeys);
+		swap(a.mEngine, b.mEngine);
+		swap(a.mValueLog, b.mValueLog);
+		swap(a.mRetireAfter, b.mRetireAfter);
+		swap(a.mBudget, b.mBudget);
+		swap(a.mResident, b.mResident);
+		swap(a.mOnSeal, b.mOnSeal);
 	};
 
 	std::string name() const { return mName; }
+	const CollectionOptions& options() const { return mOptions; }
 
+	// Reads and writes may come from another thread than garbage collection,
+	// which swaps the values of live keys. Counts and ranks only read keys.
 	void set(std::string key, std::string value);
-	const std::string get(std::string value);
+	Value get(std::string value);
+	// The values of the keys, in the order given, nullptr for keys that
+	// don't exist. Cheaper than a get per key, see OrderedMap::find_sorted.
+	std::vector<Value> multiGet(const std::vector<std::string>& keys);
+	// Same, but values in the value log are read through its IOEngine rather
+	// than blocking. Returns the values if none of them are. Otherwise
+	// returns nullopt and passes them to `done` on `context`.
+	std::optional<std::vector<Value>> multiGet(const std::vector<std::string>& keys,
+		boost::asio::io_context& context, ValuesHandler done);
 	void del(std::string key);
+	// Read-modify-write of the key's value with a single lookup, see
+	// OrderedMap::update. `modify` changes the live value in place, or fills
+	// in the empty one it's given if the key doesn't exist, and returns
+	// whether to keep the change. Returns that too.
+	bool update(const std::string& key, const std::function<bool(std::string& value, bool exists)>& modify);
+	// Applies an entry loaded from a run, with its value as stored. The
+	// write buffers are skipped, since the entry is saved already.
+	void replay(std::string key, std::string value, bool isDeleted);
+
+	// Number of keys, in all or in [lo, hi]
+	size_t size() const { return mCache.size(); }
+	size_t count(const std::string& lo, const std::string& hi) const { return mCache.count(lo, hi); }
+	// Number of keys less than the key
+	size_t rank(const std::string& key) const { return mCache.rank(key); }
+	// Up to `limit` entries in key order, starting with the one of rank n
+	Entries select(size_t n, size_t limit = 1) const;
+	// Same, reading the value log like the multiGet taking a handler
+	std::optional<Entries> select(size_t n, size_t limit, boost::asio::io_context& context, EntriesHandler done) const;
+
+	// Sum of the values that are numbers, over all keys or those in [lo, hi].
+	// Aggregations scan in parallel on WorkerPool::shared(), see
+	// parallel_reduce_async. These wait for the result, the overloads taking
+	// a handler return at once and call it on a worker. The collection must
+	// not change while scanning().
+	NumericSum sum() const;
+	NumericSum sum(const std::string& lo, const std::string& hi) const;
+	void sum(SumHandler done) const { sumRange(0, size(), std::move(done)); }
+	void sum(const std::string& lo, const std::string& hi, SumHandler done) const
+	{
+		sumRange(mCache.rank(lo), count(lo, hi), std::move(done));
+	}
+	// Number of keys per distinct prefix of `prefixLength` bytes, over all
+	// keys or those in [lo, hi]. Stops at maxBuckets + 1 prefixes, so a
+	// longer result than maxBuckets means it's incomplete.
+	Histogram histogram(size_t prefixLength, size_t maxBuckets) const;
+	Histogram histogram(size_t prefixLength, size_t maxBuckets, const std::string& lo, const std::string& hi) const;
+	void histogram(size_t prefixLength, size_t maxBuckets, HistogramHandler done) const
+	{
+		histogramRange(prefixLength, maxBuckets, 0, size(), std::move(done));
+	}
+	void histogram(size_t prefixLength, size_t maxBuckets, const std::string& lo, const std::string& hi,
+		HistogramHandler done) const
+	{
+		histogramRange(prefixLength, maxBuckets, mCache.rank(lo), count(lo, hi), std::move(done));
+	}
+	// Whether an aggregation is still reading the collection
+	bool scanning() const { return mScans > 0; }
+
+	// The most accessed keys and their estimated access counts, empty if
+	// tracking is off
+	std::vector<HotKeyTracker::HotKey> topKeys(size_t k) const
+	{
+		return mHotKeys ? mHotKeys->top(k) : std::vector<HotKeyTracker::HotKey>();
+	}
+
+	// Bytes held by the cache, the write buffers and the hash index
+	size_t memoryUsage() const;
+	// Same without the sealed write buffers
+	size_t residentMemoryUsage() const;
+	// Where large values are kept, or nullptr if they're kept in the trees
+	const ValueLog* valueLog() const { return mValueLog.get(); }
+	// Collects the value log segment with the most garbage, if it has enough:
+	// moves its live values to the end of the log and retires it. The flush
+	// thread does this after each flush. The segment is deleted once the
+	// write buffers holding the moved values are flushed, so no run points
+	// into it anymore. Gives up while scanning(). Returns the bytes freed.
+	uint64_t collectGarbage();
+	// Waits for the values appended to the value log and makes them durable
+	void syncValueLog();
+	// Sets the value log's garbage from the values the cache points at
+	void recountGarbage();
+	// Number of sealed write buffers waiting to be flushed
+	size_t sealedBuffers() const;
+	// Seals the active write buffer, unless it's empty
+	void seal();
+	// Passes the oldest sealed write buffer to `sink` and frees it. Returns
+	// false if there was none. If `sink` throws, the buffer stays queued.
+	// Safe to call from another thread than the one writing.
+	bool flush(const std::function<void(const Map&)>& sink);
 private:
+	static uint64_t hash(const std::string& key) { return std::hash<std::string>{}(key); }
+	// Points the hash index at the leaves the key and, after a split, its
+	// former neighbours now live in
+	void index(const std::string& key, Leaf* leaf, Leaf* splitLeaf);
+	Map& writeBuffer();
+	// mMutex must be held by these
+	void sealBuffer();
+	size_t residentBytes() const;
+	// Reports the change in resident memory to the budget
+	void track();
+	void openValueLog();
+	// With a value log, the trees hold values as a tag byte followed by
+	// either the value or its ValuePointer. These convert to and from that.
+	std::string store(const std::string& key, std::string value);
+	std::string load(const std::string& stored) const;
+	Value load(const Value& stored) const;
+	// Counts the value as garbage if it's in the value log
+	void release(const std::string& stored);
+	// The stored value of a live key, or nullptr
+	const std::string* stored(const std::string& key) const;
+	// The stored values of the keys, nullptr for those that don't exist
+	std::vector<Value> findStored(const std::vector<std::string>& keys);
+	// Loads the stored values through the value log's engine, see multiGet.
+	// mMutex must be held, so their segments aren't retired first.
+	std::optional<std::vector<Value>> loadAsync(std::vector<Value> values,
+		boost::asio::io_context& context, ValuesHandler done) const;
+	// Over the `total` keys starting with the one of rank `first`
+	void sumRange(size_t first, size_t total, SumHandler done) const;
+	void histogramRange(size_t prefixLength, size_t maxBuckets, size_t first, size_t total, HistogramHandler done) const;
+
 	std::string mName;
-	std::vector<OrderedMap<std::string, std::string>*> mWriteBuffers;
-	OrderedMap<std::string, std::string> mCache;
+	CollectionOptions mOptions;
+	// Receives writes until it reaches writeBufferSize, created on demand
+	Map* mWriteBuffer = nullptr;
+	// Write buffers waiting to be flushed, oldest first. These are read only.
+	std::deque<Map*> mSealedBuffers;
+	mutable std::mutex mSealedMutex;
+	Map mCache;
+	// Exact for every key in mCache, up to 64-bit hash collisions
+	std::unique_ptr<HashIndex<Leaf*>> mIndex;
+	std::unique_ptr<HotKeyTracker> mHotKeys;
+	IOEngine* mEngine;
+	std::unique_ptr<ValueLog> mValueLog;
+	// The sealed write buffer whose flush drops the retired value log
+	// segments. Guarded by mSealedMutex.
+	Map* mRetireAfter = nullptr;
+	// Held by reads, writes and garbage collection
+	mutable std::mutex mMutex;
+	MemoryBudget* mBudget;
+	// Resident bytes last reported to mBudget
+	size_t mResident = 0;
+	SealHandler mOnSeal;
+	// Aggregations running, which read mCache from the workers. Started
+	// under mMutex, so garbage collection sees them.
+	mutable std::atomic<size_t> mScans = 0;
 };
 
+// Sealed write buffers are flushed by a background thread, one at a time in
+// the order they were sealed
 class Database
 {
 public:
+	// Wait before retrying a flush that failed
+	static constexpr std::chrono::seconds FLUSH_RETRY_DELAY{ 1 };
+	// A collection's runs are merged into one once it has this many
+	static constexpr size_t COMPACTION_RUNS = 8;
+
+	Database(DatabaseOptions options = DatabaseOptions());
+	Database(const Database& other) = delete;
+	Database& operator=(const Database& other) = delete;
+	~Database();
+
 	Collection& addCollection(std::string collectionName) {
 		if (mCollections.contains(collectionName)) {
 			return mCollections[collectionName];
 		}
-		mCollections[collectionName] = Collection(collectionName);
+		mCollections[collectionName] = Collection(collectionName, mOptions.collectionDefaults, &mBudget,
+			[this](Collection& collection) { scheduleFlush(collection); }, mEngine.get());
 		return mCollections[collectionName];
 	}
 
 	Collection& getCollection(std::string collectionName) {
 		return mCollections.at(collectionName);
 	}
+
+	const MemoryBudget& budget() const { return mBudget; }
+	// How long the next write should be held back, see MemoryBudget
+	std::chrono::microseconds writeDelay() const { return mBudget.writeDelay(); }
+	// Writes should wait until a flush frees up memory
+	bool writesStalled() const { return mBudget.isStalled(); }
+	// Writes that add data should fail, only deletes free up memory
+	bool memoryExhausted() const { return mBudget.isExhausted(); }
+	// Writes to the collection should wait until its aggregations finish
+	bool isScanning(const std::string& collectionName) const
+	{
+		auto it = mCollections.find(collectionName);
+		return it != mCollections.end() && it->second.scanning();
+	}
+	// Blocks until every write buffer sealed so far is flushed
+	void waitForFlushes();
 private:
+	void scheduleFlush(Collection& collection);
+	void runFlushes();
+	// Saves a write buffer as a sorted run in the data directory
+	void writeRun(const Collection& collection, const Collection::Map& buffer);
+	// Merges the collection's runs into one once there are enough of them,
+	// and deletes the runs it replaces
+	void compactRuns(const Collection& collection);
+	// Loads the runs in the data directory into their collections, oldest
+	// first so later writes win
+	void recover();
+
+	DatabaseOptions mOptions;
+	MemoryBudget mBudget;
+	// Shared by the collections' value logs, so it outlives them
+	std::unique_ptr<IOEngine> mEngine;
 	std::unordered_map<std::string, Collection> mCollections;
+
+	std::mutex mFlushMutex;
+	std::condition_variable mFlushReady;
+	std::condition_variable mFlushDone;
+	// One entry per sealed write buffer
+	std::deque<Collection*> mFlushQueue;
+	// Sequence numbers of each collection's runs, oldest first. Only the
+	// flush thread uses these once it's started.
+	std::unordered_map<std::string, std::vector<uint64_t>> mRuns;
+	uint64_t mRunSequence = 0;
+	bool mStopping = false;
+	std::thread mFlusher;
 };
 
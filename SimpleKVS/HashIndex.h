@@ -0,0 +1,127 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#endif
+
+// Open-addressing hash table from precomputed 64-bit hashes to values,
+// laid out Swiss-table style: a byte array of control bytes holding 7 bits
+// of each hash, and a parallel array of slots holding the full hash and the
+// value. A probe scans the control bytes and only touches a slot when those
+// 7 bits match, so a lookup usually costs one miss in each array.
+//
+// Keys themselves aren't stored. Two keys with the same 64-bit hash share an
+// entry, so callers have to verify what they find.
+template<typename T>
+class HashIndex
+{
+public:
+	HashIndex(size_t capacity = 16)
+	{
+		size_t c = MIN_CAPACITY;
+		while (c < capacity) c *= 2;
+		allocate(c);
+	}
+	HashIndex(const HashIndex& other) = delete;
+	HashIndex& operator=(const HashIndex& other) = delete;
+
+	// Returns the value stored for the hash, or nullptr
+	T* find(uint64_t hash) const
+	{
+		uint64_t mixed = mix(hash);
+		uint8_t h2 = tag(mixed);
+		for (size_t i = mixed & mMask;; i = (i + 1) & mMask) {
+			if (mControl[i] == h2 && mSlots[i].hash == hash) return &mSlots[i].value;
+			if (mControl[i] == EMPTY) return nullptr;
+		}
+	}
+
+	// Inserts the value for the hash, replacing the existing one if any
+	void insert(uint64_t hash, T value)
+	{
+		if ((mSize + 1) * 8 > capacity() * 7) grow();
+		uint64_t mixed = mix(hash);
+		uint8_t h2 = tag(mixed);
+		size_t i = mixed & mMask;
+		for (;; i = (i + 1) & mMask) {
+			if (mControl[i] == EMPTY) break;
+			if (mControl[i] == h2 && mSlots[i].hash == hash) {
+				mSlots[i].value = std::move(value);
+				return;
+			}
+		}
+		mControl[i] = h2;
+		mSlots[i].hash = hash;
+		mSlots[i].value = std::move(value);
+		mSize++;
+	}
+
+	// Hints that `hash` will be looked up soon
+	void prefetch(uint64_t hash) const
+	{
+		size_t i = mix(hash) & mMask;
+#if defined(_MSC_VER)
+		_mm_prefetch((const char*)&mControl[i], _MM_HINT_T0);
+		_mm_prefetch((const char*)&mSlots[i], _MM_HINT_T0);
+#else
+		__builtin_prefetch(&mControl[i]);
+		__builtin_prefetch(&mSlots[i]);
+#endif
+	}
+
+	void clear()
+	{
+		for (size_t i = 0; i < capacity(); i++) mControl[i] = EMPTY;
+		mSize = 0;
+	}
+
+	size_t size() const { return mSize; }
+	size_t capacity() const { return mMask + 1; }
+private:
+	static constexpr uint8_t EMPTY = 0x80;
+	static constexpr size_t MIN_CAPACITY = 16;
+
+	struct Slot {
+		uint64_t hash;
+		T value;
+	};
+
+	// Spreads the hash so that weak hash functions still probe well
+	static uint64_t mix(uint64_t hash)
+	{
+		hash ^= hash >> 33;
+		hash *= 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 33;
+		return hash;
+	}
+
+	// The top 7 bits, which never collide with EMPTY
+	static uint8_t tag(uint64_t mixed) { return (uint8_t)(mixed >> 57); }
+
+	void allocate(size_t capacity)
+	{
+		mControl = std::make_unique<uint8_t[]>(capacity);
+		mSlots = std::make_unique<Slot[]>(capacity);
+		mMask = capacity - 1;
+		mSize = 0;
+		for (size_t i = 0; i < capacity; i++) mControl[i] = EMPTY;
+	}
+
+	// Doubles the capacity, rehashing from the stored hashes
+	void grow()
+	{
+		auto control = std::move(mControl);
+		auto slots = std::move(mSlots);
+		size_t oldCapacity = capacity();
+		allocate(oldCapacity * 2);
+		for (size_t i = 0; i < oldCapacity; i++) {
+			if (control[i] != EMPTY) insert(slots[i].hash, std::move(slots[i].value));
+		}
+	}
+
+	std::unique_ptr<uint8_t[]> mControl;
+	std::unique_ptr<Slot[]> mSlots;
+	size_t mMask = 0;
+	size_t mSize = 0;
+};
@@ -0,0 +1,188 @@
+#include "HotKeys.h"
+
+#include <algorithm>
+#include <thread>
+
+CountMinSketch::CountMinSketch(size_t width, size_t depth) :
+	mWidth{ width },
+	mDepth{ depth },
+	mCounters(width * depth)
+{}
+
+size_t CountMinSketch::index(uint64_t hash, size_t row) const
+{
+	// Rows hash with h1 + row * h2, from the two halves of the key's hash
+	uint64_t h1 = hash & 0xffffffff;
+	uint64_t h2 = (hash >> 32) | 1;
+	return row * mWidth + (h1 + row * h2) % mWidth;
+}
+
+void CountMinSketch::add(uint64_t hash, uint64_t count)
+{
+	for (size_t row = 0; row < mDepth; row++) {
+		mCounters[index(hash, row)] += count;
+	}
+}
+
+uint64_t CountMinSketch::estimate(uint64_t hash) const
+{
+	uint64_t estimate = UINT64_MAX;
+	for (size_t row = 0; row < mDepth; row++) {
+		estimate = (std::min)(estimate, mCounters[index(hash, row)]);
+	}
+	return estimate;
+}
+
+void CountMinSketch::decay()
+{
+	for (auto& counter : mCounters) {
+		counter /= 2;
+	}
+}
+
+SpaceSaving::SpaceSaving(size_t capacity) :
+	mCapacity{ capacity }
+{
+	mHeap.reserve(capacity);
+	mPositions.reserve(capacity);
+}
+
+void SpaceSaving::add(const std::string& key, uint64_t count)
+{
+	auto found = mPositions.find(key);
+	if (found != mPositions.end()) {
+		size_t i = found->second;
+		mHeap[i].count += count;
+		siftDown(i);
+		return;
+	}
+
+	if (mHeap.size() < mCapacity) {
+		// Counts are at least 1, so a new key with the smallest count can
+		// only go at the end while there's room
+		mHeap.push_back({ key, count, 0 });
+		size_t i = mHeap.size() - 1;
+		mPositions[key] = i;
+		// Sift up
+		while (i > 0 && mHeap[(i - 1) / 2].count > mHeap[i].count) {
+			std::swap(mHeap[i], mHeap[(i - 1) / 2]);
+			mPositions[mHeap[i].key] = i;
+			i = (i - 1) / 2;
+			mPositions[mHeap[i].key] = i;
+		}
+		return;
+	}
+
+	// Evict the least frequent key, the new one inherits its count as error
+	uint64_t minimum = mHeap[0].count;
+	mPositions.erase(mHeap[0].key);
+	mPositions[key] = 0;
+	mHeap[0] = { key, minimum + count, minimum };
+	siftDown(0);
+}
+
+void SpaceSaving::siftDown(size_t i)
+{
+	Entry entry = std::move(mHeap[i]);
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= mHeap.size()) break;
+		if (child + 1 < mHeap.size() && mHeap[child + 1].count < mHeap[child].count) child++;
+		if (entry.count <= mHeap[child].count) break;
+		place(i, std::move(mHeap[child]));
+		i = child;
+	}
+	place(i, std::move(entry));
+}
+
+void SpaceSaving::place(size_t i, Entry entry)
+{
+	mHeap[i] = std::move(entry);
+	mPositions[mHeap[i].key] = i;
+}
+
+std::vector<SpaceSaving::Entry> SpaceSaving::top(size_t k) const
+{
+	std::vector<Entry> entries = mHeap;
+	k = (std::min)(k, entries.size());
+	std::partial_sort(entries.begin(), entries.begin() + k, entries.end(),
+		[](const Entry& a, const Entry& b) { return a.count > b.count; });
+	entries.resize(k);
+	return entries;
+}
+
+void SpaceSaving::decay()
+{
+	// Halving keeps the heap order
+	for (auto& entry : mHeap) {
+		entry.count /= 2;
+		entry.error /= 2;
+	}
+}
+
+HotKeyTracker::HotKeyTracker(uint32_t sampling, size_t capacity) :
+	mSampling{ (std::max)(sampling, 1u) },
+	mSummary(capacity)
+{}
+
+uint64_t HotKeyTracker::nextRandom()
+{
+	// xorshift64, seeded per thread
+	thread_local uint64_t state = std::hash<std::thread::id>{}(std::this_thread::get_id()) | 1;
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+void HotKeyTracker::sample(const std::string& key)
+{
+	thread_local size_t shardIndex = std::hash<std::thread::id>{}(std::this_thread::get_id()) % SHARDS;
+	Shard& shard = mShards[shardIndex];
+
+	std::vector<std::string> batch;
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shard.pending.push_back(key);
+		if (shard.pending.size() < BATCH_SIZE) return;
+		std::swap(batch, shard.pending);
+	}
+	std::lock_guard<std::mutex> lock(mMutex);
+	fold(batch);
+}
+
+void HotKeyTracker::fold(std::vector<std::string>& samples)
+{
+	for (const auto& key : samples) {
+		mSketch.add(hash(key), mSampling);
+		mSummary.add(key, mSampling);
+	}
+	mSinceDecay += samples.size() * mSampling;
+	if (mSinceDecay >= DECAY_PERIOD) {
+		mSketch.decay();
+		mSummary.decay();
+		mSinceDecay = 0;
+	}
+}
+
+std::vector<HotKeyTracker::HotKey> HotKeyTracker::top(size_t k)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto& shard : mShards) {
+		std::vector<std::string> batch;
+		{
+			std::lock_guard<std::mutex> shardLock(shard.mutex);
+			std::swap(batch, shard.pending);
+		}
+		fold(batch);
+	}
+
+	// Both overestimate, the tighter one is the better estimate
+	std::vector<HotKey> keys;
+	for (auto& entry : mSummary.top(k)) {
+		uint64_t count = (std::min)(entry.count, mSketch.estimate(hash(entry.key)));
+		keys.push_back({ std::move(entry.key), count });
+	}
+	std::stable_sort(keys.begin(), keys.end(), [](const HotKey& a, const HotKey& b) { return a.count > b.count; });
+	return keys;
+}
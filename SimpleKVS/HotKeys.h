@@ -0,0 +1,105 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Approximate counts for any number of keys in fixed memory. Estimates never
+// undercount, and overcount by about total / width at most.
+class CountMinSketch
+{
+public:
+	CountMinSketch(size_t width = 2048, size_t depth = 4);
+
+	void add(uint64_t hash, uint64_t count);
+	uint64_t estimate(uint64_t hash) const;
+	// Halves every counter
+	void decay();
+private:
+	size_t index(uint64_t hash, size_t row) const;
+
+	size_t mWidth;
+	size_t mDepth;
+	std::vector<uint64_t> mCounters;
+};
+
+// Space-Saving summary of the `capacity` most frequent keys of a stream. A
+// key's count overestimates it by at most its error.
+class SpaceSaving
+{
+public:
+	struct Entry {
+		std::string key;
+		uint64_t count;
+		uint64_t error;
+	};
+
+	SpaceSaving(size_t capacity = 128);
+
+	void add(const std::string& key, uint64_t count);
+	// Up to k of the tracked keys, most frequent first
+	std::vector<Entry> top(size_t k) const;
+	// Halves every count and error
+	void decay();
+private:
+	void siftDown(size_t i);
+	void place(size_t i, Entry entry);
+
+	size_t mCapacity;
+	// Min-heap on count, so the key to evict is at the front
+	std::vector<Entry> mHeap;
+	std::unordered_map<std::string, size_t> mPositions;
+};
+
+// Always-on hot key detection for a collection. One in `sampling` accesses is
+// recorded, standing for `sampling` accesses. Samples are batched in shards
+// picked by thread, so threads rarely contend, and folded into a Count-Min
+// sketch and a Space-Saving summary when a batch fills up or the top keys
+// are asked for. Counts are halved periodically, so old traffic fades out.
+class HotKeyTracker
+{
+public:
+	static constexpr size_t SHARDS = 16;
+	static constexpr size_t BATCH_SIZE = 64;
+	static constexpr size_t DEFAULT_CAPACITY = 128;
+	// Accesses after which all counts are halved
+	static constexpr uint64_t DECAY_PERIOD = 1 << 22;
+
+	struct HotKey {
+		std::string key;
+		// Estimated accesses, decayed
+		uint64_t count;
+	};
+
+	HotKeyTracker(uint32_t sampling = 16, size_t capacity = DEFAULT_CAPACITY);
+
+	void record(const std::string& key)
+	{
+		// Only sampled accesses get past this, unsynchronized, check
+		if (mSampling > 1 && nextRandom() % mSampling != 0) return;
+		sample(key);
+	}
+
+	// Up to k of the most accessed keys, most accessed first
+	std::vector<HotKey> top(size_t k);
+private:
+	struct alignas(64) Shard {
+		std::mutex mutex;
+		std::vector<std::string> pending;
+	};
+
+	static uint64_t nextRandom();
+	static uint64_t hash(const std::string& key) { return std::hash<std::string>{}(key); }
+	void sample(const std::string& key);
+	// mMutex must be held
+	void fold(std::vector<std::string>& samples);
+
+	uint32_t mSampling;
+	std::array<Shard, SHARDS> mShards;
+	std::mutex mMutex;
+	CountMinSketch mSketch;
+	SpaceSaving mSummary;
+	uint64_t mSinceDecay = 0;
+};
@@ -0,0 +1,209 @@
+#include "IOEngine.h"
+
+#include <algorithm>
+#include <boost/system/system_error.hpp>
+#include "IOUringEngine.h"
+#include "ThreadPoolIOEngine.h"
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    boost::system::error_code lastError()
+    {
+#if defined(_WIN32)
+        return boost::system::error_code((int)GetLastError(), boost::system::system_category());
+#else
+        return boost::system::error_code(errno, boost::system::system_category());
+#endif
+    }
+}
+
+void StorageFile::open(const std::string& path)
+{
+    close();
+    uint64_t size = 0;
+#if defined(_WIN32)
+    mHandle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+        OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (mHandle == INVALID_HANDLE_VALUE) {
+        mHandle = nullptr;
+        throw boost::system::system_error(lastError(), "Opening " + path);
+    }
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(mHandle, &fileSize)) size = fileSize.QuadPart;
+#else
+    mHandle = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (mHandle < 0) {
+        throw boost::system::system_error(lastError(), "Opening " + path);
+    }
+    struct stat info;
+    if (fstat(mHandle, &info) == 0) size = info.st_size;
+#endif
+    mPath = path;
+    mSize = size;
+}
+
+void StorageFile::close()
+{
+    if (!isOpen()) return;
+#if defined(_WIN32)
+    CloseHandle(mHandle);
+    mHandle = nullptr;
+#else
+    ::close(mHandle);
+    mHandle = -1;
+#endif
+}
+
+bool StorageFile::isOpen() const
+{
+#if defined(_WIN32)
+    return mHandle != nullptr;
+#else
+    return mHandle >= 0;
+#endif
+}
+
+size_t StorageFile::readAt(uint64_t offset, char* data, size_t size, boost::system::error_code& error) const
+{
+    size_t done = 0;
+    while (done < size) {
+#if defined(_WIN32)
+        OVERLAPPED position = {};
+        position.Offset = (DWORD)(offset + done);
+        position.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD count = 0;
+        DWORD chunk = (DWORD)(std::min)(size - done, (size_t)1 << 30);
+        if (!ReadFile(mHandle, data + done, chunk, &count, &position) && GetLastError() != ERROR_HANDLE_EOF) {
+            error = lastError();
+            return done;
+        }
+#else
+        ssize_t count = pread(mHandle, data + done, size - done, (off_t)(offset + done));
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            error = lastError();
+            return done;
+        }
+#endif
+        if (count == 0) break;
+        done += count;
+    }
+    return done;
+}
+
+size_t StorageFile::writeAt(uint64_t offset, const char* data, size_t size, boost::system::error_code& error)
+{
+    size_t done = 0;
+    while (done < size) {
+#if defined(_WIN32)
+        OVERLAPPED position = {};
+        position.Offset = (DWORD)(offset + done);
+        position.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD count = 0;
+        DWORD chunk = (DWORD)(std::min)(size - done, (size_t)1 << 30);
+        if (!WriteFile(mHandle, data + done, chunk, &count, &position)) {
+            error = lastError();
+            return done;
+        }
+#else
+        ssize_t count = pwrite(mHandle, data + done, size - done, (off_t)(offset + done));
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            error = lastError();
+            return done;
+        }
+#endif
+        done += count;
+    }
+    return done;
+}
+
+void StorageFile::sync(boost::system::error_code& error)
+{
+#if defined(_WIN32)
+    if (!FlushFileBuffers(mHandle)) error = lastError();
+#else
+    if (fdatasync(mHandle) != 0) error = lastError();
+#endif
+}
+
+std::unique_ptr<IOEngine> IOEngine::create(const IOEngineOptions& options)
+{
+#if defined(__linux__)
+    if (options.allowIOUring) {
+        auto engine = IOUringEngine::create(options.queueDepth);
+        if (engine) return engine;
+    }
+#endif
+    return std::make_unique<ThreadPoolIOEngine>(options.threads);
+}
+
+void IOEngine::read(StorageFile& file, uint64_t offset, char* data, size_t size,
+    boost::asio::io_context& context, IOHandler handler)
+{
+    enqueue({ IOOperation::Read, &file, offset, data, size, track(context), std::move(handler) });
+}
+
+uint64_t IOEngine::append(StorageFile& file, const char* data, size_t size,
+    boost::asio::io_context& context, IOHandler handler)
+{
+    uint64_t offset = file.reserve(size);
+    enqueue({ IOOperation::Write, &file, offset, const_cast<char*>(data), size, track(context), std::move(handler) });
+    return offset;
+}
+
+void IOEngine::sync(StorageFile& file, boost::asio::io_context& context, IOHandler handler)
+{
+    enqueue({ IOOperation::Sync, &file, 0, nullptr, 0, track(context), std::move(handler) });
+}
+
+void IOEngine::read(StorageFile& file, uint64_t offset, char* data, size_t size, IOHandler handler)
+{
+    enqueue({ IOOperation::Read, &file, offset, data, size, {}, std::move(handler) });
+}
+
+uint64_t IOEngine::append(StorageFile& file, const char* data, size_t size, IOHandler handler)
+{
+    uint64_t offset = file.reserve(size);
+    enqueue({ IOOperation::Write, &file, offset, const_cast<char*>(data), size, {}, std::move(handler) });
+    return offset;
+}
+
+void IOEngine::sync(StorageFile& file, IOHandler handler)
+{
+    enqueue({ IOOperation::Sync, &file, 0, nullptr, 0, {}, std::move(handler) });
+}
+
+void IOEngine::enqueue(IORequest request)
+{
+    std::vector<IORequest> batch;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQueued.push_back(std::move(request));
+        if (mQueued.size() < MAX_BATCH_SIZE) return;
+        std::swap(batch, mQueued);
+    }
+    submitBatch(batch);
+}
+
+void IOEngine::submit()
+{
+    std::vector<IORequest> batch;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mQueued.empty()) return;
+        std::swap(batch, mQueued);
+    }
+    submitBatch(batch);
+}
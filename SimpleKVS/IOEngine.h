@@ -0,0 +1,162 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/prefer.hpp>
+#include <boost/system/error_code.hpp>
+
+// Asynchronous storage I/O. Requests are queued, handed to the backend in
+// batches, and their handlers run on the io_context the caller passed in, so
+// a cold read never blocks the thread serving the connection.
+//
+// Backends: io_uring on Linux, when the kernel allows it, and otherwise a
+// thread pool doing positional reads and writes.
+
+// A file accessed with positional I/O only, so it can be shared by any
+// number of outstanding requests.
+class StorageFile
+{
+public:
+#if defined(_WIN32)
+    using NativeHandle = void*;
+#else
+    using NativeHandle = int;
+#endif
+
+    StorageFile() = default;
+    StorageFile(const StorageFile& other) = delete;
+    StorageFile& operator=(const StorageFile& other) = delete;
+    ~StorageFile() { close(); }
+
+    // Opens the file for reading and writing, creating it if needed.
+    // Throws boost::system::system_error on failure.
+    void open(const std::string& path);
+    void close();
+    bool isOpen() const;
+
+    const std::string& path() const { return mPath; }
+    NativeHandle native() const { return mHandle; }
+
+    // Size including appends that were reserved but may not have completed
+    uint64_t size() const { return mSize; }
+    // Reserves space for an append, returning the offset it starts at
+    uint64_t reserve(size_t size) { return mSize.fetch_add(size); }
+
+    // Blocking positional I/O, used by the thread pool backend. Reads return
+    // fewer bytes than requested only at the end of the file.
+    size_t readAt(uint64_t offset, char* data, size_t size, boost::system::error_code& error) const;
+    size_t writeAt(uint64_t offset, const char* data, size_t size, boost::system::error_code& error);
+    void sync(boost::system::error_code& error);
+private:
+    std::string mPath;
+#if defined(_WIN32)
+    NativeHandle mHandle = nullptr;
+#else
+    NativeHandle mHandle = -1;
+#endif
+    std::atomic<uint64_t> mSize{ 0 };
+};
+
+enum class IOOperation : uint8_t {
+    Read,
+    Write,
+    // Flushes written data to stable storage
+    Sync,
+};
+
+using IOHandler = std::function<void(const boost::system::error_code& error, size_t bytes)>;
+
+struct IORequest {
+    IOOperation op = IOOperation::Read;
+    StorageFile* file = nullptr;
+    uint64_t offset = 0;
+    // Read: destination. Write: source, which must outlive the request.
+    char* data = nullptr;
+    size_t size = 0;
+    // Where the handler runs. It counts as outstanding work, so the
+    // context's run() doesn't return while the request is pending. If
+    // empty, the handler runs on the thread that completed the request.
+    boost::asio::any_io_executor executor;
+    IOHandler handler;
+};
+
+struct IOEngineOptions {
+    // Requests the io_uring backend keeps in flight
+    unsigned queueDepth = 256;
+    // Worker threads of the thread pool backend
+    size_t threads = 4;
+    bool allowIOUring = true;
+};
+
+class IOEngine
+{
+public:
+    // Queued requests are submitted on their own once this many build up
+    static constexpr size_t MAX_BATCH_SIZE = 64;
+
+    IOEngine() = default;
+    IOEngine(const IOEngine& other) = delete;
+    IOEngine& operator=(const IOEngine& other) = delete;
+    virtual ~IOEngine() = default;
+
+    // io_uring when available, the thread pool otherwise
+    static std::unique_ptr<IOEngine> create(const IOEngineOptions& options = IOEngineOptions());
+
+    // Queues a read. The handler gets the number of bytes read, which is less
+    // than `size` only at the end of the file.
+    void read(StorageFile& file, uint64_t offset, char* data, size_t size,
+        boost::asio::io_context& context, IOHandler handler);
+    // Queues an append and returns the offset the data will be written at.
+    // Appends to the same file may complete in any order.
+    uint64_t append(StorageFile& file, const char* data, size_t size,
+        boost::asio::io_context& context, IOHandler handler);
+    // Queues a sync. It covers writes that completed before it was queued.
+    void sync(StorageFile& file, boost::asio::io_context& context, IOHandler handler);
+
+    // The same for callers without an io_context, such as background
+    // threads. Handlers run on the engine's own threads, so they must be
+    // short and must not wait on the engine.
+    void read(StorageFile& file, uint64_t offset, char* data, size_t size, IOHandler handler);
+    uint64_t append(StorageFile& file, const char* data, size_t size, IOHandler handler);
+    void sync(StorageFile& file, IOHandler handler);
+
+    // Hands everything queued so far to the backend. Callers queue the
+    // requests of one event loop pass and then submit them together.
+    void submit();
+
+    virtual const char* name() const = 0;
+protected:
+    // Starts every request in the batch and clears it
+    virtual void submitBatch(std::vector<IORequest>& batch) = 0;
+
+    // Posts the request's handler to its io_context, or runs it right away
+    // if it has none
+    static void complete(IORequest& request, const boost::system::error_code& error, size_t bytes)
+    {
+        if (!request.executor) {
+            request.handler(error, bytes);
+            return;
+        }
+        auto executor = std::move(request.executor);
+        boost::asio::post(executor, [handler = std::move(request.handler), error, bytes]() {
+            handler(error, bytes);
+        });
+    }
+private:
+    static boost::asio::any_io_executor track(boost::asio::io_context& context)
+    {
+        return boost::asio::prefer(context.get_executor(), boost::asio::execution::outstanding_work.tracked);
+    }
+
+    void enqueue(IORequest request);
+
+    std::mutex mMutex;
+    std::vector<IORequest> mQueued;
+};
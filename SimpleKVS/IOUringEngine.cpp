@@ -0,0 +1,239 @@
+#include "IOUringEngine.h"
+
+#if defined(__linux__)
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace {
+    int ioUringSetup(unsigned entries, io_uring_params* params)
+    {
+        return (int)syscall(__NR_io_uring_setup, entries, params);
+    }
+
+    int ioUringEnter(int ring, unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        return (int)syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+    // The ring indices are shared with the kernel
+    unsigned loadAcquire(const unsigned* index)
+    {
+        return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+    }
+
+    void storeRelease(unsigned* index, unsigned value)
+    {
+        __atomic_store_n(index, value, __ATOMIC_RELEASE);
+    }
+
+    // user_data of the no-op that wakes the reaper up to stop
+    constexpr uint64_t WAKEUP = 0;
+}
+
+struct IOUringEngine::InFlight {
+    IORequest request;
+    // Bytes transferred by earlier attempts, after a short read or write
+    size_t done = 0;
+    iovec buffer;
+};
+
+std::unique_ptr<IOUringEngine> IOUringEngine::create(unsigned queueDepth)
+{
+    std::unique_ptr<IOUringEngine> engine(new IOUringEngine());
+    if (!engine->setup(queueDepth)) return nullptr;
+    engine->mReaper = std::thread([engine = engine.get()]() { engine->reap(); });
+    return engine;
+}
+
+bool IOUringEngine::setup(unsigned queueDepth)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    mRing = ioUringSetup(queueDepth, &params);
+    if (mRing < 0) return false;
+    mDepth = params.sq_entries;
+
+    mSqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    mCqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap) {
+        mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+    }
+
+    void* sqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) return false;
+    mSqRing = sqRing;
+
+    if (singleMap) {
+        mCqRing = mSqRing;
+    }
+    else {
+        void* cqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) return false;
+        mCqRing = cqRing;
+    }
+
+    mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mRing, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    mSqes = (io_uring_sqe*)sqes;
+
+    char* sq = (char*)mSqRing;
+    mSqHead = (unsigned*)(sq + params.sq_off.head);
+    mSqTail = (unsigned*)(sq + params.sq_off.tail);
+    mSqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    mSqArray = (unsigned*)(sq + params.sq_off.array);
+
+    char* cq = (char*)mCqRing;
+    mCqHead = (unsigned*)(cq + params.cq_off.head);
+    mCqTail = (unsigned*)(cq + params.cq_off.tail);
+    mCqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    mCqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+IOUringEngine::~IOUringEngine()
+{
+    if (mReaper.joinable()) {
+        submit();
+        {
+            std::unique_lock<std::mutex> lock(mSubmitMutex);
+            mStopping = true;
+            // A full ring only drains as requests complete, which wakes us
+            mSlotsFreed.wait(lock, [this]() { return *mSqTail - loadAcquire(mSqHead) < mDepth; });
+            unsigned tail = *mSqTail;
+            io_uring_sqe& sqe = mSqes[tail & mSqMask];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_NOP;
+            sqe.user_data = WAKEUP;
+            mSqArray[tail & mSqMask] = tail & mSqMask;
+            storeRelease(mSqTail, tail + 1);
+            mUnsubmitted++;
+            int submitted = ioUringEnter(mRing, mUnsubmitted, 0, 0);
+            if (submitted > 0) mUnsubmitted -= submitted;
+        }
+        mReaper.join();
+    }
+
+    if (mSqes) munmap(mSqes, mSqesSize);
+    if (mCqRing && mCqRing != mSqRing) munmap(mCqRing, mCqRingSize);
+    if (mSqRing) munmap(mSqRing, mSqRingSize);
+    if (mRing >= 0) close(mRing);
+}
+
+void IOUringEngine::submitBatch(std::vector<IORequest>& batch)
+{
+    std::lock_guard<std::mutex> lock(mSubmitMutex);
+    for (auto& request : batch) {
+        mBacklog.push_back(std::move(request));
+    }
+    batch.clear();
+    fill();
+}
+
+void IOUringEngine::fill()
+{
+    while (!mRetries.empty() || (!mBacklog.empty() && mInFlight < mDepth)) {
+        unsigned tail = *mSqTail;
+        if (tail - loadAcquire(mSqHead) >= mDepth) break;
+
+        InFlight* request;
+        if (!mRetries.empty()) {
+            request = mRetries.front();
+            mRetries.pop_front();
+        }
+        else {
+            request = new InFlight{ std::move(mBacklog.front()), 0, {} };
+            mBacklog.pop_front();
+            mInFlight++;
+        }
+
+        unsigned index = tail & mSqMask;
+        prepare(mSqes[index], request);
+        mSqArray[index] = index;
+        storeRelease(mSqTail, tail + 1);
+        mUnsubmitted++;
+    }
+
+    if (mUnsubmitted == 0) return;
+    int submitted = ioUringEnter(mRing, mUnsubmitted, 0, 0);
+    // On EAGAIN or EBUSY the entries stay in the ring, and go out with the
+    // next submission or once the reaper has freed up completion slots.
+    if (submitted > 0) mUnsubmitted -= submitted;
+}
+
+void IOUringEngine::prepare(io_uring_sqe& sqe, InFlight* request)
+{
+    const IORequest& r = request->request;
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = r.file->native();
+    sqe.user_data = (uint64_t)request;
+
+    switch (r.op) {
+    case IOOperation::Read:
+    case IOOperation::Write:
+        request->buffer.iov_base = r.data + request->done;
+        request->buffer.iov_len = r.size - request->done;
+        sqe.opcode = r.op == IOOperation::Read ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe.addr = (uint64_t)&request->buffer;
+        sqe.len = 1;
+        sqe.off = r.offset + request->done;
+        break;
+    case IOOperation::Sync:
+        sqe.opcode = IORING_OP_FSYNC;
+        sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    }
+}
+
+void IOUringEngine::reap()
+{
+    for (;;) {
+        if (ioUringEnter(mRing, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return;
+        }
+
+        unsigned head = *mCqHead;
+        unsigned tail = loadAcquire(mCqTail);
+        unsigned completed = 0;
+        std::vector<InFlight*> retries;
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = mCqes[head & mCqMask];
+            if (cqe.user_data == WAKEUP) continue;
+
+            auto* request = (InFlight*)cqe.user_data;
+            IORequest& r = request->request;
+            boost::system::error_code error;
+            if (cqe.res < 0) {
+                error = boost::system::error_code(-cqe.res, boost::system::system_category());
+            }
+            else {
+                request->done += cqe.res;
+                // Short transfer: go again for the rest, a read returning 0
+                // means the end of the file
+                if (r.op != IOOperation::Sync && cqe.res > 0 && request->done < r.size) {
+                    retries.push_back(request);
+                    continue;
+                }
+            }
+            complete(r, error, request->done);
+            delete request;
+            completed++;
+        }
+        storeRelease(mCqHead, head);
+
+        std::lock_guard<std::mutex> lock(mSubmitMutex);
+        mInFlight -= completed;
+        mRetries.insert(mRetries.end(), retries.begin(), retries.end());
+        fill();
+        mSlotsFreed.notify_all();
+        if (mStopping && mInFlight == 0 && mBacklog.empty()) return;
+    }
+}
+#endif
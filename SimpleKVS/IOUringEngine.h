@@ -0,0 +1,72 @@
+#pragma once
+#include "IOEngine.h"
+
+#if defined(__linux__)
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct iovec;
+
+// Backend on Linux io_uring, driven through the raw system calls. One ring
+// is shared by all threads. Submission happens on the caller's thread under
+// a lock, a reaper thread waits for completions and posts their handlers.
+// Requests beyond the queue depth wait in a backlog until slots free up.
+class IOUringEngine : public IOEngine
+{
+public:
+    // Returns nullptr if the kernel doesn't support io_uring or it's blocked,
+    // as it is by some container runtimes.
+    static std::unique_ptr<IOUringEngine> create(unsigned queueDepth);
+    ~IOUringEngine();
+
+    const char* name() const override { return "io_uring"; }
+protected:
+    void submitBatch(std::vector<IORequest>& batch) override;
+private:
+    struct InFlight;
+
+    IOUringEngine() = default;
+
+    bool setup(unsigned queueDepth);
+    // Moves backlogged requests into free submission slots and submits them.
+    // mSubmitMutex must be held.
+    void fill();
+    void prepare(io_uring_sqe& sqe, InFlight* request);
+    void reap();
+
+    int mRing = -1;
+    unsigned mDepth = 0;
+
+    void* mSqRing = nullptr;
+    size_t mSqRingSize = 0;
+    void* mCqRing = nullptr;
+    size_t mCqRingSize = 0;
+    io_uring_sqe* mSqes = nullptr;
+    size_t mSqesSize = 0;
+
+    unsigned* mSqHead = nullptr;
+    unsigned* mSqTail = nullptr;
+    unsigned mSqMask = 0;
+    unsigned* mSqArray = nullptr;
+    unsigned* mCqHead = nullptr;
+    unsigned* mCqTail = nullptr;
+    unsigned mCqMask = 0;
+    io_uring_cqe* mCqes = nullptr;
+
+    std::mutex mSubmitMutex;
+    // Signalled by the reaper after it frees up submission slots
+    std::condition_variable mSlotsFreed;
+    std::deque<IORequest> mBacklog;
+    // In-flight requests to resubmit after a short read or write
+    std::deque<InFlight*> mRetries;
+    // Requests handed to the kernel and not completed yet
+    unsigned mInFlight = 0;
+    // Entries written to the submission ring the kernel hasn't taken yet
+    unsigned mUnsubmitted = 0;
+    bool mStopping = false;
+    std::thread mReaper;
+};
+#endif
@@ -0,0 +1,133 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+// Index over a sorted array of distinct numeric keys, each with a value,
+// that predicts where a key is instead of searching for it. The keys are
+// covered by line segments, fitted greedily so every key's predicted position
+// is off by at most `maxError`. A lookup binary searches the segments, which
+// are few for dense or evenly spread keys and stay cached, then only the
+// 2 * maxError or so keys around the prediction. Keys larger than all the
+// others can be appended, which extends the last segment while it fits.
+template<typename K, typename T>
+class LearnedIndex
+{
+public:
+	static constexpr size_t DEFAULT_MAX_ERROR = 8;
+
+	LearnedIndex(std::vector<K> keys, std::vector<T> values, size_t maxError = DEFAULT_MAX_ERROR) :
+		mKeys{ std::move(keys) },
+		mValues{ std::move(values) },
+		mMaxError{ maxError }
+	{
+		static_assert(std::is_arithmetic_v<K>, "Keys have to be numbers to fit lines to them");
+		fit();
+	}
+
+	// The value of the last key not greater than `key`, or of the first key
+	// if they all are. There has to be at least one key.
+	const T& find(K key) const { return mValues[position(key)]; }
+
+	size_t position(K key) const
+	{
+		auto segment = std::upper_bound(mSegments.begin(), mSegments.end(), key,
+			[](K key, const Segment& segment) { return key < segment.first; });
+		if (segment == mSegments.begin()) return 0;
+		--segment;
+
+		// Between two keys the line is between their predictions too, so
+		// allow one more position, and one for rounding
+		double predicted = segment->position + segment->slope * ((double)key - (double)segment->first);
+		size_t guess = (size_t)std::clamp(predicted, 0.0, (double)(mKeys.size() - 1));
+		size_t error = mMaxError + 2;
+		size_t lo = guess > error ? guess - error : 0;
+		size_t hi = (std::min)(guess + error + 1, mKeys.size());
+
+		// Keys too large for a double to tell apart may be predicted worse
+		if (!(mKeys[lo] <= key) || (hi < mKeys.size() && !(key < mKeys[hi]))) {
+			lo = 0;
+			hi = mKeys.size();
+		}
+		size_t found = std::upper_bound(mKeys.begin() + lo, mKeys.begin() + hi, key) - mKeys.begin();
+		return found == 0 ? 0 : found - 1;
+	}
+
+	// `key` has to be greater than every key so far
+	void append(K key, T value)
+	{
+		mKeys.push_back(key);
+		mValues.push_back(std::move(value));
+		extend(mKeys.size() - 1);
+	}
+
+	size_t size() const { return mKeys.size(); }
+	size_t segments() const { return mSegments.size(); }
+	size_t memory_usage() const
+	{
+		return sizeof(*this) + mKeys.capacity() * sizeof(K) + mValues.capacity() * sizeof(T)
+			+ mSegments.capacity() * sizeof(Segment);
+	}
+private:
+	struct Segment {
+		K first;
+		// Of the first key
+		size_t position;
+		double slope;
+	};
+
+	void fit()
+	{
+		for (size_t i = 0; i < mKeys.size(); i++) {
+			extend(i);
+		}
+	}
+
+	// Shrinking cone: the last segment takes key i while some slope keeps
+	// every key in it within maxError of its position, else key i starts a
+	// new one
+	void extend(size_t i)
+	{
+		if (mSegments.empty()) {
+			open(i);
+			return;
+		}
+		Segment& segment = mSegments.back();
+		double dx = (double)mKeys[i] - (double)segment.first;
+		double dy = (double)(i - segment.position);
+		double error = (double)mMaxError;
+		if (dx > 0) {
+			double lo = (std::max)(mLo, (dy - error) / dx);
+			double hi = (std::min)(mHi, (dy + error) / dx);
+			if (lo > hi) {
+				open(i);
+				return;
+			}
+			mLo = lo;
+			mHi = hi;
+		}
+		// Indistinguishable as doubles, the line can't tell them apart
+		else if (dy > error) {
+			open(i);
+			return;
+		}
+		segment.slope = std::isinf(mHi) ? mLo : (mLo + mHi) / 2;
+	}
+
+	void open(size_t i)
+	{
+		mSegments.push_back({ mKeys[i], i, 0 });
+		mLo = 0;
+		mHi = INFINITY;
+	}
+
+	std::vector<K> mKeys;
+	std::vector<T> mValues;
+	std::vector<Segment> mSegments;
+	size_t mMaxError;
+	// Slopes that keep the last segment's keys within mMaxError
+	double mLo = 0;
+	double mHi = INFINITY;
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+// Tracks the memory the collections of a Database hold, and turns it into
+// back-pressure on writers. Resident bytes are the trees, active write
+// buffers and hash indexes, which only deletes free. Pending bytes are write
+// buffers sealed but not flushed yet, which flushing frees. The limit bounds
+// both together.
+class MemoryBudget
+{
+public:
+	// Writes start slowing down at this fraction of the limit
+	static constexpr double SLOWDOWN_FRACTION = 0.5;
+	// Delay of a write just below the limit. At the limit writes stall and
+	// check again after this long.
+	static constexpr std::chrono::microseconds MAX_WRITE_DELAY{ 10000 };
+
+	MemoryBudget(size_t limit) : mLimit{ limit } {}
+
+	size_t limit() const { return mLimit; }
+	size_t resident() const { return mResident.load(std::memory_order_relaxed); }
+	size_t pending() const { return mPending.load(std::memory_order_relaxed); }
+	size_t flushed() const { return mFlushed.load(std::memory_order_relaxed); }
+
+	// A collection's resident bytes went from `from` to `to`
+	void resize(size_t from, size_t to)
+	{
+		if (to > from) mResident.fetch_add(to - from, std::memory_order_relaxed);
+		else mResident.fetch_sub(from - to, std::memory_order_relaxed);
+	}
+
+	void seal(size_t bytes) { mPending.fetch_add(bytes, std::memory_order_relaxed); }
+	void release(size_t bytes)
+	{
+		mPending.fetch_sub(bytes, std::memory_order_relaxed);
+		mFlushed.fetch_add(bytes, std::memory_order_relaxed);
+	}
+
+	// No flush can make room, so writes that add data should fail
+	bool isExhausted() const { return resident() >= mLimit; }
+	// Writes should wait until a flush makes room
+	bool isStalled() const { return !isExhausted() && pending() >= headroom(); }
+
+	// How long a write should wait before it's applied. Pending bytes are
+	// measured against what resident bytes leave of the limit: nothing below
+	// the slowdown point, then growing linearly to MAX_WRITE_DELAY when
+	// they fill it. Exhausted budgets don't delay, since waiting won't help.
+	std::chrono::microseconds writeDelay() const
+	{
+		if (isExhausted()) return std::chrono::microseconds(0);
+		double used = (double)pending() / (double)headroom();
+		if (used < SLOWDOWN_FRACTION) return std::chrono::microseconds(0);
+		double ramp = (std::min)((used - SLOWDOWN_FRACTION) / (1 - SLOWDOWN_FRACTION), 1.0);
+		return std::chrono::microseconds((std::max)((long long)(ramp * MAX_WRITE_DELAY.count()), 1LL));
+	}
+private:
+	size_t headroom() const { return mLimit - (std::min)(resident(), mLimit); }
+
+	size_t mLimit;
+	std::atomic<size_t> mResident = 0;
+	std::atomic<size_t> mPending = 0;
+	std::atomic<size_t> mFlushed = 0;
+};
@@ -1,64 +1,145 @@
 #pragma once
 #include <concepts>
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <type_traits>
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 #include <math.h>
-
-constexpr size_t DEFAULT_BRANCHING_FACTOR = 3;
-
-template<typename K, typename V>
+#include "LearnedIndex.h"
+#include "Prefetch.h"
+
+// Used when the cache geometry isn't known, see CacheGeometry for detection
+constexpr size_t ASSUMED_CACHE_LINE_SIZE = 64;
+constexpr size_t ASSUMED_L1_CACHE_SIZE = 32 * 1024;
+constexpr size_t MIN_BRANCHING_FACTOR = 4;
+constexpr size_t MAX_BRANCHING_FACTOR = 512;
+// Fraction of L1 a single node should take up
+constexpr size_t NODE_L1_FRACTION = 32;
+// Nodes with a compile-time capacity up to this many arithmetic keys are
+// searched with an unrolled linear scan instead of a binary search
+constexpr size_t LINEAR_SEARCH_MAX_KEYS = 16;
+// Once a split drops a map's learned index, it's fitted again after one more
+// split per this many leaves, so refitting costs a few steps per split
+constexpr size_t RELEARN_LEAVES_PER_SPLIT = 8;
+
+template<typename K, typename V, size_t N = 0>
 	requires std::totally_ordered<K>
 class OrderedMapNode;
 
+// Heap memory owned by a key or value, on top of its sizeof
+template<typename T>
+size_t heap_size(const T&)
+{
+	return 0;
+}
+
+template<typename C, typename Traits, typename A>
+size_t heap_size(const std::basic_string<C, Traits, A>& s)
+{
+	// Short strings are stored inside the object
+	const char* data = (const char*)s.data();
+	const char* object = (const char*)&s;
+	if (data >= object && data < object + sizeof(s)) return 0;
+	return (s.capacity() + 1) * sizeof(C);
+}
+
+// Counted in full by every map that shares it, so sharing overestimates
+template<typename T>
+size_t heap_size(const std::shared_ptr<T>& p)
+{
+	return p ? sizeof(T) + heap_size(*p) : 0;
+}
+
 template<typename V>
 struct OrderedMapNodeValue {
 	bool isDeleted;
 	V value;
 };
 
-template<typename K, typename V>
+template<typename K, typename V, size_t N = 0>
 	requires std::totally_ordered<K>
 union OrderedMapNodeChild {
-	OrderedMapNode<K, V>* node;
+	OrderedMapNode<K, V, N>* node;
 	OrderedMapNodeValue<V> value;
 	OrderedMapNodeChild() : node{ nullptr } {};
-	OrderedMapNodeChild(OrderedMapNode<K, V>* node) : node{ node } {};
-	OrderedMapNodeChild(OrderedMapNodeValue<V> value) : value{ value } {};
-	OrderedMapNodeChild(const OrderedMapNodeChild<K, V>& other) { memcpy(this, &other, sizeof(OrderedMapNodeChild<K, V>)); };
+	OrderedMapNodeChild(OrderedMapNode<K, V, N>* node) : node{ node } {};
+	OrderedMapNodeChild(OrderedMapNodeValue<V> value) : value{ std::move(value) } {};
+	OrderedMapNodeChild(const OrderedMapNodeChild<K, V, N>& other) { memcpy(this, &other, sizeof(OrderedMapNodeChild<K, V, N>)); };
 	OrderedMapNodeChild& operator=(const OrderedMapNodeChild& other)
 	{
-		memcpy(this, &other, sizeof(OrderedMapNodeChild<K, V>));
+		memcpy(this, &other, sizeof(OrderedMapNodeChild<K, V, N>));
 		return *this;
 	};
 	~OrderedMapNodeChild() {};
 };
 
+// Node capacity for OrderedMap<K, V> given the cache line and L1 data cache
+// sizes. A node's keys and children are sized to a fixed slice of L1, so the
+// upper levels of the tree stay cached while a lookup binary searches them.
 template<typename K, typename V>
+constexpr size_t branching_factor_for(size_t lineSize, size_t l1Size)
+{
+	size_t entrySize = sizeof(K) + sizeof(OrderedMapNodeChild<K, V>);
+	size_t nodeSize = l1Size / NODE_L1_FRACTION;
+	// Round to whole cache lines of keys
+	size_t keysPerLine = lineSize >= sizeof(K) ? lineSize / sizeof(K) : 1;
+	size_t factor = nodeSize / entrySize / keysPerLine * keysPerLine;
+	return std::clamp(factor, MIN_BRANCHING_FACTOR, MAX_BRANCHING_FACTOR);
+}
+
+// Compile-time default, for when the map isn't created through Collection
+template<typename K, typename V>
+constexpr size_t default_branching_factor()
+{
+	return branching_factor_for<K, V>(ASSUMED_CACHE_LINE_SIZE, ASSUMED_L1_CACHE_SIZE);
+}
+
+template<typename K, typename V, size_t N>
 	requires std::totally_ordered<K>
 class OrderedMapNode {
 	// A node in the B+ tree
 	// Note: for branch nodes, the first key is used to store the minimum value
 	// contained within the subtree.
+	// With N = 0 the key and child arrays are allocated to the branching factor
+	// given at runtime. Otherwise the node holds N of each inline.
+	using KeyArray = std::conditional_t<N == 0, K*, std::array<K, N>>;
+	using ChildArray = std::conditional_t<N == 0, OrderedMapNodeChild<K, V, N>*, std::array<OrderedMapNodeChild<K, V, N>, N>>;
 public:
 	size_t mSize;
 	bool mIsLeafNode;
-	OrderedMapNodeChild<K, V>* mChildren;
-	K* mKeys;
+	ChildArray mChildren;
+	KeyArray mKeys;
+	// Branch nodes only: the number of live entries under each child
+	size_t* mCounts;
+	// Leaf nodes only: the neighbouring leaves, in key order
 	OrderedMapNode* mNext;
+	OrderedMapNode* mPrev;
 
-	OrderedMapNode(size_t branchingFactor=DEFAULT_BRANCHING_FACTOR) : 
+	OrderedMapNode(size_t branchingFactor=default_branching_factor<K, V>(), bool isLeafNode=true) : 
 		mSize{ 0 }, 
-		mIsLeafNode{ true },
-		mKeys{ new K[branchingFactor] },
-		mChildren{ new OrderedMapNodeChild<K, V>[branchingFactor] },
-		mNext { nullptr }
+		mIsLeafNode{ isLeafNode },
+		mChildren{ make_children(capacity(branchingFactor)) },
+		mKeys{ make_keys(capacity(branchingFactor)) },
+		mCounts{ isLeafNode ? nullptr : new size_t[capacity(branchingFactor)] },
+		mNext { nullptr },
+		mPrev { nullptr }
 	{};
 	OrderedMapNode(const OrderedMapNode& other) = delete;
 	OrderedMapNode(OrderedMapNode&& other) :
 		mSize{ 0 },
 		mIsLeafNode{ true },
-		mKeys{ nullptr },
-		mNext{ nullptr }
+		mChildren{},
+		mKeys{},
+		mCounts{ nullptr },
+		mNext{ nullptr },
+		mPrev{ nullptr }
 	{
 		swap(*this, other);
 	}
@@ -75,11 +156,30 @@ public:
 		std::swap(a.mSize, b.mSize);
 		std::swap(a.mChildren, b.mChildren);
 		std::swap(a.mIsLeafNode, b.mIsLeafNode);
-		std::swap(a.mChildrenKeys, b.mChildrenKeys);
+		std::swap(a.mKeys, b.mKeys);
+		std::swap(a.mCounts, b.mCounts);
 		std::swap(a.mNext, b.mNext);
+		std::swap(a.mPrev, b.mPrev);
+	}
+
+	// The node's capacity, known at compile time unless N is 0
+	static constexpr size_t capacity(size_t branchingFactor)
+	{
+		return N ? N : branchingFactor;
+	}
+
+	// Bytes allocated for a node, not counting what its keys and values own
+	static size_t node_bytes(size_t branchingFactor, bool isLeafNode)
+	{
+		size_t bytes = sizeof(OrderedMapNode);
+		if constexpr (N == 0) bytes += branchingFactor * (sizeof(K) + sizeof(OrderedMapNodeChild<K, V, N>));
+		if (!isLeafNode) bytes += capacity(branchingFactor) * sizeof(size_t);
+		return bytes;
 	}
 
-	OrderedMapNode* set_value(K key, OrderedMapNodeChild<K, V> value, size_t branchingFactor);
+	// Inserts or replaces an entry. For branch nodes, `count` is the number of
+	// live entries under the new child. Returns the new node if this one split.
+	OrderedMapNode* set_value(K key, OrderedMapNodeChild<K, V, N> value, size_t branchingFactor, size_t count = 0);
 
 	void print(std::ostream& out = std::cout, int depth = 0)
 	{
@@ -107,23 +207,68 @@ public:
 		}
 	}
 
-	// For a given key, return the index of the subtree that would contain the key.
-	size_t child_position(K key) const {
-		if (mSize <= 1 || key < mKeys[1]) return 0;
-
-		ptrdiff_t left = 1;
-		ptrdiff_t right = mSize - 1;
-		ptrdiff_t mid;
-		while (right > left) {
-			mid = (left + right + 1) / 2;
-			if (key < mKeys[mid]) {
-				right = mid - 1;
+	// Number of keys less than the key, or not greater than it if `inclusive`.
+	// For arithmetic keys in nodes with a compile-time capacity the loop has a
+	// fixed trip count, so it's unrolled into branchless code, and vectorized
+	// for small nodes. Other keys are dominated by the cost of comparing them.
+	template<bool Inclusive = false>
+	size_t search(const K& key) const {
+		auto before = [&key](const K& other) { return Inclusive ? !(key < other) : other < key; };
+		if constexpr (N > 0 && N <= LINEAR_SEARCH_MAX_KEYS && std::is_arithmetic_v<K>) {
+			size_t position = 0;
+			for (size_t i = 0; i < N; i++) {
+				position += (i < mSize) & before(mKeys[i]);
 			}
-			else {
-				left = mid;
+			return position;
+		}
+		else if constexpr (N > 0 && std::is_arithmetic_v<K>) {
+			// Binary search in power of two steps from the largest below N
+			size_t position = 0;
+			for (size_t step = std::bit_floor(N); step > 0; step >>= 1) {
+				if (position + step <= mSize && before(mKeys[position + step - 1])) position += step;
 			}
+			return position;
+		}
+		else {
+			const K* keys = &mKeys[0];
+			if constexpr (Inclusive) return std::upper_bound(keys, keys + mSize, key) - keys;
+			else return std::lower_bound(keys, keys + mSize, key) - keys;
+		}
+	}
+
+	// For a given key, return the index of the subtree that would contain the key.
+	size_t child_position(const K& key) const {
+		size_t position = search<true>(key);
+		return position == 0 ? 0 : position - 1;
+	}
+
+	// For a leaf node, return the index of the key, or -1 if it isn't present.
+	ptrdiff_t leaf_position(const K& key) const {
+		size_t position = search(key);
+		if (position < mSize && mKeys[position] == key) return position;
+		return -1;
+	}
+
+	// Starts fetching the first keys and children into the cache
+	void prefetch_entries() const {
+		KVS_PREFETCH(&mKeys[0]);
+		KVS_PREFETCH(&mChildren[0]);
+	}
+
+	// Starts fetching the keys the first steps of a search compare against
+	void prefetch_search() const {
+		KVS_PREFETCH(&mKeys[mSize / 2]);
+		KVS_PREFETCH(&mKeys[mSize / 4]);
+		KVS_PREFETCH(&mKeys[mSize * 3 / 4]);
+	}
+
+	// Number of live (not deleted) entries in this subtree
+	size_t live_count() const {
+		size_t count = 0;
+		for (size_t i = 0; i < mSize; i++) {
+			count += mIsLeafNode ? !mChildren[i].value.isDeleted : mCounts[i];
 		}
-		return left;  
+		return count;
 	}
 
 	K min_key() {
@@ -144,81 +289,125 @@ public:
 				mChildren[i].value.OrderedMapNodeValue<V>::~OrderedMapNodeValue();
 			}
 		}
-		delete[] mChildren;
-		delete[] mKeys;
+		if constexpr (N == 0) {
+			delete[] mChildren;
+			delete[] mKeys;
+		}
+		delete[] mCounts;
 	};
+private:
+	static ChildArray make_children(size_t branchingFactor)
+	{
+		if constexpr (N == 0) return new OrderedMapNodeChild<K, V, N>[branchingFactor];
+		else return ChildArray{};
+	}
+
+	static KeyArray make_keys(size_t branchingFactor)
+	{
+		if constexpr (N == 0) return new K[branchingFactor];
+		else return KeyArray{};
+	}
 };
 
 
 // A map with linear-time key-order traversal
-// Implemented as a B+ tree
-template<typename K, typename V>
+// Implemented as a B+ tree. A nonzero N fixes the branching factor at compile
+// time and stores the node arrays inline, see OrderedMapNode.
+template<typename K, typename V, size_t N = 0>
 	requires std::totally_ordered<K>
 class OrderedMap
 {
 public:
+	// Refers to the entries where they are stored in the leaves, so moving it
+	// doesn't copy anything. It's invalidated by any change to the map.
+	// Moving in either direction starts fetching the next leaf that way, and
+	// halfway through a leaf, the start of the next leaf's entries. end() is
+	// past both the last and the first entry.
 	struct Iterator {
 	public:
-		using iterator_category = std::forward_iterator_tag;
+		struct Entry { const K& first; const V& second; bool isDeleted; };
+
+		using iterator_category = std::input_iterator_tag;
+		using iterator_concept = std::bidirectional_iterator_tag;
 		using difference_type = std::ptrdiff_t;
-		using value_type = struct { K first; V second; bool isDeleted; };
-		using pointer = value_type*;
-		using reference = value_type&; 
-
-		Iterator(K key, OrderedMapNodeValue<V> value, const OrderedMapNode<K, V>* parent) :
-			ptr{ value_type { key, value.value, value.isDeleted } },
-			parent { parent },
-			keyIndex { 0 }
+		using value_type = Entry;
+		using reference = Entry;
+		// Holds the entry for operator->
+		struct pointer {
+			Entry entry;
+			const Entry* operator->() const { return &entry; }
+		};
+
+		Iterator() : parent{ nullptr }, keyIndex{ 0 } {};
+		Iterator(const OrderedMapNode<K, V, N>* parent, size_t keyIndex) :
+			parent{ nullptr },
+			keyIndex{ 0 }
 		{
-			if (!parent) return;
-			for (size_t i = 0; i < parent->mSize; i++) {
-				if (parent->mKeys[i] == key) {
-					keyIndex = i;
-				}
-			}
+			enter(parent, keyIndex, parent ? parent->mNext : nullptr);
 		};
-		reference operator*() { return ptr; }
-		pointer operator->() { return &ptr; }
+		reference operator*() const
+		{
+			const auto& value = parent->mChildren[keyIndex].value;
+			return { parent->mKeys[keyIndex], value.value, value.isDeleted };
+		}
+		pointer operator->() const { return { **this }; }
 
 		Iterator operator++(int) { Iterator tmp = *this; ++(*this); return tmp; }
-		Iterator& operator++() 
-		{ 
-			if (keyIndex < parent->mSize - 1) {
-				keyIndex += 1;
+		Iterator& operator++()
+		{
+			if (++keyIndex < parent->mSize) {
+				if (keyIndex == parent->mSize / 2 && parent->mNext) parent->mNext->prefetch_entries();
 			}
-			else if (parent->mNext) {
-				parent = parent->mNext;
-				keyIndex = 0;
+			else {
+				auto next = parent->mNext;
+				enter(next, 0, next ? next->mNext : nullptr);
+			}
+			return *this;
+		}
+
+		Iterator operator--(int) { Iterator tmp = *this; --(*this); return tmp; }
+		Iterator& operator--()
+		{
+			if (keyIndex > 0) {
+				if (--keyIndex == parent->mSize / 2 && parent->mPrev) parent->mPrev->prefetch_entries();
 			}
 			else {
-				parent = nullptr;
-				return *this;
+				auto prev = parent->mPrev;
+				enter(prev, prev ? prev->mSize - 1 : 0, prev ? prev->mPrev : nullptr);
 			}
-			ptr.first = parent->mKeys[keyIndex];
-			ptr.second = parent->mChildren[keyIndex].value.value;
-			return *this; 
+			return *this;
 		}
 
-		friend bool operator== (const Iterator& a, const Iterator& b) 
+		friend bool operator== (const Iterator& a, const Iterator& b)
 		{
-			if (a.parent == nullptr && b.parent == nullptr) return true;
 			return a.parent == b.parent && a.keyIndex == b.keyIndex;
 		};
-		friend bool operator!= (const Iterator& a, const Iterator& b) 
+		friend bool operator!= (const Iterator& a, const Iterator& b)
 		{
-			if (a.parent == nullptr && b.parent == nullptr) return false;
-			return a.parent != b.parent || a.keyIndex != b.keyIndex;
+			return !(a == b);
 		};
 
-		value_type ptr;
-		const OrderedMapNode<K, V>* parent;
+		const OrderedMapNode<K, V, N>* parent;
 		size_t keyIndex;
+	private:
+		// Moves to the entry, and starts fetching `ahead`, the leaf after it in
+		// the direction of travel
+		void enter(const OrderedMapNode<K, V, N>* leaf, size_t index, const OrderedMapNode<K, V, N>* ahead)
+		{
+			parent = leaf;
+			keyIndex = leaf ? index : 0;
+			KVS_PREFETCH(ahead);
+		}
 	};
 
-	OrderedMap(size_t branchingFactor=DEFAULT_BRANCHING_FACTOR) :
-		mRoot{ new OrderedMapNode<K, V>(branchingFactor) },
-		mBranchingFactor{ branchingFactor },
-		mHeight { 1 }
+	static_assert(N == 0 || N >= MIN_BRANCHING_FACTOR, "Nodes need room for a few keys");
+
+	// The branching factor is ignored if N is given
+	OrderedMap(size_t branchingFactor=default_branching_factor<K, V>()) :
+		mRoot{ new OrderedMapNode<K, V, N>(branchingFactor) },
+		mBranchingFactor{ OrderedMapNode<K, V, N>::capacity(branchingFactor) },
+		mHeight { 1 },
+		mBytes { OrderedMapNode<K, V, N>::node_bytes(branchingFactor, true) }
 	{};
 	OrderedMap(const OrderedMap& other) = delete;
 	OrderedMap(OrderedMap&& other) noexcept : OrderedMap()
@@ -240,6 +429,12 @@ public:
 		using std::swap;
 		swap(a.mRoot, b.mRoot);
 		swap(a.mBranchingFactor, b.mBranchingFactor);
+		swap(a.mHeight, b.mHeight);
+		swap(a.mBytes, b.mBytes);
+		swap(a.mLearned, b.mLearned);
+		swap(a.mLearnedError, b.mLearnedError);
+		swap(a.mStaleSplits, b.mStaleSplits);
+		swap(a.mStaleLeaves, b.mStaleLeaves);
 	};
 
 	Iterator begin() const 
@@ -247,79 +442,217 @@ public:
 		if (mRoot->mSize == 0) return end();
 		auto curr = mRoot;
 		while (!curr->mIsLeafNode) curr = curr->mChildren[0].node;
-		return Iterator(curr->mKeys[0], curr->mChildren[0].value, curr);
+		return Iterator(curr, 0);
+	}
+
+	// The last entry, for iterating backwards down to end()
+	Iterator last() const
+	{
+		if (mRoot->mSize == 0) return end();
+		auto curr = mRoot;
+		while (!curr->mIsLeafNode) curr = curr->mChildren[curr->mSize - 1].node;
+		return Iterator(curr, curr->mSize - 1);
 	}
 
 	Iterator end() const
 	{
-		return Iterator(mRoot->mKeys[mRoot->mSize], mRoot->mChildren[mRoot->mSize].value, nullptr);
+		return Iterator();
 	}
 
 	V& at(K key, bool* isDeleted = nullptr) const 
 	{
+		auto leaf = find_leaf(key);
+		ptrdiff_t i = leaf ? leaf->leaf_position(key) : -1;
+		if (i < 0) throw std::out_of_range("Key not found");
+		if (isDeleted) *isDeleted = leaf->mChildren[i].value.isDeleted;
+		return leaf->mChildren[i].value.value;
+	}
+
+	bool del(K key)
+	{
+		auto leaf = find_leaf(key);
+		ptrdiff_t i = leaf ? leaf->leaf_position(key) : -1;
+		if (i < 0) return false;
+		if (!leaf->mChildren[i].value.isDeleted) {
+			leaf->mChildren[i].value.isDeleted = true;
+			add_count(key, -1);
+		}
+		return true;
+	}
+
+	// Bytes allocated for the nodes and owned by the keys and values,
+	// including deleted entries, and by the learned index
+	size_t memory_usage() const { return mBytes + (mLearned ? mLearned->memory_usage() : 0); }
+
+	// Number of live keys
+	size_t size() const { return mRoot->live_count(); }
+
+	// Number of live keys less than the key
+	size_t rank(const K& key) const { return count_below(key, false); }
+
+	// Number of live keys in [lo, hi]
+	size_t count(const K& lo, const K& hi) const
+	{
+		if (hi < lo) return 0;
+		return count_below(hi, true) - count_below(lo, false);
+	}
+
+	// The live entry with the given rank, or end() if there are fewer live keys
+	Iterator select(size_t n) const
+	{
+		if (n >= size()) return end();
 		auto curr = mRoot;
-		while (true) {
-			if (!curr || curr->mSize == 0) throw std::out_of_range("Key not found");
-			if (!curr->mIsLeafNode) {
-				size_t i = curr->child_position(key);
-				curr = curr->mChildren[i].node;
+		while (!curr->mIsLeafNode) {
+			size_t j = 0;
+			while (n >= curr->mCounts[j]) {
+				n -= curr->mCounts[j];
+				j++;
 			}
-			else {
-				ptrdiff_t left = 0;
-				ptrdiff_t right = curr->mSize - 1;
-				ptrdiff_t mid;
-
-				while (left <= right) {
-					mid = (left + right) / 2;
-					if (key == curr->mKeys[mid]) {
-						if (isDeleted) *isDeleted = curr->mChildren[mid].value.isDeleted;
-						return curr->mChildren[mid].value.value;
-					}
-					else if (key < curr->mKeys[mid]) {
-						right = mid - 1;
-					}
-					else {
-						left = mid + 1;
-					}
+			curr = curr->mChildren[j].node;
+		}
+		for (size_t i = 0;; i++) {
+			if (curr->mChildren[i].value.isDeleted) continue;
+			if (n == 0) return Iterator(curr, i);
+			n--;
+		}
+	}
+
+	// Splits the `total` live entries starting with the one of rank `first`
+	// into up to `parts` runs of about the same size. Runs are found through
+	// the subtree counts, without scanning, and given as their first entry and
+	// the number of live entries in them.
+	std::vector<std::pair<Iterator, size_t>> partition(size_t first, size_t total, size_t parts) const
+	{
+		std::vector<std::pair<Iterator, size_t>> runs;
+		parts = (std::min)(parts, total);
+		for (size_t i = 0; i < parts; i++) {
+			size_t begin = first + total * i / parts;
+			size_t end = first + total * (i + 1) / parts;
+			runs.emplace_back(select(begin), end - begin);
+		}
+		return runs;
+	}
+
+	// Looks up `count` keys given in ascending order, calling found(i, entry)
+	// with the entry of keys[i], or nullptr if it's not in the map. Entries
+	// may be deleted. The keys share one descent, a level at a time: each
+	// node on their paths is visited once, and every node of a level is
+	// prefetched before the first is searched, so their cache misses overlap.
+	template<typename F>
+	void find_sorted(const K* const* keys, size_t count, F&& found) const
+	{
+		if (count == 0) return;
+		if (mRoot->mSize == 0) {
+			for (size_t i = 0; i < count; i++) found(i, (const OrderedMapNodeValue<V>*)nullptr);
+			return;
+		}
+
+		// The keys in [first, last) are under the node
+		struct Run {
+			const OrderedMapNode<K, V, N>* node;
+			size_t first;
+			size_t last;
+		};
+		std::vector<Run> level{ { mRoot, 0, count } };
+		std::vector<Run> next;
+		while (!level.front().node->mIsLeafNode) {
+			for (const auto& run : level) run.node->prefetch_search();
+			next.clear();
+			for (const auto& run : level) {
+				auto node = run.node;
+				for (size_t i = run.first; i < run.last;) {
+					size_t j = node->child_position(*keys[i]);
+					size_t end = i + 1;
+					if (j + 1 == node->mSize) end = run.last;
+					while (end < run.last && *keys[end] < node->mKeys[j + 1]) end++;
+					next.push_back({ node->mChildren[j].node, i, end });
+					KVS_PREFETCH(next.back().node);
+					i = end;
 				}
-				throw std::out_of_range("Key not found");
+			}
+			std::swap(level, next);
+		}
+
+		for (const auto& run : level) run.node->prefetch_search();
+		std::vector<const OrderedMapNodeValue<V>*> entries(count);
+		for (const auto& run : level) {
+			for (size_t i = run.first; i < run.last; i++) {
+				ptrdiff_t position = run.node->leaf_position(*keys[i]);
+				if (position < 0) continue;
+				entries[i] = &run.node->mChildren[position].value;
+				KVS_PREFETCH(entries[i]);
 			}
 		}
+		for (size_t i = 0; i < count; i++) found(i, entries[i]);
 	}
 
-	bool del(K key)
+	// Numeric keys only. Fits a LearnedIndex to the first keys of the leaves,
+	// which find_leaf then uses instead of descending the tree, and keeps
+	// one from then on. Meant for dense or evenly spread keys. Keys appended
+	// in order extend it. Other splits drop it, and lookups fall back to the
+	// tree until it's fitted again, see RELEARN_LEAVES_PER_SPLIT.
+	void learn(size_t maxError = LearnedIndex<K, OrderedMapNode<K, V, N>*>::DEFAULT_MAX_ERROR)
+		requires std::is_arithmetic_v<K>
+	{
+		mLearned.reset();
+		mLearnedError = maxError;
+		mStaleSplits = 0;
+		if (mRoot->mSize == 0) return;
+		auto leaf = mRoot;
+		while (!leaf->mIsLeafNode) leaf = leaf->mChildren[0].node;
+		std::vector<K> keys;
+		std::vector<OrderedMapNode<K, V, N>*> leaves;
+		for (; leaf; leaf = leaf->mNext) {
+			keys.push_back(leaf->mKeys[0]);
+			leaves.push_back(leaf);
+		}
+		mLearned = std::make_unique<LearnedIndex<K, OrderedMapNode<K, V, N>*>>(std::move(keys), std::move(leaves), maxError);
+	}
+
+	// The learned index, or nullptr if it isn't fitted or a split dropped it
+	const LearnedIndex<K, OrderedMapNode<K, V, N>*>* learned() const { return mLearned.get(); }
+
+	// Returns the leaf whose range covers the key, or nullptr if the map is empty
+	OrderedMapNode<K, V, N>* find_leaf(const K& key) const
 	{
 		auto curr = mRoot;
-		while (true) {
-			if (!curr || curr->mSize == 0) return false;
-			if (!curr->mIsLeafNode) {
-				size_t i = curr->child_position(key);
-				curr = curr->mChildren[i].node;
-			}
-			else {
-				ptrdiff_t left = 0;
-				ptrdiff_t right = curr->mSize - 1;
-				ptrdiff_t mid;
-
-				while (left <= right) {
-					mid = (left + right) / 2;
-					if (key == curr->mKeys[mid]) {
-						curr->mChildren[mid].value.isDeleted = true;
-						return true;
-					}
-					else if (key < curr->mKeys[mid]) {
-						right = mid - 1;
-					}
-					else {
-						left = mid + 1;
-					}
-				}
-				return false;
-			} 
+		if (curr->mSize == 0) return nullptr;
+		if constexpr (std::is_arithmetic_v<K>) {
+			if (mLearned) return mLearned->find(key);
+		}
+		while (!curr->mIsLeafNode) {
+			curr = curr->mChildren[curr->child_position(key)].node;
+		}
+		return curr;
+	}
+
+	// Returns the leaf the key ended up in. If inserting it split a leaf,
+	// `splitLeaf` is set to the new leaf holding the upper half.
+	OrderedMapNode<K, V, N>* set(K key, V value, bool setAsDeleted = false, OrderedMapNode<K, V, N>** splitLeaf = nullptr); 
+
+	// Read-modify-write of the key's value. `modify(V& value, bool exists)`
+	// changes the live value in place, or fills in a default constructed one
+	// if the key is missing or deleted, and returns whether it changed
+	// anything. A live key takes a single descent, others are inserted with
+	// set. Returns the leaf the key is in if it was changed, else nullptr.
+	template<typename F>
+	OrderedMapNode<K, V, N>* update(const K& key, F&& modify, OrderedMapNode<K, V, N>** splitLeaf = nullptr)
+	{
+		if (splitLeaf) *splitLeaf = nullptr;
+		auto leaf = find_leaf(key);
+		ptrdiff_t i = leaf ? leaf->leaf_position(key) : -1;
+		if (i >= 0 && !leaf->mChildren[i].value.isDeleted) {
+			V& value = leaf->mChildren[i].value.value;
+			mBytes -= heap_size(value);
+			bool changed = modify(value, true);
+			mBytes += heap_size(value);
+			return changed ? leaf : nullptr;
 		}
+		V value{};
+		if (!modify(value, false)) return nullptr;
+		return set(key, std::move(value), false, splitLeaf);
 	}
 
-	void set(K key, V value, bool setAsDeleted = false); 
 	void print(std::ostream& out = std::cout) const
 	{
 		mRoot->print(out);
@@ -327,31 +660,86 @@ public:
 
 	V& operator[](const K& key) const {}
 private:
-	OrderedMapNode<K, V>* mRoot;
+	OrderedMapNode<K, V, N>* mRoot;
 	size_t mBranchingFactor;
 	size_t mHeight;
+	size_t mBytes;
+	// Leaves by their first keys, see learn()
+	std::unique_ptr<LearnedIndex<K, OrderedMapNode<K, V, N>*>> mLearned;
+	// The error learn() was called with, if it was
+	std::optional<size_t> mLearnedError;
+	// Splits since the learned index was dropped, and the leaves it had
+	size_t mStaleSplits = 0;
+	size_t mStaleLeaves = 0;
+
+	// Keeps the learned index in step with a split that created `leaf`
+	void learn_split(OrderedMapNode<K, V, N>* leaf)
+	{
+		if constexpr (std::is_arithmetic_v<K>) {
+			if (!mLearnedError) return;
+			// Keys appended in order only ever split the last leaf, whose
+			// upper half goes at the end of the index
+			if (mLearned && !leaf->mNext) {
+				mLearned->append(leaf->mKeys[0], leaf);
+				return;
+			}
+			// Any other split moves the leaves after it
+			if (mLearned) {
+				mStaleLeaves = mLearned->size();
+				mLearned.reset();
+			}
+			if (++mStaleSplits * RELEARN_LEAVES_PER_SPLIT >= mStaleLeaves) learn(*mLearnedError);
+		}
+	}
+
+	// Adds delta to the live counts on the path to the key
+	void add_count(const K& key, ptrdiff_t delta)
+	{
+		auto curr = mRoot;
+		while (!curr->mIsLeafNode) {
+			size_t j = curr->child_position(key);
+			curr->mCounts[j] += delta;
+			curr = curr->mChildren[j].node;
+		}
+	}
+
+	// Number of live keys less than (or equal to, if inclusive) the key
+	size_t count_below(const K& key, bool inclusive) const
+	{
+		size_t count = 0;
+		auto curr = mRoot;
+		while (!curr->mIsLeafNode) {
+			size_t j = curr->child_position(key);
+			for (size_t i = 0; i < j; i++) count += curr->mCounts[i];
+			curr = curr->mChildren[j].node;
+		}
+		for (size_t i = 0; i < curr->mSize && (curr->mKeys[i] < key || (inclusive && curr->mKeys[i] == key)); i++) {
+			count += !curr->mChildren[i].value.isDeleted;
+		}
+		return count;
+	}
 };
 
-template<typename K, typename V>
+template<typename K, typename V, size_t N>
 	requires std::totally_ordered<K>
-OrderedMapNode<K, V>* OrderedMapNode<K, V>::set_value(K key, OrderedMapNodeChild<K, V> value, size_t branchingFactor)
+OrderedMapNode<K, V, N>* OrderedMapNode<K, V, N>::set_value(K key, OrderedMapNodeChild<K, V, N> value, size_t branchingFactor, size_t count)
 {
 	// linear-time insertion
 	// First determine the insertion point
-	size_t i;
-	for (i = 0; i < mSize && mKeys[i] < key; i++);
+	size_t i = search(key);
 	if (mIsLeafNode && i < mSize && mKeys[i] == key) {
-		// Value exists, set it
+		// Value exists, release the old one and take ownership of the new one
+		mChildren[i].value.OrderedMapNodeValue<V>::~OrderedMapNodeValue();
 		mChildren[i] = value;
 		return nullptr;
 	}
 
+	branchingFactor = capacity(branchingFactor);
 	if ((mIsLeafNode && mSize == branchingFactor - 1) || (!mIsLeafNode && mSize == branchingFactor)) {
 		// Split the node into two new nodes, return the new node
 		size_t half = (size_t)ceil((double)mSize / 2.0f);
 
-		OrderedMapNode* newNode = new OrderedMapNode(branchingFactor);
-		newNode->mIsLeafNode = mIsLeafNode;
+		OrderedMapNode* newNode = new OrderedMapNode(branchingFactor, mIsLeafNode);
 
 		size_t k = 0;
 
@@ -359,21 +747,24 @@ OrderedMapNode<K, V>* OrderedMapNode<K, V>::set_value(K key, OrderedMapNodeChild
 			// The new value will get inserted in the first half
 			// First, copy the second half over to the new node
 			for (size_t j = half - 1; j < mSize; j++, k++) {
-				newNode->mKeys[k] = mKeys[j];
+				newNode->mKeys[k] = std::move(mKeys[j]);
 				newNode->mChildren[k] = mChildren[j];
+				if (mCounts) newNode->mCounts[k] = mCounts[j];
 				if (!mIsLeafNode) mChildren[j].node = nullptr;
 			}
 			if (half >= 2) {
 				// Shift down the necessary portion of the first half (which is our current node)
 				for (size_t j = half - 2; j >= i; j--) {
-					mKeys[j + 1] = mKeys[j];
+					mKeys[j + 1] = std::move(mKeys[j]);
 					mChildren[j + 1] = mChildren[j];
+					if (mCounts) mCounts[j + 1] = mCounts[j];
 					if (j == 0) break; // prevent negative integer overflow
 				}
 			}
 			// Insert the new value in the first half
-			mKeys[i] = key;
+			mKeys[i] = std::move(key);
 			mChildren[i] = value;
+			if (mCounts) mCounts[i] = count;
 
 			newNode->mSize = k;
 		}
@@ -381,18 +772,21 @@ OrderedMapNode<K, V>* OrderedMapNode<K, V>::set_value(K key, OrderedMapNodeChild
 			// The new value will get inserted in the second half
 			for (size_t j = half; j < i; j++, k++) {
 				// Copy over the part of the second half that comes before the value
-				newNode->mKeys[k] = mKeys[j];
+				newNode->mKeys[k] = std::move(mKeys[j]);
 				newNode->mChildren[k] = mChildren[j];
+				if (mCounts) newNode->mCounts[k] = mCounts[j];
 				if (!mIsLeafNode) mChildren[j].node = nullptr;
 			}
 			// Add the new value to the new node
-			newNode->mKeys[k] = key;
+			newNode->mKeys[k] = std::move(key);
 			newNode->mChildren[k] = value;
+			if (mCounts) newNode->mCounts[k] = count;
 			k++;
 			// Copy the remainder of the second half
 			for (size_t j = i; j < mSize; j++, k++) {
-				newNode->mKeys[k] = mKeys[j];
+				newNode->mKeys[k] = std::move(mKeys[j]);
 				newNode->mChildren[k] = mChildren[j];
+				if (mCounts) newNode->mCounts[k] = mCounts[j];
 				if (!mIsLeafNode) mChildren[j].node = nullptr;
 			}
 
@@ -401,6 +795,8 @@ OrderedMapNode<K, V>* OrderedMapNode<K, V>::set_value(K key, OrderedMapNodeChild
 
 		if (mIsLeafNode) {
 			newNode->mNext = mNext;
+			newNode->mPrev = this;
+			if (mNext) mNext->mPrev = newNode;
 			mNext = newNode;
 		}
 
@@ -411,13 +807,15 @@ OrderedMapNode<K, V>* OrderedMapNode<K, V>::set_value(K key, OrderedMapNodeChild
 		// No split
 		if (mSize > 0) {
 			for (size_t j = mSize - 1; j >= i; j--) {
-				mKeys[j + 1] = mKeys[j];
+				mKeys[j + 1] = std::move(mKeys[j]);
 				mChildren[j + 1] = mChildren[j];
+				if (mCounts) mCounts[j + 1] = mCounts[j];
 				if (j == 0) break;	// prevent negative integer overflow
 			}
 		}
-		mKeys[i] = key;
+		mKeys[i] = std::move(key);
 		mChildren[i] = value;
+		if (mCounts) mCounts[i] = count;
 		mSize++;
 	}
 
@@ -425,50 +823,83 @@ OrderedMapNode<K, V>* OrderedMapNode<K, V>::set_value(K key, OrderedMapNodeChild
 }
 
 
-template<typename K, typename V>
+template<typename K, typename V, size_t N>
 	requires std::totally_ordered<K>
-void OrderedMap<K, V>::set(K key, V value, bool setAsDeleted)
+OrderedMapNode<K, V, N>* OrderedMap<K, V, N>::set(K key, V value, bool setAsDeleted, OrderedMapNode<K, V, N>** splitLeaf)
 {
-	OrderedMapNodeChild<K, V> newValue = OrderedMapNodeChild<K, V>( { .isDeleted = setAsDeleted, .value = value });
+	OrderedMapNodeChild<K, V, N> newValue = OrderedMapNodeChild<K, V, N>( { .isDeleted = setAsDeleted, .value = std::move(value) });
 
-	OrderedMapNode<K, V>** stack = new OrderedMapNode<K, V>*[mHeight+1];
+	OrderedMapNode<K, V, N>** stack = new OrderedMapNode<K, V, N>*[mHeight+1];
 
 	stack[0] = mRoot;
 	size_t i = 0;
-	OrderedMapNode<K, V>* curr = mRoot;
+	OrderedMapNode<K, V, N>* curr = mRoot;
 
 	while (!curr->mIsLeafNode) {
 		i += 1;
 		size_t j = curr->child_position(key);
 
-		curr->mKeys[j] = std::min(curr->mKeys[j], key);
+		if (key < curr->mKeys[j]) {
+			mBytes -= heap_size(curr->mKeys[j]);
+			curr->mKeys[j] = key;
+			mBytes += heap_size(curr->mKeys[j]);
+		}
 		curr = curr->mChildren[j].node;
 		stack[i] = curr;
 	};
 
-	OrderedMapNode<K, V>* newNode = curr->set_value(key, newValue, mBranchingFactor);
+	// Keep the live counts on the path in step with the entry being added,
+	// revived or deleted
+	ptrdiff_t existing = curr->leaf_position(key);
+	ptrdiff_t delta = existing < 0 ? !setAsDeleted : (ptrdiff_t)curr->mChildren[existing].value.isDeleted - setAsDeleted;
+	if (delta != 0) {
+		for (size_t l = 0; l < i; l++) {
+			stack[l]->mCounts[stack[l]->child_position(key)] += delta;
+		}
+	}
+	// An overwrite keeps the stored key and releases the old value
+	if (existing >= 0) mBytes -= heap_size(curr->mChildren[existing].value.value);
+
+	OrderedMapNode<K, V, N>* leaf = curr;
+	OrderedMapNode<K, V, N>* newNode = curr->set_value(key, newValue, mBranchingFactor);
+	if (splitLeaf) *splitLeaf = newNode;
+	if (newNode && !(key < newNode->mKeys[0])) leaf = newNode;
+
+	// Measure the entry where it was stored
+	ptrdiff_t stored = leaf->leaf_position(key);
+	mBytes += heap_size(leaf->mChildren[stored].value.value);
+	if (existing < 0) mBytes += heap_size(leaf->mKeys[stored]);
 
 	if (!newNode) {
 		delete[] stack;
-		return;
+		return leaf;
 	}
+	mBytes += OrderedMapNode<K, V, N>::node_bytes(mBranchingFactor, true);
+	OrderedMapNode<K, V, N>* newLeaf = newNode;
 
 	while (i > 0 && newNode) {
 		i -= 1;
-		OrderedMapNode<K, V>* parent = stack[i];
+		OrderedMapNode<K, V, N>* parent = stack[i];
+		// The split child handed part of its entries to newNode
+		parent->mCounts[parent->child_position(key)] = stack[i + 1]->live_count();
 		K newKey = newNode->min_key();
-		OrderedMapNodeChild<K, V> newValue = OrderedMapNodeChild<K, V>(newNode);
-		newNode = parent->set_value(newKey, newValue, mBranchingFactor);
+		mBytes += heap_size(newKey);
+		OrderedMapNodeChild<K, V, N> newValue = OrderedMapNodeChild<K, V, N>(newNode);
+		newNode = parent->set_value(std::move(newKey), newValue, mBranchingFactor, newNode->live_count());
+		if (newNode) mBytes += OrderedMapNode<K, V, N>::node_bytes(mBranchingFactor, false);
 	}
 
 	if (i == 0 && newNode) {
-		OrderedMapNode<K, V>* newRoot = new OrderedMapNode<K, V>(mBranchingFactor);
+		OrderedMapNode<K, V, N>* newRoot = new OrderedMapNode<K, V, N>(mBranchingFactor, false);
 		newRoot->mSize = 2;
-		newRoot->mIsLeafNode = false;
 		newRoot->mChildren[0].node = mRoot;
 		newRoot->mChildren[1].node = newNode;
+		newRoot->mCounts[0] = mRoot->live_count();
+		newRoot->mCounts[1] = newNode->live_count();
 		newRoot->mKeys[0] = mRoot->min_key();
 		newRoot->mKeys[1] = newNode->min_key();
+		mBytes += OrderedMapNode<K, V, N>::node_bytes(mBranchingFactor, false);
+		mBytes += heap_size(newRoot->mKeys[0]) + heap_size(newRoot->mKeys[1]);
 
 		if (mRoot->mIsLeafNode)
 			mRoot->mNext = newNode;
@@ -477,5 +908,8 @@ void OrderedMap<K, V>::set(K key, V value, bool setAsDeleted)
 		mHeight++;
 	}
 
+	// Once the leaves are linked, a split root leaf included
+	learn_split(newLeaf);
 	delete[] stack;
+	return leaf;
 }
\ No newline at end of file
@@ -0,0 +1,99 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "OrderedMap.h"
+#include "WorkerPool.h"
+
+// Runs shorter than this aren't worth a worker of their own
+constexpr size_t MIN_ENTRIES_PER_SCAN_THREAD = 16 * 1024;
+
+// Folds the `total` live entries of the map starting with the one of rank
+// `first` into a T, on `pool`, without waiting for it. The range is split
+// into up to `threads` runs with OrderedMap::partition. Each run is folded
+// by its own task, starting from `init`, with fold(T&, const K&, const V&).
+// The task finishing last combines the partial results in key order with
+// merge(T&, T&&) and calls done(std::exception_ptr, T&&), passing the first
+// exception a fold threw, if any. With nothing to fold, `done` is called
+// right away on the calling thread.
+// The map must not change until `done` is called, and `done` must not throw.
+template<typename T, typename K, typename V, size_t N, typename Fold, typename Merge, typename Done>
+void parallel_reduce_async(const OrderedMap<K, V, N>& map, size_t first, size_t total, size_t threads,
+	const T& init, Fold fold, Merge merge, Done done, WorkerPool& pool = WorkerPool::shared())
+{
+	size_t parts = std::clamp(total / MIN_ENTRIES_PER_SCAN_THREAD, (size_t)1, (std::max)(threads, (size_t)1));
+	auto runs = map.partition(first, total, parts);
+	if (runs.empty()) {
+		done(nullptr, T(init));
+		return;
+	}
+
+	// Shared by the tasks, the last one to finish frees it
+	using Runs = decltype(runs);
+	struct Scan {
+		Scan(Runs r, const T& i, Fold f, Merge m, Done d) :
+			runs(std::move(r)), partials(runs.size(), i), init(i),
+			fold(std::move(f)), merge(std::move(m)), done(std::move(d)),
+			remaining(runs.size()) {}
+
+		Runs runs;
+		std::vector<T> partials;
+		T init;
+		Fold fold;
+		Merge merge;
+		Done done;
+		std::atomic<size_t> remaining;
+		std::mutex errorMutex;
+		std::exception_ptr error;
+	};
+	auto scan = std::make_shared<Scan>(std::move(runs), init, std::move(fold), std::move(merge), std::move(done));
+
+	for (size_t i = 0; i < scan->runs.size(); i++) {
+		pool.post([scan, i]() {
+			try {
+				auto it = scan->runs[i].first;
+				for (size_t remaining = scan->runs[i].second; remaining > 0; ++it) {
+					if (it->isDeleted) continue;
+					scan->fold(scan->partials[i], it->first, it->second);
+					remaining--;
+				}
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(scan->errorMutex);
+				if (!scan->error) scan->error = std::current_exception();
+			}
+			if (scan->remaining.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+			T result = std::move(scan->init);
+			if (!scan->error) {
+				for (auto& partial : scan->partials) {
+					scan->merge(result, std::move(partial));
+				}
+			}
+			scan->done(scan->error, std::move(result));
+		});
+	}
+}
+
+// Like parallel_reduce_async, but waits for the result, and rethrows what
+// a fold threw
+template<typename T, typename K, typename V, size_t N, typename Fold, typename Merge>
+T parallel_reduce(const OrderedMap<K, V, N>& map, size_t first, size_t total, size_t threads,
+	const T& init, Fold fold, Merge merge, WorkerPool& pool = WorkerPool::shared())
+{
+	// Owned by the handler too, as set_value may still be running after
+	// get returns
+	auto result = std::make_shared<std::promise<T>>();
+	auto future = result->get_future();
+	parallel_reduce_async(map, first, total, threads, init, std::move(fold), std::move(merge),
+		[result](std::exception_ptr error, T&& value) {
+			if (error) result->set_exception(error);
+			else result->set_value(std::move(value));
+		}, pool);
+	return future.get();
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// KVS_PREFETCH(address) hints that the cache line holding `address` will be
+// read soon. It never faults, so any address may be given, and compiles to
+// nothing where there's no prefetch instruction to use.
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define KVS_PREFETCH(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#elif defined(_MSC_VER) && defined(_M_ARM64)
+#include <intrin.h>
+#define KVS_PREFETCH(address) __prefetch((const void*)(address))
+#elif defined(__GNUC__) || defined(__clang__)
+#define KVS_PREFETCH(address) __builtin_prefetch((const void*)(address))
+#else
+#define KVS_PREFETCH(address) ((void)(address))
+#endif
@@ -0,0 +1,459 @@
+#include "Protocol.h"
+
+#include <charconv>
+
+namespace {
+    // Splits off the next space-delimited token from `rest`.
+    std::string_view nextToken(std::string_view& rest)
+    {
+        size_t end = rest.find(' ');
+        std::string_view token = rest.substr(0, end);
+        rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+        return token;
+    }
+
+    const char* opcodeName(Opcode op)
+    {
+        switch (op) {
+        case Opcode::Get: return "GET";
+        case Opcode::Set: return "SET";
+        case Opcode::Del: return "DEL";
+        case Opcode::MGet: return "MGET";
+        case Opcode::MSet: return "MSET";
+        case Opcode::Count: return "COUNT";
+        case Opcode::Rank: return "RANK";
+        case Opcode::Select: return "SELECT";
+        case Opcode::Sum: return "SUM";
+        case Opcode::Histogram: return "HISTOGRAM";
+        case Opcode::TopKeys: return "TOPKEYS";
+        case Opcode::Incr: return "INCR";
+        case Opcode::Append: return "APPEND";
+        case Opcode::Cas: return "CAS";
+        }
+        return "";
+    }
+
+    void formatResult(const Result& result, std::string& out)
+    {
+        switch (result.status) {
+        case Status::Ok:
+            out += "OK\n";
+            break;
+        case Status::Value:
+            out += "VALUE ";
+            out += result.view();
+            out += '\n';
+            break;
+        case Status::NotFound:
+            out += "NOT_FOUND\n";
+            break;
+        case Status::Error:
+            out += "ERROR ";
+            out += result.data;
+            out += '\n';
+            break;
+        }
+    }
+
+    void putU16(char* out, uint16_t value)
+    {
+        out[0] = (char)(value & 0xff);
+        out[1] = (char)(value >> 8);
+    }
+
+    void putU32(char* out, uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) {
+            out[i] = (char)((value >> (8 * i)) & 0xff);
+        }
+    }
+
+    uint16_t getU16(const char* in)
+    {
+        return (uint16_t)((uint8_t)in[0] | ((uint8_t)in[1] << 8));
+    }
+
+    uint32_t getU32(const char* in)
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= (uint32_t)(uint8_t)in[i] << (8 * i);
+        }
+        return value;
+    }
+
+    void appendU32(std::string& out, uint32_t value)
+    {
+        char bytes[4];
+        putU32(bytes, value);
+        out.append(bytes, 4);
+    }
+
+    // Reads one (u32 length, bytes) item from the front of `rest`
+    bool nextItem(std::string_view& rest, std::string& item)
+    {
+        if (rest.size() < 4) return false;
+        uint32_t length = getU32(rest.data());
+        if (rest.size() - 4 < length) return false;
+        item.assign(rest.data() + 4, length);
+        rest.remove_prefix(4 + (size_t)length);
+        return true;
+    }
+
+    // Checks the number of arguments against what the command expects
+    bool checkArgs(const Request& request, std::string& error)
+    {
+        size_t count = request.args.size();
+        switch (request.op) {
+        case Opcode::Get:
+        case Opcode::Del:
+        case Opcode::Rank:
+            if (count != 1) {
+                error = "Expected exactly one key";
+                return false;
+            }
+            return true;
+        case Opcode::MGet:
+            if (count == 0) {
+                error = "Expected at least one key";
+                return false;
+            }
+            return true;
+        case Opcode::MSet:
+            if (count == 0 || count % 2 != 0) {
+                error = "Expected key value pairs";
+                return false;
+            }
+            return true;
+        case Opcode::Count:
+        case Opcode::Sum:
+            if (count != 0 && count != 2) {
+                error = "Expected an optional lower and upper key";
+                return false;
+            }
+            return true;
+        case Opcode::TopKeys:
+            if (count > 1) {
+                error = "Expected an optional count";
+                return false;
+            }
+            return true;
+        case Opcode::Histogram:
+            if (count != 1 && count != 3) {
+                error = "Expected a prefix length and optional lower and upper key";
+                return false;
+            }
+            return true;
+        case Opcode::Select:
+            if (count != 1 && count != 2) {
+                error = "Expected an offset and optional limit";
+                return false;
+            }
+            return true;
+        case Opcode::Incr:
+            if (count != 1 && count != 2) {
+                error = "Expected a key and optional delta";
+                return false;
+            }
+            return true;
+        case Opcode::Append:
+            if (count != 2) {
+                error = "Expected a key and suffix";
+                return false;
+            }
+            return true;
+        case Opcode::Cas:
+            if (count != 3) {
+                error = "Expected a key, expected value and new value";
+                return false;
+            }
+            return true;
+        default:
+            return true;
+        }
+    }
+
+    Result parseResult(std::string_view line)
+    {
+        if (line == "OK") return { Status::Ok, "" };
+        if (line == "NOT_FOUND") return { Status::NotFound, "" };
+        if (line.starts_with("VALUE ")) return { Status::Value, std::string(line.substr(6)) };
+        if (line.starts_with("ERROR ")) return { Status::Error, std::string(line.substr(6)) };
+        return { Status::Error, "Malformed response: " + std::string(line) };
+    }
+}
+
+bool parseRequest(std::string_view line, Request& request, std::string& error)
+{
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+    std::string_view rest = line;
+    std::string_view command = nextToken(rest);
+    request.args.clear();
+
+    if (command == "GET") request.op = Opcode::Get;
+    else if (command == "SET") request.op = Opcode::Set;
+    else if (command == "DEL") request.op = Opcode::Del;
+    else if (command == "MGET") request.op = Opcode::MGet;
+    else if (command == "MSET") request.op = Opcode::MSet;
+    else if (command == "COUNT") request.op = Opcode::Count;
+    else if (command == "RANK") request.op = Opcode::Rank;
+    else if (command == "SELECT") request.op = Opcode::Select;
+    else if (command == "SUM") request.op = Opcode::Sum;
+    else if (command == "HISTOGRAM") request.op = Opcode::Histogram;
+    else if (command == "TOPKEYS") request.op = Opcode::TopKeys;
+    else if (command == "INCR") request.op = Opcode::Incr;
+    else if (command == "APPEND") request.op = Opcode::Append;
+    else if (command == "CAS") request.op = Opcode::Cas;
+    else {
+        error = "Unknown command";
+        return false;
+    }
+
+    request.collection = nextToken(rest);
+    if (request.collection.empty()) {
+        error = "Missing collection";
+        return false;
+    }
+
+    if (request.op == Opcode::Set || request.op == Opcode::Append || request.op == Opcode::Cas) {
+        std::string_view key = nextToken(rest);
+        if (key.empty()) {
+            error = "Missing key";
+            return false;
+        }
+        request.args.emplace_back(key);
+        if (request.op == Opcode::Cas) {
+            if (rest.empty()) {
+                error = "Missing expected value";
+                return false;
+            }
+            request.args.emplace_back(nextToken(rest));
+        }
+        request.args.emplace_back(rest);
+        return true;
+    }
+
+    while (!rest.empty()) {
+        request.args.emplace_back(nextToken(rest));
+    }
+    return checkArgs(request, error);
+}
+
+void formatRequest(const Request& request, std::string& out)
+{
+    out += opcodeName(request.op);
+    out += ' ';
+    out += request.collection;
+    for (const auto& arg : request.args) {
+        out += ' ';
+        out += arg;
+    }
+    out += '\n';
+}
+
+void formatResponse(const Response& response, std::string& out)
+{
+    if (response.isMulti) {
+        out += "VALUES ";
+        out += std::to_string(response.results.size());
+        out += '\n';
+    }
+    for (const auto& result : response.results) {
+        formatResult(result, out);
+    }
+}
+
+void encodeBinaryHeader(const BinaryHeader& header, char* out)
+{
+    out[0] = (char)header.magic;
+    out[1] = (char)header.code;
+    putU16(out + 2, header.collectionLength);
+    putU32(out + 4, header.keyLength);
+    putU32(out + 8, header.valueLength);
+    putU32(out + 12, header.opaque);
+}
+
+BinaryHeader decodeBinaryHeader(const char* in)
+{
+    BinaryHeader header;
+    header.magic = (uint8_t)in[0];
+    header.code = (uint8_t)in[1];
+    header.collectionLength = getU16(in + 2);
+    header.keyLength = getU32(in + 4);
+    header.valueLength = getU32(in + 8);
+    header.opaque = getU32(in + 12);
+    return header;
+}
+
+bool isValidRequestHeader(const BinaryHeader& header)
+{
+    return header.magic == BINARY_REQUEST_MAGIC &&
+        (size_t)header.collectionLength + header.keyLength + header.valueLength <= MAX_PAYLOAD_SIZE;
+}
+
+bool decodeBinaryRequest(const BinaryHeader& header, std::string_view payload, Request& request, std::string& error)
+{
+    request.args.clear();
+    request.op = (Opcode)header.code;
+    if (payload.size() != (size_t)header.collectionLength + header.keyLength) {
+        error = "Payload doesn't match the header";
+        return false;
+    }
+    request.collection.assign(payload.data(), header.collectionLength);
+    if (request.collection.empty()) {
+        error = "Missing collection";
+        return false;
+    }
+
+    std::string_view keys = payload.substr(header.collectionLength, header.keyLength);
+    switch (request.op) {
+    case Opcode::Get:
+    case Opcode::Del:
+    case Opcode::Set:
+        if (request.op != Opcode::Set && header.valueLength != 0) {
+            error = "Unexpected value";
+            return false;
+        }
+        request.args.emplace_back(keys);
+        if (request.op == Opcode::Set) request.args.emplace_back();
+        return true;
+    case Opcode::MGet:
+    case Opcode::MSet:
+    case Opcode::Count:
+    case Opcode::Rank:
+    case Opcode::Select:
+    case Opcode::Sum:
+    case Opcode::Histogram:
+    case Opcode::TopKeys:
+    case Opcode::Incr:
+    case Opcode::Append:
+    case Opcode::Cas:
+        if (header.valueLength != 0) {
+            error = "Unexpected value";
+            return false;
+        }
+        while (!keys.empty()) {
+            if (!nextItem(keys, request.args.emplace_back())) {
+                error = "Malformed key section";
+                return false;
+            }
+        }
+        return checkArgs(request, error);
+    default:
+        error = "Unknown command";
+        return false;
+    }
+}
+
+void encodeBinaryRequest(const Request& request, uint32_t opaque, std::string& out)
+{
+    BinaryHeader header;
+    header.code = (uint8_t)request.op;
+    header.collectionLength = (uint16_t)request.collection.size();
+    header.opaque = opaque;
+
+    size_t start = out.size();
+    out.resize(start + BINARY_HEADER_SIZE);
+    out += request.collection;
+
+    size_t keyStart = out.size();
+    if (request.op != Opcode::Get && request.op != Opcode::Set && request.op != Opcode::Del) {
+        for (const auto& arg : request.args) {
+            appendU32(out, (uint32_t)arg.size());
+            out += arg;
+        }
+        header.keyLength = (uint32_t)(out.size() - keyStart);
+    }
+    else {
+        out += request.args[0];
+        header.keyLength = (uint32_t)request.args[0].size();
+        if (request.op == Opcode::Set) {
+            out += request.args[1];
+            header.valueLength = (uint32_t)request.args[1].size();
+        }
+    }
+    encodeBinaryHeader(header, out.data() + start);
+}
+
+void encodeBinaryResponseFraming(const Response& response, uint32_t opaque, std::string& framing)
+{
+    BinaryHeader header;
+    header.magic = BINARY_RESPONSE_MAGIC;
+    header.opaque = opaque;
+
+    size_t payload = 0;
+    if (response.isMulti) {
+        header.code = (uint8_t)Status::Ok;
+        header.keyLength = (uint32_t)response.results.size();
+        framing.resize(BINARY_HEADER_SIZE + response.results.size() * BINARY_RESULT_PREFIX_SIZE);
+        char* prefix = framing.data() + BINARY_HEADER_SIZE;
+        for (const auto& result : response.results) {
+            prefix[0] = (char)result.status;
+            putU32(prefix + 1, (uint32_t)result.view().size());
+            prefix += BINARY_RESULT_PREFIX_SIZE;
+            payload += BINARY_RESULT_PREFIX_SIZE + result.view().size();
+        }
+    }
+    else {
+        framing.resize(BINARY_HEADER_SIZE);
+        if (!response.results.empty()) {
+            header.code = (uint8_t)response.results[0].status;
+            payload = response.results[0].view().size();
+        }
+    }
+    header.valueLength = (uint32_t)payload;
+    encodeBinaryHeader(header, framing.data());
+}
+
+bool decodeBinaryResponse(const BinaryHeader& header, std::string_view payload, Response& response)
+{
+    response.results.clear();
+    response.isMulti = header.keyLength > 0;
+    if (!response.isMulti) {
+        response.results.push_back({ (Status)header.code, std::string(payload) });
+        return true;
+    }
+
+    response.results.reserve(header.keyLength);
+    for (uint32_t i = 0; i < header.keyLength; i++) {
+        if (payload.size() < BINARY_RESULT_PREFIX_SIZE) return false;
+        Status status = (Status)payload[0];
+        uint32_t length = getU32(payload.data() + 1);
+        payload.remove_prefix(BINARY_RESULT_PREFIX_SIZE);
+        if (payload.size() < length) return false;
+        response.results.push_back({ status, std::string(payload.substr(0, length)) });
+        payload.remove_prefix(length);
+    }
+    return true;
+}
+
+bool ResponseParser::feed(std::string_view line)
+{
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+
+    if (mRemaining == 0) {
+        if (line.starts_with("VALUES ")) {
+            std::string_view count = line.substr(7);
+            size_t n = 0;
+            std::from_chars(count.data(), count.data() + count.size(), n);
+            mResponse.isMulti = true;
+            mResponse.results.reserve(n);
+            mRemaining = n;
+            return n == 0;
+        }
+        mResponse.results.push_back(parseResult(line));
+        return true;
+    }
+
+    mResponse.results.push_back(parseResult(line));
+    mRemaining--;
+    return mRemaining == 0;
+}
+
+void ResponseParser::reset()
+{
+    mResponse.isMulti = false;
+    mResponse.results.clear();
+    mRemaining = 0;
+}
@@ -0,0 +1,214 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Wire protocol shared by the server and the client library.
+//
+// Text protocol: one request per line, tokens separated by single spaces.
+//   GET <collection> <key>                      -> VALUE <value> | NOT_FOUND
+//   SET <collection> <key> <value...>           -> OK
+//   DEL <collection> <key>                      -> OK
+//   MGET <collection> <key> [<key> ...]         -> VALUES <n>, then n GET-style lines
+//   MSET <collection> <key> <value> [...]       -> OK
+//   COUNT <collection> [<lo> <hi>]              -> VALUE <number of keys, in [lo, hi] if given>
+//   RANK <collection> <key>                     -> VALUE <number of keys before key>
+//   SELECT <collection> <offset> [<limit>]      -> VALUES <2n>, then n key and value pairs
+//                                                  starting at the offset-th key
+//   SUM <collection> [<lo> <hi>]                -> VALUE <sum of the values that are numbers>
+//   HISTOGRAM <collection> <length> [<lo> <hi>] -> VALUES <2n>, then n key prefix and count
+//                                                  pairs, for prefixes of that length
+//   TOPKEYS <collection> [<count>]              -> VALUES <2n>, then n key and estimated access
+//                                                  count pairs, most accessed first
+//   INCR <collection> <key> [<delta>]           -> VALUE <new value>, a missing key counts as 0
+//   APPEND <collection> <key> <suffix...>       -> VALUE <new length>
+//   CAS <collection> <key> <old> <value...>     -> OK if the value was old and is now value,
+//                                                  else VALUE <current value> | NOT_FOUND
+// Any request can also be answered with ERROR <message>.
+// The value of SET, the suffix of APPEND and the new value of CAS are the
+// remainder of the line, so they may contain spaces. INCR, APPEND and CAS
+// change the value in place, atomically with respect to other requests.
+//
+// Binary protocol: a connection switches to binary framing when the first
+// byte the client sends is BINARY_REQUEST_MAGIC. Every frame starts with a
+// fixed BINARY_HEADER_SIZE byte header (see BinaryHeader, little-endian),
+// followed by the payload:
+//   GET/DEL:  collection, key
+//   SET:      collection, key, value
+//   MGET:     collection, keys as repeated (u32 length, bytes)
+//   MSET:     collection, pairs as repeated (u32 length, key, u32 length, value)
+//   COUNT, RANK, SELECT, SUM, HISTOGRAM, TOPKEYS, INCR, APPEND, CAS:
+//             collection, arguments as repeated (u32 length, bytes)
+// Responses echo the request's opaque value. Single results carry the
+// value or error message as payload. Multi-key results set the count field
+// and carry repeated (u8 status, u32 length, bytes).
+//
+// The server greets every connection with a single MOTD line, in text,
+// regardless of the framing the client picks.
+
+enum class Opcode : uint8_t {
+    Get = 1,
+    Set = 2,
+    Del = 3,
+    MGet = 4,
+    MSet = 5,
+    Count = 6,
+    Rank = 7,
+    Select = 8,
+    Sum = 9,
+    Histogram = 10,
+    TopKeys = 11,
+    Incr = 12,
+    Append = 13,
+    Cas = 14,
+};
+
+// Requests that go into the write buffers, these are held back while
+// flushing falls behind
+inline bool isWrite(Opcode op)
+{
+    return op == Opcode::Set || op == Opcode::Del || op == Opcode::MSet
+        || op == Opcode::Incr || op == Opcode::Append || op == Opcode::Cas;
+}
+
+enum class Status : uint8_t {
+    Ok = 0,
+    Value = 1,
+    NotFound = 2,
+    Error = 3,
+};
+
+enum class Framing : uint8_t {
+    Text,
+    Binary,
+};
+
+constexpr uint8_t BINARY_REQUEST_MAGIC = 0x80;
+constexpr uint8_t BINARY_RESPONSE_MAGIC = 0x81;
+constexpr size_t BINARY_HEADER_SIZE = 16;
+// Size of the per-result prefix in multi-key binary responses
+constexpr size_t BINARY_RESULT_PREFIX_SIZE = 5;
+// Requests announcing a larger payload are rejected
+constexpr size_t MAX_PAYLOAD_SIZE = 256 * 1024 * 1024;
+
+struct BinaryHeader {
+    uint8_t magic = BINARY_REQUEST_MAGIC;
+    // Opcode for requests, Status for responses
+    uint8_t code = 0;
+    // Requests only
+    uint16_t collectionLength = 0;
+    // Requests: length of the key section. Responses: result count for
+    // multi-key responses, 0 otherwise.
+    uint32_t keyLength = 0;
+    // Length of everything following the key section
+    uint32_t valueLength = 0;
+    uint32_t opaque = 0;
+};
+
+struct Request {
+    Opcode op = Opcode::Get;
+    std::string collection;
+    // GET/DEL/MGET: keys. SET/MSET: alternating keys and values.
+    // COUNT/RANK/SELECT/SUM/HISTOGRAM/TOPKEYS/INCR/APPEND/CAS: the arguments
+    // in text form.
+    std::vector<std::string> args;
+};
+
+struct Result {
+    Status status = Status::Ok;
+    // The value for Status::Value, the message for Status::Error.
+    std::string data;
+    // A stored value, shared with the collection instead of copied into
+    // data. It stays valid even if the key is overwritten meanwhile.
+    std::shared_ptr<const std::string> shared;
+
+    static Result value(std::shared_ptr<const std::string> stored)
+    {
+        return { Status::Value, "", std::move(stored) };
+    }
+
+    std::string_view view() const { return shared ? std::string_view(*shared) : std::string_view(data); }
+};
+
+struct Response {
+    // Multi-key requests are always answered with a VALUES header,
+    // even when only one key was requested.
+    bool isMulti = false;
+    std::vector<Result> results;
+
+    static Response error(std::string message)
+    {
+        Response response;
+        response.results.push_back({ Status::Error, std::move(message) });
+        return response;
+    }
+};
+
+// Parses a single request line (without the trailing newline).
+// Returns false and sets `error` if the line is malformed.
+bool parseRequest(std::string_view line, Request& request, std::string& error);
+
+// Appends the text encoding of a request, including the trailing newline.
+void formatRequest(const Request& request, std::string& out);
+
+// Appends the text encoding of a response, including the trailing newline(s).
+void formatResponse(const Response& response, std::string& out);
+
+void encodeBinaryHeader(const BinaryHeader& header, char* out);
+BinaryHeader decodeBinaryHeader(const char* in);
+// Whether the header of a request can be trusted to frame its payload. The
+// stream can't be resynchronized after one that can't.
+bool isValidRequestHeader(const BinaryHeader& header);
+
+// Decodes the collection and key section of a binary request, which has to
+// be exactly as long as the header says. For SET, the value is left as an
+// empty last argument for the caller to read into.
+bool decodeBinaryRequest(const BinaryHeader& header, std::string_view payload, Request& request, std::string& error);
+
+// Appends a complete binary request frame.
+void encodeBinaryRequest(const Request& request, uint32_t opaque, std::string& out);
+
+// Writes the framing of a binary response into `framing`: the header,
+// followed by the per-result prefixes for multi-key responses. Result data
+// isn't copied, it is meant to be sent from the Response itself, see
+// binaryResponseLayout().
+void encodeBinaryResponseFraming(const Response& response, uint32_t opaque, std::string& framing);
+
+// Calls `emit(data, size)` for every piece of a binary response in wire
+// order, so it can be sent with a single gathered write.
+template<typename F>
+void binaryResponseLayout(const Response& response, const std::string& framing, F emit)
+{
+    emit(framing.data(), BINARY_HEADER_SIZE);
+    if (!response.isMulti) {
+        if (!response.results.empty()) {
+            std::string_view data = response.results[0].view();
+            emit(data.data(), data.size());
+        }
+        return;
+    }
+    for (size_t i = 0; i < response.results.size(); i++) {
+        emit(framing.data() + BINARY_HEADER_SIZE + i * BINARY_RESULT_PREFIX_SIZE, BINARY_RESULT_PREFIX_SIZE);
+        std::string_view data = response.results[i].view();
+        emit(data.data(), data.size());
+    }
+}
+
+// Decodes the payload of a binary response.
+bool decodeBinaryResponse(const BinaryHeader& header, std::string_view payload, Response& response);
+
+// Incrementally decodes text responses, one line at a time.
+class ResponseParser {
+public:
+    // Feeds one line (without the trailing newline). Returns true once a
+    // complete response is available in `response()`.
+    bool feed(std::string_view line);
+
+    Response& response() { return mResponse; }
+    void reset();
+private:
+    Response mResponse;
+    size_t mRemaining = 0;
+};
@@ -3,22 +3,85 @@
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/asio.hpp>
 
+#include <chrono>
 #include <ctime>
 #include <iostream>
+#include <optional>
 #include <string>
 
+#include "BufferPool.h"
+#include "CommandProcessor.h"
 
 using boost::asio::ip::tcp;
 
-class TCPConnection
+// Values at least this large are read straight into their final buffer
+// instead of going through the connection's read buffer
+constexpr size_t LARGE_VALUE_SIZE = 4096;
+// Payloads of rejected requests are skipped this many bytes at a time, so
+// they never take more memory than that
+constexpr size_t DISCARD_CHUNK_SIZE = 16 * 1024;
+// Pooled buffers that grew past this are freed instead of reused
+constexpr size_t MAX_POOLED_BUFFER_SIZE = 64 * 1024;
+// How often a write checks whether the aggregations reading its collection
+// are done
+constexpr std::chrono::microseconds SCAN_WAIT{ 1000 };
+
+struct ServerOptions {
+    unsigned port = 6278;
+    // Further clients are disconnected right after being accepted
+    size_t maxConnections = 10000;
+    // Connections that send nothing for this long are closed, 0 disables
+    std::chrono::seconds idleTimeout{ 300 };
+};
+
+// Read and write buffers of a connection, recycled through a BufferPool
+struct ConnectionBuffers {
+    boost::asio::streambuf read;
+    std::string write;
+    std::string pendingWrite;
+    std::vector<boost::asio::const_buffer> gather;
+
+    bool reset()
+    {
+        read.consume(read.size());
+        write.clear();
+        pendingWrite.clear();
+        gather.clear();
+        return read.capacity() <= MAX_POOLED_BUFFER_SIZE &&
+            write.capacity() <= MAX_POOLED_BUFFER_SIZE &&
+            pendingWrite.capacity() <= MAX_POOLED_BUFFER_SIZE;
+    }
+};
+
+// A client connection. Every pending operation holds a shared_ptr to the
+// connection, so it is destroyed once the socket is closed and the last
+// handler has run.
+class TCPConnection : public boost::enable_shared_from_this<TCPConnection>
 {
 public:
-    TCPConnection(boost::asio::io_context& io_context, std::function<void(void)> onClose) :
+    TCPConnection(boost::asio::io_context& io_context, Database& database,
+        std::chrono::seconds idleTimeout, std::function<void(void)> onClose) :
         mSocket(io_context),
-        mIsActive(true),
-        mOnClose(mOnClose)
+        mIdleTimer(io_context),
+        mIdleTimeout(idleTimeout),
+        mThrottleTimer(io_context),
+        mDatabase(database),
+        mProcessor(database, io_context),
+        mBuffers(BufferPool<ConnectionBuffers>::local().acquire()),
+        mReadMessage(mBuffers->read),
+        mWriteMessage(mBuffers->write),
+        mPendingWrite(mBuffers->pendingWrite),
+        mWriteBuffers(mBuffers->gather),
+        mIsActive(false),
+        mWriteInProgress(false),
+        mOnClose(std::move(onClose))
     {}
 
+    ~TCPConnection()
+    {
+        BufferPool<ConnectionBuffers>::local().release(std::move(mBuffers));
+    }
+
     tcp::socket& socket()
     {
         return mSocket;
@@ -26,70 +89,431 @@ public:
 
     void start()
     {
-        boost::asio::async_write(
+        mIsActive = true;
+        touch();
+        startIdleTimer();
+
+        // Pipelined responses are batched by the write queue already, Nagle
+        // only adds delayed-ACK stalls on top
+        mSocket.set_option(tcp::no_delay(true));
+
+        // Goes through the write queue so it can't interleave with responses
+        mPendingWrite += "MOTD: hello!\n";
+        doWrite();
+
+        doNegotiate();
+    }
+
+private:
+    enum class BinaryState {
+        Header,
+        Keys,
+        Value,
+        // Skipping the value of a request that doesn't take one
+        Discard,
+    };
+
+    struct PendingResponse {
+        std::string framing;
+        Response response;
+    };
+
+    // Closes the socket, which fails every pending operation and lets the
+    // connection be destroyed once their handlers have run.
+    void close()
+    {
+        if (!mIsActive) return;
+        mIsActive = false;
+
+        boost::system::error_code ignored;
+        mIdleTimer.cancel();
+        mThrottleTimer.cancel();
+        mSocket.shutdown(tcp::socket::shutdown_both, ignored);
+        mSocket.close(ignored);
+        mOnClose();
+    }
+
+    void touch()
+    {
+        mLastActivity = std::chrono::steady_clock::now();
+    }
+
+    // Rather than re-arming the timer on every read, it wakes up when the
+    // connection would have timed out and checks when it was last active.
+    void startIdleTimer()
+    {
+        if (mIdleTimeout.count() == 0) return;
+
+        mIdleTimer.expires_at(mLastActivity + mIdleTimeout);
+        mIdleTimer.async_wait([self = shared_from_this()](const boost::system::error_code& error) {
+            if (error || !self->mIsActive) return;
+            if (std::chrono::steady_clock::now() - self->mLastActivity >= self->mIdleTimeout) {
+                std::cout << "Idle timeout" << std::endl;
+                self->close();
+                return;
+            }
+            self->startIdleTimer();
+        });
+    }
+
+    // The first byte the client sends picks the framing for the connection
+    void doNegotiate()
+    {
+        boost::asio::async_read(
             mSocket,
-            boost::asio::buffer("MOTD: hello!"),
-            [this](const boost::system::error_code& error, size_t bytes_transferred) {}
+            mReadMessage,
+            boost::asio::transfer_at_least(1),
+            [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
+                self->handleNegotiate(error);
+            }
         );
+    }
+
+    void handleNegotiate(const boost::system::error_code& error)
+    {
+        if (error) {
+            handleDisconnect();
+            return;
+        }
+        touch();
 
-        doRead();
+        auto first = (uint8_t)*static_cast<const char*>(mReadMessage.data().data());
+        if (first == BINARY_REQUEST_MAGIC) {
+            mFraming = Framing::Binary;
+            doReadBinary();
+        }
+        else {
+            doRead();
+        }
     }
 
-private:
     void doRead() {
         //Read from client, make json and send appropriate response
         boost::asio::async_read_until(
             mSocket,
             mReadMessage,
             "\n",
-            [&](const boost::system::error_code& error, size_t bytes_transferred) {
-                if ((boost::asio::error::eof == error) ||
-                    (boost::asio::error::connection_reset == error))
-                {
-                    // handle the disconnect.
-                    std::cout << "Disconnected" << std::endl;
-                    mIsActive = false;
-                    mOnClose();
+            [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
+                self->handleRead(error, bytes_transferred);
+            }
+        );
+    }
+
+    void handleRead(const boost::system::error_code& error, size_t bytes_transferred)
+    {
+        if (error)
+        {
+            handleDisconnect();
+            return;
+        }
+        touch();
+
+        // Only consume the first line, pipelined requests may already
+        // be buffered behind it. The line is parsed in place.
+        std::string_view message(static_cast<const char*>(mReadMessage.data().data()), bytes_transferred - 1);
+        mIsRequestValid = parseRequest(message, mRequest, mRequestError);
+        mReadMessage.consume(bytes_transferred);
+
+        delayRequest(writeDelay(), [this]() {
+            if (handleTextRequest()) doRead();
+        });
+    }
+
+    // Binary frames are parsed straight from the fixed-size header, every
+    // buffered request is handled before going back to the socket.
+    void doReadBinary()
+    {
+        while (true) {
+            size_t needed = 0;
+            switch (mBinaryState) {
+            case BinaryState::Header:
+                needed = BINARY_HEADER_SIZE;
+                break;
+            case BinaryState::Keys:
+                needed = (size_t)mHeader.collectionLength + mHeader.keyLength;
+                break;
+            case BinaryState::Value:
+                if (!(mIsRequestValid && mRequest.op == Opcode::Set)) {
+                    mDiscardRemaining = mHeader.valueLength;
+                    mBinaryState = BinaryState::Discard;
+                    continue;
+                }
+                if (mHeader.valueLength >= LARGE_VALUE_SIZE) {
+                    readLargeValue();
                     return;
                 }
+                needed = mHeader.valueLength;
+                break;
+            case BinaryState::Discard:
+                needed = std::min(mDiscardRemaining, DISCARD_CHUNK_SIZE);
+                break;
+            }
+
+            size_t buffered = mReadMessage.size();
+            if (buffered < needed) {
+                boost::asio::async_read(
+                    mSocket,
+                    mReadMessage,
+                    boost::asio::transfer_at_least(needed - buffered),
+                    [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
+                        if (error) {
+                            self->handleDisconnect();
+                            return;
+                        }
+                        self->touch();
+                        self->doReadBinary();
+                    }
+                );
+                return;
+            }
 
-                std::string messageP;
-                {
-                    std::stringstream ss;
-                    ss << &mReadMessage;
-                    ss.flush();
-                    messageP = ss.str();
+            const char* data = static_cast<const char*>(mReadMessage.data().data());
+            switch (mBinaryState) {
+            case BinaryState::Header:
+                mHeader = decodeBinaryHeader(data);
+                mReadMessage.consume(needed);
+                if (!isValidRequestHeader(mHeader)) {
+                    // The stream can't be resynchronized after a bad header
+                    handleDisconnect();
+                    return;
                 }
+                mBinaryState = BinaryState::Keys;
+                break;
+            case BinaryState::Keys:
+                mIsRequestValid = decodeBinaryRequest(mHeader, std::string_view(data, needed), mRequest, mRequestError);
+                mReadMessage.consume(needed);
+                mBinaryState = BinaryState::Value;
+                break;
+            case BinaryState::Value:
+                mRequest.args.back().assign(data, needed);
+                mReadMessage.consume(needed);
+                if (!completeBinaryRequest()) return;
+                break;
+            case BinaryState::Discard:
+                mReadMessage.consume(needed);
+                mDiscardRemaining -= needed;
+                if (mDiscardRemaining == 0 && !completeBinaryRequest()) return;
+                break;
+            }
+        }
+    }
 
-                std::cout << "Message:" << messageP << std::endl;
-                doRead();
+    // Handles the request once its value is read. Returns false if it's
+    // held back by a write delay or answered in the background, reading
+    // resumes once it's handled then.
+    bool completeBinaryRequest()
+    {
+        if (auto delay = writeDelay(); delay.count() > 0) {
+            delayRequest(delay, [this]() {
+                if (handleBinaryRequest()) doReadBinary();
+            });
+            return false;
+        }
+        return handleBinaryRequest();
+    }
+
+    void readLargeValue()
+    {
+        // Read directly into the string that is moved into the collection,
+        // only the part that was already read ahead is copied.
+        std::string& value = mRequest.args.back();
+        value.resize(mHeader.valueLength);
+
+        size_t buffered = std::min(mReadMessage.size(), value.size());
+        memcpy(value.data(), mReadMessage.data().data(), buffered);
+        mReadMessage.consume(buffered);
+
+        boost::asio::async_read(
+            mSocket,
+            boost::asio::buffer(value.data() + buffered, value.size() - buffered),
+            [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
+                if (error) {
+                    self->handleDisconnect();
+                    return;
+                }
+                self->touch();
+                self->delayRequest(self->writeDelay(), [self]() {
+                    if (self->handleBinaryRequest()) self->doReadBinary();
+                });
             }
         );
     }
 
+    // Writes are held back while flushing falls behind, see MemoryBudget,
+    // and while an aggregation reads their collection
+    std::chrono::microseconds writeDelay() const
+    {
+        if (!mIsRequestValid || !isWrite(mRequest.op)) return std::chrono::microseconds(0);
+        if (waitsForScan()) return std::max(SCAN_WAIT, mDatabase.writeDelay());
+        return mDatabase.writeDelay();
+    }
+
+    bool waitsForScan() const
+    {
+        return mIsRequestValid && isWrite(mRequest.op) && mDatabase.isScanning(mRequest.collection);
+    }
+
+    // Runs `next` after the delay. Nothing is read in the meantime, so the
+    // client is slowed down by TCP flow control rather than buffered for.
+    void delayRequest(std::chrono::microseconds delay, std::function<void()> next)
+    {
+        if (delay.count() == 0) {
+            next();
+            return;
+        }
+        mThrottleTimer.expires_after(delay);
+        mThrottleTimer.async_wait([self = shared_from_this(), next = std::move(next)](const boost::system::error_code& error) {
+            if (error || !self->mIsActive) return;
+            // Waiting on a flush doesn't make the client idle
+            self->touch();
+            if (self->mDatabase.writesStalled() || self->waitsForScan()) {
+                self->delayRequest(self->writeDelay(), next);
+                return;
+            }
+            next();
+        });
+    }
+
+    // Returns false if the response comes from the background, then reading
+    // resumes once it's sent, so pipelined responses stay in order
+    bool handleTextRequest()
+    {
+        auto response = execute([self = shared_from_this()](Response response) {
+            if (!self->mIsActive) return;
+            self->respondText(std::move(response));
+            self->doRead();
+        });
+        if (!response) return false;
+        respondText(std::move(*response));
+        return true;
+    }
+
+    bool handleBinaryRequest()
+    {
+        auto response = execute([self = shared_from_this()](Response response) {
+            if (!self->mIsActive) return;
+            self->respondBinary(std::move(response));
+            self->doReadBinary();
+        });
+        if (!response) return false;
+        respondBinary(std::move(*response));
+        return true;
+    }
+
+    std::optional<Response> execute(const CommandProcessor::ResponseHandler& done)
+    {
+        if (!mIsRequestValid) return Response::error(mRequestError);
+        return mProcessor.execute(mRequest, done);
+    }
+
+    void respondText(Response response)
+    {
+        formatResponse(response, mPendingWrite);
+        doWrite();
+    }
+
+    void respondBinary(Response response)
+    {
+        PendingResponse& pending = mPendingResponses.emplace_back();
+        pending.response = std::move(response);
+        encodeBinaryResponseFraming(pending.response, mHeader.opaque, pending.framing);
+        mBinaryState = BinaryState::Header;
+        doWrite();
+    }
+
+    void doWrite()
+    {
+        // Responses queued while a write is in flight are sent together
+        if (!mIsActive || mWriteInProgress || (mPendingWrite.empty() && mPendingResponses.empty())) return;
+
+        mWriteInProgress = true;
+        std::swap(mWriteMessage, mPendingWrite);
+        mPendingWrite.clear();
+        std::swap(mWriteResponses, mPendingResponses);
+
+        // Binary responses are gathered from their framing and the result
+        // strings themselves, values are never copied into a send buffer.
+        mWriteBuffers.clear();
+        if (!mWriteMessage.empty()) {
+            mWriteBuffers.push_back(boost::asio::buffer(mWriteMessage));
+        }
+        for (const auto& pending : mWriteResponses) {
+            binaryResponseLayout(pending.response, pending.framing, [this](const char* data, size_t size) {
+                if (size > 0) mWriteBuffers.push_back(boost::asio::buffer(data, size));
+            });
+        }
+
+        boost::asio::async_write(
+            mSocket,
+            mWriteBuffers,
+            [self = shared_from_this()](const boost::system::error_code& error, size_t bytes_transferred) {
+                self->mWriteInProgress = false;
+                self->mWriteResponses.clear();
+                if (error) {
+                    self->close();
+                    return;
+                }
+                self->doWrite();
+            }
+        );
+    }
+
+    void handleDisconnect()
+    {
+        if (mIsActive) std::cout << "Disconnected" << std::endl;
+        close();
+    }
+
     tcp::socket mSocket;
-    std::string mMessage;
-    boost::asio::streambuf mReadMessage;
+    boost::asio::steady_timer mIdleTimer;
+    std::chrono::seconds mIdleTimeout;
+    std::chrono::steady_clock::time_point mLastActivity;
+    boost::asio::steady_timer mThrottleTimer;
+    Database& mDatabase;
+    CommandProcessor mProcessor;
+    Framing mFraming = Framing::Text;
+    Request mRequest;
+    std::unique_ptr<ConnectionBuffers> mBuffers;
+    boost::asio::streambuf& mReadMessage;
+    std::string& mWriteMessage;
+    std::string& mPendingWrite;
+    std::vector<boost::asio::const_buffer>& mWriteBuffers;
+    std::vector<PendingResponse> mWriteResponses;
+    std::vector<PendingResponse> mPendingResponses;
+
+    BinaryState mBinaryState = BinaryState::Header;
+    BinaryHeader mHeader;
+    bool mIsRequestValid = false;
+    std::string mRequestError;
+    // Bytes of the rejected request's value still to skip
+    size_t mDiscardRemaining = 0;
+
     bool mIsActive;
+    bool mWriteInProgress;
 
-    std::function<void()>& mOnClose;
+    std::function<void()> mOnClose;
 };
 
 class Server {
 public:
-	Server(boost::asio::io_context& io_context, unsigned port = 6278)
+	Server(boost::asio::io_context& io_context, Database& database, ServerOptions options = ServerOptions())
         : mIoContext(io_context),
-        mAcceptor(io_context, tcp::endpoint(tcp::v4(), 6278))
+        mDatabase(database),
+        mOptions(options),
+        mAcceptor(io_context, tcp::endpoint(tcp::v4(), options.port))
     {
         startAccept();
     }
+
+    size_t connectionCount() const { return mConnectionCount; }
 private:
     void startAccept()
     {
-        // TODO: fix memory leak
-        TCPConnection* newConnection = new TCPConnection(mIoContext, [newConnection]() {
-            //delete newConnection; this doesn't work, use enable_shared_from_this instead
-        });
+        boost::shared_ptr<TCPConnection> newConnection(new TCPConnection(
+            mIoContext, mDatabase, mOptions.idleTimeout, [this]() {
+                mConnectionCount--;
+            }
+        ));
 
         mAcceptor.async_accept(
             newConnection->socket(),
@@ -99,18 +523,28 @@ private:
         );
     }
 
-    void handleAccept(TCPConnection * newConnection,
+    void handleAccept(boost::shared_ptr<TCPConnection> newConnection,
         const boost::system::error_code& error)
     {
         if (!error)
         {
-            std::cout << "A client connected" << std::endl;
-            newConnection->start();
+            if (mConnectionCount >= mOptions.maxConnections) {
+                // Never started, so dropping the last reference closes the socket
+                std::cout << "Connection limit reached, rejecting client" << std::endl;
+            }
+            else {
+                std::cout << "A client connected" << std::endl;
+                mConnectionCount++;
+                newConnection->start();
+            }
         }
 
         startAccept();
     }
 
     boost::asio::io_context& mIoContext;
+    Database& mDatabase;
+    ServerOptions mOptions;
     tcp::acceptor mAcceptor;
+    size_t mConnectionCount = 0;
 };
@@ -1,5 +1,6 @@
 #define _WIN32_WINNT 0x0601
 
+#include <csignal>
 #include <iostream>
 #include <boost/asio.hpp>
 #include <string>
@@ -26,7 +27,38 @@ int main(int argc, char* argv[]) {
     }
     */
 
-    auto db = Database();
+    DatabaseOptions databaseOptions;
+    CollectionOptions& collectionOptions = databaseOptions.collectionDefaults;
+    collectionOptions.hashIndex = input.cmdOptionExists("-hashindex");
+    databaseOptions.dataDirectory = input.getCmdOption("-datadir");
+    ServerOptions options;
+    try {
+        if (input.cmdOptionExists("-p"))
+            options.port = std::stoul(input.getCmdOption("-p"));
+        if (input.cmdOptionExists("-maxconn"))
+            options.maxConnections = std::stoull(input.getCmdOption("-maxconn"));
+        if (input.cmdOptionExists("-idle"))
+            options.idleTimeout = std::chrono::seconds(std::stoll(input.getCmdOption("-idle")));
+        if (input.cmdOptionExists("-branching"))
+            collectionOptions.branchingFactor = std::stoull(input.getCmdOption("-branching"));
+        if (input.cmdOptionExists("-hotkeys"))
+            collectionOptions.hotKeySampling = (uint32_t)std::stoul(input.getCmdOption("-hotkeys"));
+        if (input.cmdOptionExists("-writebuffer"))
+            collectionOptions.writeBufferSize = std::stoull(input.getCmdOption("-writebuffer")) * 1024 * 1024;
+        if (input.cmdOptionExists("-membudget"))
+            databaseOptions.memoryBudget = std::stoull(input.getCmdOption("-membudget")) * 1024 * 1024;
+        if (input.cmdOptionExists("-valuelog"))
+            collectionOptions.valueLogThreshold = std::stoull(input.getCmdOption("-valuelog"));
+        // The value log goes in the data directory
+        if (collectionOptions.valueLogThreshold && databaseOptions.dataDirectory.empty())
+            throw std::invalid_argument("-valuelog needs -datadir");
+    } catch (std::exception&) {
+        std::cerr << "Usage: SimpleKVS [-p port] [-maxconn connections] [-idle seconds] [-hashindex] [-branching factor]"
+            " [-writebuffer MB] [-membudget MB] [-datadir path] [-hotkeys sampling] [-valuelog bytes]" << std::endl;
+        return 1;
+    }
+
+    auto db = Database(databaseOptions);
     db.addCollection("test");
 
     Collection& collection = db.getCollection("test");
@@ -36,7 +68,10 @@ int main(int argc, char* argv[]) {
     try
     {
         boost::asio::io_context io_context;
-        Server server(io_context);
+        Server server(io_context, db, options);
+        // Stopping on a signal lets the database save its write buffers
+        boost::asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        signals.async_wait([&](const boost::system::error_code& error, int signal) { io_context.stop(); });
         io_context.run();
     } catch (std::exception& e) {
         std::cerr << e.what() << std::endl;
@@ -0,0 +1,68 @@
+#include "ThreadPoolIOEngine.h"
+
+#include <algorithm>
+
+ThreadPoolIOEngine::ThreadPoolIOEngine(size_t threads)
+{
+    for (size_t i = 0; i < (std::max)(threads, (size_t)1); i++) {
+        mThreads.emplace_back([this]() { run(); });
+    }
+}
+
+ThreadPoolIOEngine::~ThreadPoolIOEngine()
+{
+    // Requests still queued in the engine are run too, so every handler
+    // gets posted
+    submit();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mReady.notify_all();
+    for (auto& thread : mThreads) {
+        thread.join();
+    }
+}
+
+void ThreadPoolIOEngine::submitBatch(std::vector<IORequest>& batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (auto& request : batch) {
+            mPending.push_back(std::move(request));
+        }
+    }
+    if (batch.size() == 1) mReady.notify_one();
+    else mReady.notify_all();
+    batch.clear();
+}
+
+void ThreadPoolIOEngine::run()
+{
+    for (;;) {
+        IORequest request;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mReady.wait(lock, [this]() { return mStopping || !mPending.empty(); });
+            // Finish what was submitted before stopping
+            if (mPending.empty()) return;
+            request = std::move(mPending.front());
+            mPending.pop_front();
+        }
+
+        boost::system::error_code error;
+        size_t bytes = 0;
+        switch (request.op) {
+        case IOOperation::Read:
+            bytes = request.file->readAt(request.offset, request.data, request.size, error);
+            break;
+        case IOOperation::Write:
+            bytes = request.file->writeAt(request.offset, request.data, request.size, error);
+            break;
+        case IOOperation::Sync:
+            request.file->sync(error);
+            break;
+        }
+        complete(request, error, bytes);
+    }
+}
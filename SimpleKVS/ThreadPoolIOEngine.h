@@ -0,0 +1,25 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include "IOEngine.h"
+
+// Fallback backend: worker threads doing blocking positional I/O
+class ThreadPoolIOEngine : public IOEngine
+{
+public:
+    ThreadPoolIOEngine(size_t threads);
+    ~ThreadPoolIOEngine();
+
+    const char* name() const override { return "threads"; }
+protected:
+    void submitBatch(std::vector<IORequest>& batch) override;
+private:
+    void run();
+
+    std::mutex mMutex;
+    std::condition_variable mReady;
+    std::deque<IORequest> mPending;
+    bool mStopping = false;
+    std::vector<std::thread> mThreads;
+};
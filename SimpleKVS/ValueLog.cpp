@@ -0,0 +1,351 @@
+#include "ValueLog.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <future>
+#include <ios>
+#include <boost/asio/error.hpp>
+#include <boost/asio/post.hpp>
+
+namespace {
+	// Segments are read back in requests of at least this size
+	constexpr size_t SCAN_CHUNK_SIZE = 256 * 1024;
+
+	void putU32(char* out, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++) {
+			out[i] = (char)(value >> (8 * i));
+		}
+	}
+
+	uint32_t getU32(const char* in)
+	{
+		uint32_t value = 0;
+		for (int i = 0; i < 4; i++) {
+			value |= (uint32_t)(uint8_t)in[i] << (8 * i);
+		}
+		return value;
+	}
+
+	std::ios_base::failure failure(const std::string& what, const boost::system::error_code& error)
+	{
+		return std::ios_base::failure(what + " failed: " + error.message());
+	}
+}
+
+ValueLog::Segment::~Segment() {
+	if (!isDropped) return;
+	file.close();
+	std::error_code ignored;
+	std::filesystem::remove(path, ignored);
+}
+
+ValueLog::ValueLog(std::filesystem::path directory, std::string stem, IOEngine* engine, uint64_t segmentSize) :
+	mDirectory{ std::move(directory) },
+	mStem{ std::move(stem) },
+	mSegmentSize{ segmentSize },
+	mEngine{ engine }
+{
+	if (!mEngine) {
+		mOwnEngine = IOEngine::create();
+		mEngine = mOwnEngine.get();
+	}
+	std::filesystem::create_directories(mDirectory);
+	std::lock_guard<std::mutex> lock(mMutex);
+	uint32_t next = 0;
+	std::string prefix = mStem + ".";
+	for (const auto& entry : std::filesystem::directory_iterator(mDirectory)) {
+		std::string name = entry.path().filename().string();
+		if (entry.path().extension() != ".vlog" || name.compare(0, prefix.size(), prefix) != 0) continue;
+		uint32_t segment = 0;
+		const char* end = name.data() + name.size() - 5;
+		auto [parsed, error] = std::from_chars(name.data() + prefix.size(), end, segment);
+		if (error != std::errc() || parsed != end) continue;
+		// Nothing points into an empty segment, such as the last process's
+		// active one if it never got a value
+		if (entry.file_size() == 0) {
+			std::filesystem::remove(entry.path());
+			continue;
+		}
+		open(segment);
+		next = (std::max)(next, segment + 1);
+	}
+	open(next);
+}
+
+ValueLog::~ValueLog() {
+	mEngine->submit();
+	std::unique_lock<std::mutex> lock(mMutex);
+	mWritten.wait(lock, [this]() { return mPending.empty(); });
+}
+
+void ValueLog::open(uint32_t number) {
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%06u.vlog", (unsigned)number);
+	auto segment = std::make_shared<Segment>();
+	segment->number = number;
+	segment->path = mDirectory / (mStem + suffix);
+	try {
+		segment->file.open(segment->path.string());
+	}
+	catch (const boost::system::system_error& e) {
+		throw failure("Opening " + segment->path.string(), e.code());
+	}
+	segment->values = countValues(segment->file);
+	mSegments[number] = std::move(segment);
+}
+
+uint64_t ValueLog::countValues(const StorageFile& file) {
+	// A record cut short by a crash ends the segment
+	uint64_t values = 0;
+	char header[RECORD_HEADER_SIZE];
+	for (uint64_t offset = 0; offset + RECORD_HEADER_SIZE <= file.size();) {
+		boost::system::error_code error;
+		if (file.readAt(offset, header, sizeof(header), error) < sizeof(header) || error) break;
+		uint64_t end = offset + RECORD_HEADER_SIZE + getU32(header) + getU32(header + 4);
+		if (end > file.size()) break;
+		values += getU32(header + 4);
+		offset = end;
+	}
+	return values;
+}
+
+std::shared_ptr<ValueLog::Segment> ValueLog::find(uint32_t number) const {
+	auto found = mSegments.find(number);
+	if (found != mSegments.end()) return found->second;
+	for (auto& segment : mRetired) {
+		if (segment->number == number) return segment;
+	}
+	return nullptr;
+}
+
+ValuePointer ValueLog::append(const std::string& key, std::string_view value) {
+	auto record = std::make_shared<std::string>(RECORD_HEADER_SIZE, '\0');
+	putU32(record->data(), (uint32_t)key.size());
+	putU32(record->data() + 4, (uint32_t)value.size());
+	*record += key;
+	*record += value;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mError) throw failure("Writing the value log", mError);
+	auto last = std::prev(mSegments.end());
+	if (last->second->file.size() >= mSegmentSize) {
+		open(last->first + 1);
+		last = std::prev(mSegments.end());
+	}
+	uint32_t number = last->first;
+	Segment& segment = *last->second;
+
+	// The record stays in mPending, and so alive, until it's written
+	uint64_t offset = segment.file.size() + RECORD_HEADER_SIZE + key.size();
+	mPending.emplace(PendingKey{ number, offset }, record);
+	mEngine->append(segment.file, record->data(), record->size(),
+		[this, key = PendingKey{ number, offset }, size = record->size()](const boost::system::error_code& error, size_t bytes) {
+			std::lock_guard<std::mutex> lock(mMutex);
+			if (!mError && (error || bytes < size)) mError = error ? error : make_error_code(boost::asio::error::eof);
+			mPending.erase(key);
+			mWritten.notify_all();
+		});
+	segment.values += value.size();
+	mUnsynced.insert(number);
+	return { number, (uint32_t)value.size(), offset };
+}
+
+std::string ValueLog::read(const ValuePointer& pointer) const {
+	std::shared_ptr<Segment> segment;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto pending = mPending.find({ pointer.segment, pointer.offset });
+		if (pending != mPending.end()) return pending->second->substr(pending->second->size() - pointer.length);
+		segment = find(pointer.segment);
+	}
+	if (!segment) throw std::ios_base::failure("No value log segment " + std::to_string(pointer.segment));
+	return readAt(*segment, pointer.offset, pointer.length);
+}
+
+void ValueLog::read(const ValuePointer& pointer, boost::asio::io_context& context, ReadHandler done) const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto pending = mPending.find({ pointer.segment, pointer.offset });
+	if (pending != mPending.end()) {
+		// Not written yet
+		boost::asio::post(context, [value = pending->second->substr(pending->second->size() - pointer.length), done]() mutable {
+			done({}, std::move(value));
+		});
+		return;
+	}
+	auto segment = find(pointer.segment);
+	if (!segment) throw std::ios_base::failure("No value log segment " + std::to_string(pointer.segment));
+	// The segment is kept until the read is done, even if it's retired
+	auto value = std::make_shared<std::string>(pointer.length, '\0');
+	mEngine->read(segment->file, pointer.offset, value->data(), value->size(), context,
+		[segment, value, done](const boost::system::error_code& error, size_t bytes) {
+			if (!error && bytes < value->size()) done(boost::asio::error::eof, std::string());
+			else done(error, std::move(*value));
+		});
+}
+
+std::string ValueLog::readAt(Segment& segment, uint64_t offset, size_t size) const {
+	std::string data(size, '\0');
+	// Owned by the handler too, as set_value may still be running after get
+	// returns
+	auto result = std::make_shared<std::promise<boost::system::error_code>>();
+	auto future = result->get_future();
+	mEngine->read(segment.file, offset, data.data(), data.size(), [result, size](const boost::system::error_code& error, size_t bytes) {
+		result->set_value(!error && bytes < size ? make_error_code(boost::asio::error::eof) : error);
+	});
+	mEngine->submit();
+	if (auto error = future.get()) throw failure("Reading " + segment.path.string(), error);
+	return data;
+}
+
+void ValueLog::sync() {
+	std::optional<PendingKey> last;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mPending.empty()) last = mPending.rbegin()->first;
+	}
+	mEngine->submit();
+
+	// Appends made from here on don't hold this up
+	std::vector<std::shared_ptr<Segment>> written;
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		mWritten.wait(lock, [&]() { return !last || mPending.empty() || mPending.begin()->first > *last; });
+		if (mError) throw failure("Writing the value log", mError);
+		for (uint32_t number : mUnsynced) {
+			if (auto segment = find(number)) written.push_back(std::move(segment));
+		}
+		mUnsynced.clear();
+	}
+
+	for (auto& segment : written) {
+		auto result = std::make_shared<std::promise<boost::system::error_code>>();
+		auto future = result->get_future();
+		mEngine->sync(segment->file, [result](const boost::system::error_code& error, size_t bytes) {
+			result->set_value(error);
+		});
+		mEngine->submit();
+		if (auto error = future.get()) throw failure("Syncing " + segment->path.string(), error);
+	}
+}
+
+void ValueLog::release(const ValuePointer& pointer) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto found = mSegments.find(pointer.segment);
+	if (found != mSegments.end()) found->second->garbage += pointer.length;
+}
+
+void ValueLog::recount(const std::unordered_map<uint32_t, uint64_t>& live) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto& [number, segment] : mSegments) {
+		auto found = live.find(number);
+		uint64_t referenced = found == live.end() ? 0 : found->second;
+		segment->garbage = segment->values - (std::min)(referenced, segment->values);
+	}
+}
+
+uint64_t ValueLog::size() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	uint64_t bytes = 0;
+	for (auto& [number, segment] : mSegments) {
+		bytes += segment->file.size();
+	}
+	return bytes;
+}
+
+uint64_t ValueLog::garbage() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	uint64_t bytes = 0;
+	for (auto& [number, segment] : mSegments) {
+		bytes += segment->garbage;
+	}
+	return bytes;
+}
+
+size_t ValueLog::segments() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mSegments.size();
+}
+
+std::optional<uint32_t> ValueLog::collectable() const {
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::optional<uint32_t> best;
+	double bestRatio = GARBAGE_RATIO;
+	for (auto it = mSegments.begin(); it != std::prev(mSegments.end()); ++it) {
+		if (it->second->values == 0) continue;
+		double ratio = (double)it->second->garbage / (double)it->second->values;
+		if (ratio >= bestRatio) {
+			best = it->first;
+			bestRatio = ratio;
+		}
+	}
+	return best;
+}
+
+bool ValueLog::scan(uint32_t number, const RecordHandler& record) const {
+	std::shared_ptr<Segment> segment;
+	mEngine->submit();
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		// The active segment is never scanned
+		auto found = mSegments.find(number);
+		if (found == mSegments.end() || found == std::prev(mSegments.end())) return true;
+		segment = found->second;
+		// Records still being written can't be read back from the file yet
+		mWritten.wait(lock, [&]() {
+			auto pending = mPending.lower_bound({ number, 0 });
+			return pending == mPending.end() || pending->first.first != number;
+		});
+	}
+
+	// Read in chunks, so small records don't take a request each
+	uint64_t size = segment->file.size();
+	std::string chunk;
+	uint64_t chunkStart = 0;
+	auto bytes = [&](uint64_t offset, size_t length) {
+		if (offset < chunkStart || offset + length > chunkStart + chunk.size()) {
+			uint64_t wanted = (std::max)((uint64_t)length, (uint64_t)SCAN_CHUNK_SIZE);
+			chunk = readAt(*segment, offset, (size_t)(std::min)(wanted, size - offset));
+			chunkStart = offset;
+		}
+		return std::string_view(chunk).substr((size_t)(offset - chunkStart), length);
+	};
+
+	std::string key;
+	for (uint64_t offset = 0; offset + RECORD_HEADER_SIZE <= size;) {
+		std::string_view header = bytes(offset, RECORD_HEADER_SIZE);
+		uint32_t keyLength = getU32(header.data());
+		uint32_t valueLength = getU32(header.data() + 4);
+		uint64_t valueOffset = offset + RECORD_HEADER_SIZE + keyLength;
+		// Cut short by a crash
+		if (valueOffset + valueLength > size) break;
+		std::string_view body = bytes(offset + RECORD_HEADER_SIZE, (size_t)keyLength + valueLength);
+		key.assign(body.substr(0, keyLength));
+		if (!record(key, { number, valueLength, valueOffset }, body.substr(keyLength))) return false;
+		offset = valueOffset + valueLength;
+	}
+	return true;
+}
+
+uint64_t ValueLog::retire(uint32_t number) {
+	std::lock_guard<std::mutex> lock(mMutex);
+	// The active segment is never retired
+	auto found = mSegments.find(number);
+	if (found == mSegments.end() || found == std::prev(mSegments.end())) return 0;
+	uint64_t size = found->second->file.size();
+	mRetired.push_back(std::move(found->second));
+	mSegments.erase(found);
+	return size;
+}
+
+void ValueLog::dropRetired() {
+	std::vector<std::shared_ptr<Segment>> retired;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		retired.swap(mRetired);
+	}
+	for (auto& segment : retired) {
+		segment->isDropped = true;
+	}
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+#include <boost/system/error_code.hpp>
+#include "IOEngine.h"
+
+// Where a value kept in a ValueLog is
+struct ValuePointer {
+	uint32_t segment = 0;
+	uint32_t length = 0;
+	uint64_t offset = 0;
+
+	bool operator==(const ValuePointer& other) const = default;
+};
+
+// Append-only log of values kept out of the trees, so splits and flushes
+// only move small pointers. It's split into segment files of about
+// `segmentSize` bytes. Each record is the key and value lengths as
+// little-endian u32s, then the key and value. Keys are logged so garbage
+// collection can tell which values are still referenced.
+//
+// Reads and appends go through an IOEngine. Appends return at once, and
+// their values are served from memory until they're written; sync() waits
+// for them and makes them durable.
+//
+// Overwritten and deleted values are only counted as garbage. Once enough of
+// a segment is garbage, its live values can be moved to the end of the log
+// with scan() and append(), and the segment retired.
+class ValueLog
+{
+public:
+	static constexpr uint64_t DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+	// Segments are worth collecting once this fraction of their values is
+	// garbage
+	static constexpr double GARBAGE_RATIO = 0.5;
+	// Bytes each record takes besides its key and value
+	static constexpr size_t RECORD_HEADER_SIZE = 8;
+
+	// Gets the value, or the error the read failed with
+	using ReadHandler = std::function<void(const boost::system::error_code& error, std::string value)>;
+	// Gets each record of a segment and where its value is. Returns false to
+	// stop the scan.
+	using RecordHandler = std::function<bool(const std::string& key, const ValuePointer& pointer, std::string_view value)>;
+
+	// Segment files are named `stem`.<segment>.vlog, in the directory. Those
+	// left by an earlier process are kept, since runs point into them, and
+	// appends go to a new one. I/O goes through `engine`, or one of the log's
+	// own if it's nullptr.
+	ValueLog(std::filesystem::path directory, std::string stem, IOEngine* engine = nullptr,
+		uint64_t segmentSize = DEFAULT_SEGMENT_SIZE);
+	ValueLog(const ValueLog& other) = delete;
+	ValueLog& operator=(const ValueLog& other) = delete;
+	// Waits for the appends still being written
+	~ValueLog();
+
+	// Throws std::ios_base::failure once an append has failed
+	ValuePointer append(const std::string& key, std::string_view value);
+	// Blocks until the value is read. Throws std::ios_base::failure if that
+	// fails.
+	std::string read(const ValuePointer& pointer) const;
+	// Passes the value to `done` on `context`, once the read is submitted
+	void read(const ValuePointer& pointer, boost::asio::io_context& context, ReadHandler done) const;
+	// Hands the queued reads and appends to the engine
+	void submit() const { mEngine->submit(); }
+	// Waits for every append made so far to be written, and syncs the
+	// segments they went to. Throws std::ios_base::failure on failure.
+	void sync();
+	// Counts the value as garbage
+	void release(const ValuePointer& pointer);
+	// Sets the garbage of each segment to the bytes of values in it that
+	// aren't in `live`, which maps segments to the bytes of values still
+	// referenced. For after loading runs, which only hold the last value of
+	// each key.
+	void recount(const std::unordered_map<uint32_t, uint64_t>& live);
+
+	// Bytes in all segments, and how many bytes of values in them are garbage
+	uint64_t size() const;
+	uint64_t garbage() const;
+	size_t segments() const;
+
+	// The sealed segment with the most garbage, if at least GARBAGE_RATIO of
+	// its values are
+	std::optional<uint32_t> collectable() const;
+	// Reads the records of a sealed segment in order, blocking. Returns false
+	// if `record` stopped it. Throws std::ios_base::failure if reading fails.
+	bool scan(uint32_t segment, const RecordHandler& record) const;
+	// Takes the segment out of the log and returns its size. Reads into it
+	// still work, and the file stays until dropRetired(), so it must only be
+	// called once nothing on disk points into the segment anymore.
+	uint64_t retire(uint32_t segment);
+	void dropRetired();
+private:
+	struct Segment {
+		~Segment();
+
+		uint32_t number = 0;
+		std::filesystem::path path;
+		StorageFile file;
+		// Bytes of values in the segment, and of those that are garbage
+		uint64_t values = 0;
+		uint64_t garbage = 0;
+		// Deletes the file once the last reader lets go of it
+		bool isDropped = false;
+	};
+	// Appends not written yet, by segment and value offset, which is also the
+	// order they were made in
+	using PendingKey = std::pair<uint32_t, uint64_t>;
+
+	// mMutex must be held by these
+	void open(uint32_t segment);
+	std::shared_ptr<Segment> find(uint32_t segment) const;
+	// The segment's value bytes, counted from its records
+	static uint64_t countValues(const StorageFile& file);
+	// Blocks until a read through the engine completes
+	std::string readAt(Segment& segment, uint64_t offset, size_t size) const;
+
+	std::filesystem::path mDirectory;
+	std::string mStem;
+	uint64_t mSegmentSize;
+	std::unique_ptr<IOEngine> mOwnEngine;
+	IOEngine* mEngine;
+	// Appends go to the last one. Shared with the reads in flight.
+	std::map<uint32_t, std::shared_ptr<Segment>> mSegments;
+	std::vector<std::shared_ptr<Segment>> mRetired;
+	// Hold the records until they're written
+	std::map<PendingKey, std::shared_ptr<const std::string>> mPending;
+	// Segments appended to since the last sync
+	std::set<uint32_t> mUnsynced;
+	// The first failed append, after which the log takes no more
+	boost::system::error_code mError;
+	mutable std::mutex mMutex;
+	mutable std::condition_variable mWritten;
+};
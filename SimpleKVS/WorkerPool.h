@@ -0,0 +1,76 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running posted tasks in order, so CPU-bound work like
+// scans runs off the io thread without starting threads per request.
+class WorkerPool
+{
+public:
+	WorkerPool(size_t threads)
+	{
+		for (size_t i = 0; i < (std::max)(threads, (size_t)1); i++) {
+			mThreads.emplace_back([this]() { run(); });
+		}
+	}
+	WorkerPool(const WorkerPool& other) = delete;
+	WorkerPool& operator=(const WorkerPool& other) = delete;
+
+	// Runs the tasks already posted, then stops
+	~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStopping = true;
+		}
+		mReady.notify_all();
+		for (auto& thread : mThreads) {
+			thread.join();
+		}
+	}
+
+	// One thread per core, shared by the whole process
+	static WorkerPool& shared()
+	{
+		static WorkerPool pool((std::max)(std::thread::hardware_concurrency(), 1u));
+		return pool;
+	}
+
+	size_t size() const { return mThreads.size(); }
+
+	// `task` must not throw
+	void post(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mTasks.push_back(std::move(task));
+		}
+		mReady.notify_one();
+	}
+private:
+	void run()
+	{
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mReady.wait(lock, [this]() { return mStopping || !mTasks.empty(); });
+				if (mTasks.empty()) return;
+				task = std::move(mTasks.front());
+				mTasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::mutex mMutex;
+	std::condition_variable mReady;
+	std::deque<std::function<void()>> mTasks;
+	bool mStopping = false;
+	std::vector<std::thread> mThreads;
+};
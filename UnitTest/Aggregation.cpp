@@ -0,0 +1,166 @@
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "../SimpleKVS/Database.h"
+#include "../SimpleKVS/ParallelScan.h"
+#include <future>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(AggregationTest)
+	{
+	public:
+
+		TEST_METHOD(Partition)
+		{
+			OrderedMap<int, int> map(8);
+			for (int i = 0; i < 10000; i++) map.set(i, i);
+			for (int i = 0; i < 10000; i += 3) map.del(i);
+
+			size_t first = map.rank(100);
+			size_t total = map.count(100, 8999);
+			auto runs = map.partition(first, total, 7);
+			Assert::AreEqual(runs.size(), (size_t)7);
+
+			// Runs are contiguous and about equal, and skip deleted keys
+			size_t covered = 0;
+			for (auto& [start, count] : runs) {
+				Assert::IsFalse(start->isDeleted);
+				Assert::AreEqual(map.rank(start->first), first + covered);
+				Assert::IsTrue(count == total / 7 || count == total / 7 + 1);
+				covered += count;
+			}
+			Assert::AreEqual(covered, total);
+
+			Assert::AreEqual(map.partition(0, 3, 8).size(), (size_t)3);
+			Assert::IsTrue(map.partition(0, 0, 8).empty());
+		}
+
+		TEST_METHOD(ParallelReduce)
+		{
+			OrderedMap<int64_t, int64_t> map;
+			int64_t expected = 0;
+			for (int64_t i = 0; i < 200000; i++) {
+				map.set(i, i);
+				if (i % 5 == 0) map.del(i);
+				else expected += i;
+			}
+
+			for (size_t threads : { 1, 3, 8 }) {
+				int64_t sum = parallel_reduce(map, 0, map.size(), threads, (int64_t)0,
+					[](int64_t& sum, int64_t key, int64_t value) { sum += value; },
+					[](int64_t& sum, int64_t partial) { sum += partial; });
+				Assert::AreEqual(sum, expected);
+			}
+
+			// Partial results are merged in key order
+			auto keys = parallel_reduce(map, 0, map.size(), 8, std::vector<int64_t>(),
+				[](std::vector<int64_t>& keys, int64_t key, int64_t value) { keys.push_back(key); },
+				[](std::vector<int64_t>& keys, std::vector<int64_t>&& partial) { keys.insert(keys.end(), partial.begin(), partial.end()); });
+			Assert::AreEqual(keys.size(), map.size());
+			Assert::IsTrue(std::is_sorted(keys.begin(), keys.end()));
+		}
+
+		TEST_METHOD(AsyncReduce)
+		{
+			OrderedMap<int64_t, int64_t> map;
+			for (int64_t i = 0; i < 100000; i++) map.set(i, 1);
+			WorkerPool pool(2);
+
+			// Returns before the folds run, the result comes from a worker
+			std::promise<void> started;
+			auto release = started.get_future().share();
+			std::promise<std::pair<int64_t, std::thread::id>> finished;
+			parallel_reduce_async(map, 0, map.size(), 4, (int64_t)0,
+				[release](int64_t& sum, int64_t key, int64_t value) { release.wait(); sum += value; },
+				[](int64_t& sum, int64_t partial) { sum += partial; },
+				[&](std::exception_ptr error, int64_t sum) {
+					Assert::IsFalse((bool)error);
+					finished.set_value({ sum, std::this_thread::get_id() });
+				}, pool);
+			started.set_value();
+			auto [sum, thread] = finished.get_future().get();
+			Assert::AreEqual(sum, (int64_t)100000);
+			Assert::IsTrue(thread != std::this_thread::get_id());
+
+			// A fold that throws fails the whole scan
+			Assert::ExpectException<std::runtime_error>([&] {
+				parallel_reduce(map, 0, map.size(), 4, (int64_t)0,
+					[](int64_t& sum, int64_t key, int64_t value) { if (key == 70000) throw std::runtime_error("fold"); },
+					[](int64_t& sum, int64_t partial) {}, pool);
+			});
+
+			// Nothing to fold finishes right away
+			bool empty = false;
+			parallel_reduce_async(map, 0, 0, 4, (int64_t)7,
+				[](int64_t& sum, int64_t key, int64_t value) {},
+				[](int64_t& sum, int64_t partial) {},
+				[&](std::exception_ptr error, int64_t sum) { empty = sum == 7; }, pool);
+			Assert::IsTrue(empty);
+
+			Collection collection("test");
+			for (int i = 0; i < 50000; i++) {
+				collection.set("key" + std::to_string(i), "2");
+			}
+			std::promise<NumericSum> result;
+			collection.sum([&](std::exception_ptr error, NumericSum sum) { result.set_value(sum); });
+			Assert::AreEqual(result.get_future().get().integer, (int64_t)100000);
+			// Cleared before the handler is called
+			Assert::IsFalse(collection.scanning());
+		}
+
+		TEST_METHOD(SumAndHistogram)
+		{
+			CollectionOptions options;
+			options.scanThreads = 4;
+			Collection collection("test", options);
+
+			std::map<std::string, size_t> prefixes;
+			for (int i = 0; i < 100000; i++) {
+				std::string key = "region" + std::to_string(i % 7) + ":" + std::to_string(i);
+				collection.set(key, std::to_string(i));
+				prefixes[key.substr(0, 7)]++;
+			}
+			collection.set("text", "not a number");
+			collection.set("real", "0.5");
+
+			NumericSum sum = collection.sum();
+			Assert::AreEqual(sum.values, (size_t)100001);
+			Assert::AreEqual(sum.toString(), std::string("4999950000.5"));
+			Assert::AreEqual(collection.sum("region3", "region3~").integer, (int64_t)714307143);
+
+			auto histogram = collection.histogram(7, 100, "region", "region~");
+			Assert::AreEqual(histogram.size(), prefixes.size());
+			size_t i = 0;
+			for (auto& [prefix, count] : prefixes) {
+				Assert::AreEqual(histogram[i].first, prefix);
+				Assert::AreEqual(histogram[i].second, count);
+				i++;
+			}
+
+			// Capped past maxBuckets
+			Assert::AreEqual(collection.histogram(100, 10).size(), (size_t)11);
+		}
+
+		TEST_METHOD(LargeSums)
+		{
+			NumericSum sum;
+			sum.add("9223372036854775807");
+			Assert::IsFalse(sum.isReal);
+			sum.add("1");
+			Assert::IsTrue(sum.isReal);
+			sum.add("-5");
+			sum.add("abc");
+			sum.add("");
+			sum.add("nan");
+			Assert::AreEqual(sum.values, (size_t)3);
+			Assert::AreEqual((double)sum.integer + sum.real, 9223372036854775803.0);
+		}
+	};
+}
@@ -0,0 +1,105 @@
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "../SimpleKVS/HashIndex.h"
+#include "../SimpleKVS/Database.h"
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(HashIndexTest)
+	{
+	public:
+
+		TEST_METHOD(InsertFind)
+		{
+			HashIndex<int> index;
+			for (int i = 0; i < 10000; i++) {
+				index.insert(i * 7919, i);
+			}
+			Assert::AreEqual(index.size(), (size_t)10000);
+			Assert::IsTrue(index.size() * 8 <= index.capacity() * 7);
+
+			for (int i = 0; i < 10000; i++) {
+				int* value = index.find(i * 7919);
+				Assert::IsNotNull(value);
+				Assert::AreEqual(*value, i);
+			}
+			Assert::IsNull(index.find(1));
+
+			index.insert(7919, 42);
+			Assert::AreEqual(*index.find(7919), 42);
+			Assert::AreEqual(index.size(), (size_t)10000);
+
+			index.clear();
+			Assert::AreEqual(index.size(), (size_t)0);
+			Assert::IsNull(index.find(7919));
+		}
+
+		TEST_METHOD(IndexedCollection)
+		{
+			CollectionOptions options;
+			options.hashIndex = true;
+			Collection collection("test", options);
+
+			std::vector<int> keys;
+			for (int i = 0; i < 20000; i++) keys.push_back(i);
+			std::shuffle(keys.begin(), keys.end(), std::mt19937(1));
+
+			// Enough keys to split leaves many times over, every split moves
+			// keys the index has to follow
+			for (int k : keys) {
+				collection.set("key" + std::to_string(k), std::to_string(k));
+			}
+			for (int k : keys) {
+				Assert::AreEqual(*collection.get("key" + std::to_string(k)), std::to_string(k));
+			}
+
+			collection.set("key5", "updated");
+			Assert::AreEqual(*collection.get("key5"), std::string("updated"));
+
+			collection.del("key6");
+			Assert::ExpectException<std::out_of_range>([&] { collection.get("key6"); });
+			Assert::ExpectException<std::out_of_range>([&] { collection.get("missing"); });
+
+			Collection moved = std::move(collection);
+			Assert::AreEqual(*moved.get("key7"), std::string("7"));
+		}
+
+		TEST_METHOD(MultiGet)
+		{
+			for (bool hashIndex : { false, true }) {
+				CollectionOptions options;
+				options.hashIndex = hashIndex;
+				options.branchingFactor = 8;
+				Collection collection("test", options);
+				for (int i = 0; i < 5000; i++) {
+					collection.set("key" + std::to_string(i), std::to_string(i));
+				}
+				collection.del("key10");
+
+				// Unsorted, repeated, deleted and missing keys
+				std::vector<std::string> keys;
+				std::mt19937 random(3);
+				for (int i = 0; i < 200; i++) keys.push_back("key" + std::to_string(random() % 6000));
+				keys.push_back("key10");
+				keys.push_back(keys[0]);
+				keys.push_back("");
+
+				auto values = collection.multiGet(keys);
+				Assert::AreEqual(values.size(), keys.size());
+				for (size_t i = 0; i < keys.size(); i++) {
+					int n = keys[i].empty() ? -1 : std::stoi(keys[i].substr(3));
+					if (n >= 0 && n < 5000 && n != 10) Assert::AreEqual(*values[i], std::to_string(n));
+					else Assert::IsTrue(values[i] == nullptr);
+				}
+				Assert::IsTrue(collection.multiGet({}).empty());
+				Assert::IsTrue(Collection().multiGet({ "key1" })[0] == nullptr);
+			}
+		}
+	};
+}
@@ -6,6 +6,7 @@
 #include <set>
 #include <random>
 #include <map>
+#include <array>
 
 #include "windows.h"
 #define _CRTDBG_MAP_ALLOC //to get more details
@@ -194,6 +195,46 @@ namespace UnitTest
 			}
 		}
 
+		TEST_METHOD(BidirectionalIterator)
+		{
+			OrderedMap<int, std::string> test(4);
+			std::vector<int> keys;
+			for (int i = 0; i < 500; i++) keys.push_back(i * 2);
+			std::shuffle(keys.begin(), keys.end(), std::default_random_engine(7));
+			for (auto k : keys) {
+				test.set(k, std::to_string(k));
+			}
+			test.del(10);
+
+			// Entries are seen where they're stored, not copied
+			int expected = 0;
+			for (auto it = test.begin(); it != test.end(); ++it, expected += 2) {
+				Assert::AreEqual(it->first, expected);
+				Assert::IsTrue(&it->second == &test.at(expected));
+				Assert::AreEqual(it->isDeleted, expected == 10);
+			}
+			Assert::AreEqual(expected, 1000);
+
+			for (auto it = test.last(); it != test.end(); --it) {
+				expected -= 2;
+				Assert::AreEqual((*it).first, expected);
+				Assert::AreEqual((*it).second, std::to_string(expected));
+			}
+			Assert::AreEqual(expected, 0);
+
+			// Positioned directly, and back and forth across leaf boundaries
+			auto it = test.select(100);
+			Assert::AreEqual(it->first, 202);
+			for (int i = 0; i < 10; i++) ++it;
+			for (int i = 0; i < 10; i++) it--;
+			Assert::AreEqual(it->first, 202);
+			Assert::IsTrue(--test.begin() == test.end());
+			Assert::IsTrue(++test.last() == test.end());
+
+			OrderedMap<int, int> empty;
+			Assert::IsTrue(empty.last() == empty.end());
+		}
+
 		TEST_METHOD(Strings)
 		{
 			OrderedMap test = OrderedMap<int64_t, std::string>(100);
@@ -217,6 +258,249 @@ namespace UnitTest
 			Assert::ExpectException<std::out_of_range>([&test] { test.at(12); });
 		}
 
+		TEST_METHOD(OrderStatistics)
+		{
+			for (size_t branchingFactor : { 3, 4, 7, 32 }) {
+				OrderedMap<int, int> test = OrderedMap<int, int>(branchingFactor);
+				std::set<int> live;
+				srand(1);
+
+				for (int step = 0; step < 5000; step++) {
+					int key = rand() % 2000;
+					switch (rand() % 3) {
+					case 0:
+					case 1:
+						test.set(key, key);
+						live.insert(key);
+						break;
+					case 2:
+						test.del(key);
+						live.erase(key);
+						break;
+					}
+				}
+				// Tombstones written through set count as deleted too
+				test.set(-1, -1, true);
+				test.set(live.empty() ? 0 : *live.begin(), 0, true);
+				if (!live.empty()) live.erase(live.begin());
+
+				Assert::AreEqual(test.size(), live.size());
+				std::vector<int> sorted(live.begin(), live.end());
+				for (size_t n = 0; n < sorted.size(); n++) {
+					Assert::AreEqual(test.select(n)->first, sorted[n]);
+					Assert::AreEqual(test.rank(sorted[n]), n);
+				}
+				Assert::IsTrue(test.select(sorted.size()) == test.end());
+
+				for (int i = 0; i < 200; i++) {
+					int lo = rand() % 2100 - 50;
+					int hi = lo + rand() % 500;
+					size_t expected = std::distance(live.lower_bound(lo), live.upper_bound(hi));
+					Assert::AreEqual(test.count(lo, hi), expected);
+					Assert::AreEqual(test.rank(lo), (size_t)std::distance(live.begin(), live.lower_bound(lo)));
+				}
+				Assert::AreEqual(test.count(10, 5), (size_t)0);
+			}
+		}
+
+		TEST_METHOD(BranchingFactor)
+		{
+			// Whole cache lines of keys, bigger nodes for smaller entries
+			size_t intFactor = branching_factor_for<int64_t, int64_t>(64, 32 * 1024);
+			size_t largeValueFactor = branching_factor_for<int64_t, std::array<char, 256>>(64, 32 * 1024);
+			Assert::AreEqual(intFactor % (64 / sizeof(int64_t)), (size_t)0);
+			Assert::IsTrue(intFactor > largeValueFactor);
+			Assert::IsTrue(branching_factor_for<int64_t, int64_t>(64, 64 * 1024) > intFactor);
+
+			Assert::AreEqual(branching_factor_for<int64_t, int64_t>(64, 0), MIN_BRANCHING_FACTOR);
+			Assert::AreEqual(branching_factor_for<int64_t, int64_t>(64, 1ULL << 40), MAX_BRANCHING_FACTOR);
+
+			OrderedMap<int64_t, int64_t> test;
+			for (int64_t i = 0; i < 1000; i++) test.set(i, i);
+			validate_ordered_map(test, [] { std::vector<int64_t> keys(1000); for (int64_t i = 0; i < 1000; i++) keys[i] = i; return keys; }());
+		}
+
+		TEST_METHOD(FixedBranchingFactor)
+		{
+			// Linear scans for small nodes of integer keys, binary searches
+			// over power of two steps otherwise
+			check_fixed_branching_factor<int64_t, 4>();
+			check_fixed_branching_factor<int64_t, 8>();
+			check_fixed_branching_factor<int64_t, 24>();
+			check_fixed_branching_factor<int64_t, 64>();
+			check_fixed_branching_factor<std::string, 16>();
+			check_fixed_branching_factor<std::string, 100>();
+		}
+
+		TEST_METHOD(MemoryUsage)
+		{
+			OrderedMap<int64_t, int64_t> ints(16);
+			Assert::AreEqual(ints.memory_usage(), OrderedMapNode<int64_t, int64_t>::node_bytes(16, true));
+			for (int64_t i = 0; i < 1000; i++) ints.set(i, i);
+			size_t filled = ints.memory_usage();
+			Assert::IsTrue(filled >= 1000 * 2 * sizeof(int64_t));
+
+			// Fixed-size entries only take up node memory, which overwrites
+			// and deletes leave as it is
+			for (int64_t i = 0; i < 1000; i++) ints.set(i, -i);
+			ints.del(5);
+			Assert::AreEqual(ints.memory_usage(), filled);
+
+			OrderedMap<std::string, std::string> strings(16);
+			size_t empty = strings.memory_usage();
+			std::string key(100, 'k');
+			strings.set(key, std::string(100, 'v'));
+			size_t one = strings.memory_usage();
+			Assert::IsTrue(one - empty >= 200 && one - empty < 300);
+
+			// The old value is released
+			strings.set(key, std::string(10000, 'v'));
+			size_t grown = strings.memory_usage() - one;
+			// Counted by capacity, which the allocator may round up
+			Assert::IsTrue(grown >= 9900 && grown < 20000);
+
+			OrderedMap<std::string, std::string> moved = std::move(strings);
+			Assert::AreEqual(moved.memory_usage(), one + grown);
+		}
+
+		TEST_METHOD(FindSorted)
+		{
+			// Deep enough that the keys share some nodes and not others
+			OrderedMap<int, int> test(4);
+			for (int i = 0; i < 10000; i += 2) {
+				test.set(i, -i);
+			}
+			test.del(100);
+
+			std::vector<int> keys = { -5, 0, 0, 1, 100, 102, 5000, 5001, 9998, 20000 };
+			std::vector<const int*> pointers;
+			for (const auto& k : keys) pointers.push_back(&k);
+			std::vector<int> seen;
+			test.find_sorted(pointers.data(), pointers.size(), [&](size_t i, const OrderedMapNodeValue<int>* entry) {
+				seen.push_back((int)i);
+				bool exists = keys[i] >= 0 && keys[i] < 10000 && keys[i] % 2 == 0;
+				Assert::AreEqual(entry != nullptr, exists);
+				if (entry) {
+					Assert::AreEqual(entry->value, -keys[i]);
+					Assert::AreEqual(entry->isDeleted, keys[i] == 100);
+				}
+			});
+			Assert::AreEqual(seen.size(), keys.size());
+
+			OrderedMap<int, int> empty;
+			empty.find_sorted(pointers.data(), 1, [&](size_t i, const OrderedMapNodeValue<int>* entry) { Assert::IsNull(entry); });
+		}
+
+		TEST_METHOD(Update)
+		{
+			OrderedMap<int64_t, int64_t> map(8);
+			auto increment = [](int64_t& value, bool exists) { value++; return true; };
+			for (int i = 0; i < 3; i++) {
+				for (int64_t key = 0; key < 1000; key++) {
+					Assert::IsNotNull(map.update(key, increment));
+				}
+			}
+			for (int64_t key = 0; key < 1000; key++) {
+				Assert::AreEqual(map.at(key), (int64_t)3);
+			}
+			Assert::AreEqual(map.size(), (size_t)1000);
+
+			// Deleted keys start over, and declined changes aren't written
+			map.del(5);
+			Assert::IsNull(map.update(5, [](int64_t& value, bool exists) { return exists; }));
+			Assert::AreEqual(map.size(), (size_t)999);
+			map.update(5, increment);
+			Assert::AreEqual(map.at(5), (int64_t)1);
+			Assert::IsNull(map.update(2000, [](int64_t& value, bool exists) { return false; }));
+			Assert::ExpectException<std::out_of_range>([&] { map.at(2000); });
+
+			// Values changed in place are still accounted for
+			OrderedMap<std::string, std::string> strings(16);
+			strings.set("key", "");
+			size_t before = strings.memory_usage();
+			strings.update("key", [](std::string& value, bool exists) { value.append(1000, 'v'); return true; });
+			Assert::IsTrue(strings.memory_usage() >= before + 1000);
+			Assert::AreEqual(strings.at("key").size(), (size_t)1000);
+		}
+
+		TEST_METHOD(Learned)
+		{
+			// Sequential keys fit one line
+			OrderedMap<int64_t, int64_t> dense(16);
+			for (int64_t i = 0; i < 100000; i++) {
+				dense.set(i, i * 2);
+			}
+			size_t treeBytes = dense.memory_usage();
+			dense.learn();
+			Assert::IsNotNull(dense.learned());
+			Assert::AreEqual(dense.learned()->segments(), (size_t)1);
+			Assert::IsTrue(dense.memory_usage() - treeBytes < treeBytes / 10);
+			for (int64_t i = 0; i < 100000; i++) {
+				Assert::AreEqual(dense.at(i), i * 2);
+			}
+			Assert::ExpectException<std::out_of_range>([&] { dense.at(-1); });
+			Assert::ExpectException<std::out_of_range>([&] { dense.at(100000); });
+
+			// Overwrites, deletes and keys appended in order keep it
+			dense.set(5, 0);
+			dense.del(6);
+			Assert::IsNotNull(dense.learned());
+			Assert::AreEqual(dense.at(5), (int64_t)0);
+			Assert::AreEqual(dense.size(), (size_t)99999);
+			size_t leaves = dense.learned()->size();
+			for (int64_t i = 100000; i < 110000; i++) {
+				dense.set(i, i * 2);
+			}
+			Assert::IsNotNull(dense.learned());
+			Assert::IsTrue(dense.learned()->size() > leaves);
+			Assert::AreEqual(dense.learned()->segments(), (size_t)1);
+			for (int64_t i = 7; i < 110000; i += 7) {
+				Assert::AreEqual(dense.at(i), i * 2);
+			}
+
+			// Other splits drop it, until enough of them refit it
+			int64_t key = -1;
+			while (dense.learned()) {
+				dense.set(key, key * 2);
+				key--;
+			}
+			size_t inserted = 0;
+			for (; !dense.learned(); key--, inserted++) {
+				dense.set(key, key * 2);
+			}
+			Assert::IsTrue(inserted > RELEARN_LEAVES_PER_SPLIT);
+			for (int64_t i = key + 1; i < 0; i++) {
+				Assert::AreEqual(dense.at(i), i * 2);
+			}
+			Assert::AreEqual(dense.at(109999), (int64_t)219998);
+
+			// Clusters and gaps take more lines, keys beyond a double's
+			// precision are still found, as are keys between the leaves
+			std::mt19937_64 random(1);
+			std::set<int64_t> keys;
+			for (int64_t cluster = 0; cluster < 20; cluster++) {
+				int64_t start = (int64_t)(random() >> 2);
+				for (int64_t i = 0; i < 2000; i++) keys.insert(start + i * (cluster + 1));
+			}
+			OrderedMap<int64_t, int64_t> sparse(8);
+			for (int64_t key : keys) sparse.set(key, -key);
+			for (size_t maxError : { 0, 1, 8, 64 }) {
+				sparse.learn(maxError);
+				Assert::IsTrue(sparse.learned()->segments() > 1);
+				for (int64_t key : keys) {
+					Assert::AreEqual(sparse.at(key), -key);
+					if (!keys.count(key + 1)) Assert::ExpectException<std::out_of_range>([&] { sparse.at(key + 1); });
+				}
+			}
+			sparse.update(*keys.begin() - 1, [](int64_t& value, bool exists) { value = 1; return true; });
+			Assert::AreEqual(sparse.at(*keys.begin() - 1), (int64_t)1);
+
+			OrderedMap<int64_t, int64_t> empty;
+			empty.learn();
+			Assert::IsNull(empty.learned());
+			Assert::ExpectException<std::out_of_range>([&] { empty.at(0); });
+		}
+
 		TEST_METHOD(MemoryLeak)
 		{
 			_CrtMemState sOld;
@@ -249,8 +533,51 @@ namespace UnitTest
 			*/
 		}
 	private:
-		template<typename K, typename V>
-		void validate_ordered_map(const OrderedMap<K, V>& map, const std::vector<K>& keys)
+		template<typename K, size_t N>
+		void check_fixed_branching_factor()
+		{
+			auto key = [](int i) {
+				if constexpr (std::is_same_v<K, std::string>) {
+					char buffer[16];
+					snprintf(buffer, sizeof(buffer), "key%06d", i);
+					return std::string(buffer);
+				}
+				else return (K)i;
+			};
+
+			OrderedMap<K, K, N> test;
+			std::map<K, K> expected;
+			srand(1);
+			for (int step = 0; step < 5000; step++) {
+				K k = key(rand() % 2000);
+				if (rand() % 4 == 0) {
+					test.del(k);
+					expected.erase(k);
+				}
+				else {
+					test.set(k, k);
+					expected[k] = k;
+				}
+			}
+
+			Assert::AreEqual(test.size(), expected.size());
+			std::vector<K> keys;
+			for (auto const& [k, _] : expected) {
+				Assert::AreEqual(test.at(k), k);
+				Assert::AreEqual(test.rank(k), keys.size());
+				keys.push_back(k);
+			}
+			Assert::ExpectException<std::out_of_range>([&] { test.at(key(5000)); });
+
+			std::vector<K> live;
+			for (auto it = test.begin(); it != test.end(); ++it) {
+				if (!it->isDeleted) live.push_back(it->first);
+			}
+			Assert::IsTrue(live == keys);
+		}
+
+		template<typename K, typename V, size_t N>
+		void validate_ordered_map(const OrderedMap<K, V, N>& map, const std::vector<K>& keys)
 		{
 			std::ostringstream output_buffer;
 			//output_buffer << keys.size() << std::endl;
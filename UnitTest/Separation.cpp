@@ -0,0 +1,222 @@
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "../SimpleKVS/Database.h"
+#include <boost/asio/io_context.hpp>
+#include <filesystem>
+#include <string>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(SeparationTest)
+	{
+	public:
+
+		TEST_METHOD(LargeValuesOutOfLine)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "SimpleKVS-separation";
+			std::filesystem::remove_all(directory);
+			{
+				CollectionOptions options;
+				options.valueLogThreshold = 100;
+				options.valueLogDirectory = directory.string();
+				Collection collection("test", options);
+
+				std::string large(10000, 'v');
+				for (int i = 0; i < 100; i++) {
+					collection.set("large" + std::to_string(i), large + std::to_string(i));
+					collection.set("small" + std::to_string(i), std::to_string(i));
+				}
+				for (int i = 0; i < 100; i++) {
+					Assert::AreEqual(*collection.get("large" + std::to_string(i)), large + std::to_string(i));
+					Assert::AreEqual(*collection.get("small" + std::to_string(i)), std::to_string(i));
+				}
+				// The trees only hold pointers to the large values
+				Assert::IsTrue(collection.memoryUsage() < 100 * 10000 / 10);
+				Assert::IsTrue(collection.valueLog()->size() > 100 * 10000);
+
+				Assert::AreEqual(collection.sum().toString(), std::to_string(99 * 100 / 2));
+				Assert::AreEqual(*collection.select(0)[0].second, large + "0");
+
+				// Values cross the threshold both ways
+				collection.update("small1", [&](std::string& value, bool exists) { value += large; return true; });
+				Assert::AreEqual(*collection.get("small1"), "1" + large);
+				collection.set("large1", "1");
+				collection.del("large2");
+				Assert::AreEqual(*collection.get("large1"), std::string("1"));
+				Assert::ExpectException<std::out_of_range>([&] { collection.get("large2"); });
+				Assert::IsTrue(collection.valueLog()->garbage() >= 2 * 10000);
+			}
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(GarbageCollection)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "SimpleKVS-garbage";
+			std::filesystem::remove_all(directory);
+			{
+				CollectionOptions options;
+				options.hashIndex = true;
+				options.valueLogThreshold = 100;
+				options.valueLogDirectory = directory.string();
+				options.valueLogSegmentSize = 64 * 1024;
+				Collection collection("test", options);
+				const ValueLog* log = collection.valueLog();
+				// What the flush thread does
+				auto flush = [&]() {
+					collection.seal();
+					while (collection.flush(nullptr)) {}
+					while (collection.collectGarbage() > 0) {}
+					while (collection.flush(nullptr)) {}
+				};
+				auto files = [&]() {
+					size_t count = 0;
+					for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+						count += entry.path().extension() == ".vlog";
+					}
+					return count;
+				};
+
+				// Overwrite the same keys over and over, so most of the log is garbage
+				std::string value(1000, 'v');
+				for (int round = 0; round < 20; round++) {
+					for (int i = 0; i < 100; i++) {
+						collection.set("key" + std::to_string(i), value + std::to_string(round));
+					}
+					// Garbage is only counted until the flush thread collects it
+					if (round == 0) Assert::IsFalse(log->collectable().has_value());
+					flush();
+				}
+				// Without collection this would be about 2 MB in 30 segments
+				Assert::IsTrue(log->size() < 1024 * 1024);
+				Assert::IsTrue(log->garbage() < log->size());
+				Assert::AreEqual(files(), log->segments());
+				for (int i = 0; i < 100; i++) {
+					Assert::AreEqual(*collection.get("key" + std::to_string(i)), value + "19");
+				}
+
+				// Live values are moved out of the way
+				for (int i = 50; i < 100; i++) {
+					collection.del("key" + std::to_string(i));
+				}
+				flush();
+				Assert::IsFalse(log->collectable().has_value());
+				Assert::AreEqual(files(), log->segments());
+				for (int i = 0; i < 50; i++) {
+					Assert::AreEqual(*collection.get("key" + std::to_string(i)), value + "19");
+				}
+
+				// Retired segments stay until the buffer with the moved values is
+				// flushed, as runs still point into them
+				for (int i = 0; i < 50; i++) {
+					collection.set("key" + std::to_string(i), value);
+				}
+				collection.seal();
+				while (collection.flush(nullptr)) {}
+				size_t before = files();
+				Assert::IsTrue(collection.collectGarbage() > 0);
+				Assert::AreEqual(files(), before);
+				Assert::AreEqual(*collection.get("key0"), value);
+				while (collection.flush(nullptr)) {}
+				Assert::IsTrue(files() < before);
+			}
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(AsyncReads)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "SimpleKVS-async-reads";
+			std::filesystem::remove_all(directory);
+			{
+				CollectionOptions options;
+				options.valueLogThreshold = 100;
+				options.valueLogDirectory = directory.string();
+				Collection collection("test", options);
+				std::string large(1000, 'v');
+				collection.set("a", large);
+				collection.set("b", "small");
+				collection.syncValueLog();
+
+				// Small values are answered right away
+				boost::asio::io_context context;
+				auto handler = [](std::exception_ptr error, std::vector<Collection::Value> values) {
+					Assert::Fail(L"Shouldn't be called");
+				};
+				auto values = collection.multiGet({ "b", "c" }, context, handler);
+				Assert::IsTrue(values.has_value());
+				Assert::AreEqual(*(*values)[0], std::string("small"));
+				Assert::IsFalse((bool)(*values)[1]);
+
+				// Large ones once they're read, on the context
+				std::vector<Collection::Value> read;
+				values = collection.multiGet({ "a", "b", "c" }, context,
+					[&](std::exception_ptr error, std::vector<Collection::Value> values) {
+						Assert::IsFalse((bool)error);
+						read = std::move(values);
+					});
+				Assert::IsFalse(values.has_value());
+				Collection::Entries selected;
+				auto entries = collection.select(0, 10, context,
+					[&](std::exception_ptr error, Collection::Entries entries) {
+						Assert::IsFalse((bool)error);
+						selected = std::move(entries);
+					});
+				Assert::IsFalse(entries.has_value());
+				context.run();
+
+				Assert::AreEqual(read.size(), (size_t)3);
+				Assert::AreEqual(*read[0], large);
+				Assert::AreEqual(*read[1], std::string("small"));
+				Assert::IsFalse((bool)read[2]);
+				Assert::AreEqual(selected.size(), (size_t)2);
+				Assert::AreEqual(*selected[0].second, large);
+				Assert::AreEqual(*selected[1].second, std::string("small"));
+			}
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(ReopenValueLog)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "SimpleKVS-reopen-log";
+			std::filesystem::remove_all(directory);
+			DatabaseOptions options;
+			options.dataDirectory = directory.string();
+			options.collectionDefaults.valueLogThreshold = 100;
+			options.collectionDefaults.valueLogSegmentSize = 64 * 1024;
+			options.collectionDefaults.writeBufferSize = 2 * 1024;
+
+			// Enough flushes that the flush thread collects segments that
+			// older runs still point into
+			std::string value(1000, 'v');
+			{
+				Database database(options);
+				Collection& collection = database.addCollection("test");
+				for (int round = 0; round < 20; round++) {
+					for (int i = 0; i < 100; i++) {
+						collection.set("key" + std::to_string(i), value + std::to_string(round));
+					}
+				}
+				collection.del("key99");
+				database.waitForFlushes();
+				Assert::IsTrue(collection.valueLog()->size() < 20 * 100 * 1000);
+			}
+			{
+				Database database(options);
+				Collection& collection = database.getCollection("test");
+				Assert::AreEqual(collection.size(), (size_t)99);
+				for (int i = 0; i < 99; i++) {
+					Assert::AreEqual(*collection.get("key" + std::to_string(i)), value + "19");
+				}
+				// Values overwritten before they reached a run are garbage too
+				Assert::IsTrue(collection.valueLog()->garbage() > 0);
+
+				// New values go to a new segment, the old ones are kept
+				collection.set("key0", value);
+				Assert::AreEqual(*collection.get("key0"), value);
+				Assert::AreEqual(*collection.get("key1"), value + "19");
+			}
+			std::filesystem::remove_all(directory);
+		}
+	};
+}
@@ -0,0 +1,236 @@
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "../SimpleKVS/IOEngine.h"
+#include "../SimpleKVS/IOUringEngine.h"
+#include "../SimpleKVS/ThreadPoolIOEngine.h"
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(StorageIOTest)
+	{
+	public:
+
+		// Runs `test` against every backend this machine has
+		static void forEachBackend(const std::function<void(IOEngine& engine)>& test)
+		{
+			{
+				ThreadPoolIOEngine engine(2);
+				test(engine);
+			}
+#if defined(__linux__)
+			// Blocked in some containers, then only the thread pool is tested
+			if (auto engine = IOUringEngine::create(32)) test(*engine);
+#endif
+		}
+
+		static std::string tempPath(const char* name)
+		{
+			auto path = std::filesystem::temp_directory_path() / (std::string("SimpleKVS-storageio-") + name);
+			std::filesystem::remove(path);
+			return path.string();
+		}
+
+		TEST_METHOD(RoundTrip)
+		{
+			forEachBackend([](IOEngine& engine) {
+				std::string path = tempPath("roundtrip");
+				{
+					boost::asio::io_context context;
+					StorageFile file;
+					file.open(path);
+
+					std::vector<std::string> records = { "first", std::string(100000, 'x'), "third" };
+					std::vector<uint64_t> offsets;
+					size_t written = 0;
+					for (const auto& record : records) {
+						offsets.push_back(engine.append(file, record.data(), record.size(), context,
+							[&](const boost::system::error_code& error, size_t bytes) {
+								Assert::IsFalse((bool)error);
+								written += bytes;
+							}));
+					}
+					Assert::AreEqual(offsets[1], (uint64_t)5);
+					Assert::AreEqual(offsets[2], (uint64_t)100005);
+					Assert::AreEqual(file.size(), (uint64_t)100010);
+					engine.submit();
+					context.run();
+					Assert::AreEqual(written, (size_t)100010);
+
+					bool synced = false;
+					engine.sync(file, context, [&](const boost::system::error_code& error, size_t bytes) {
+						Assert::IsFalse((bool)error);
+						synced = true;
+					});
+					engine.submit();
+					context.restart();
+					context.run();
+					Assert::IsTrue(synced);
+
+					std::vector<std::string> read(records.size());
+					for (size_t i = 0; i < records.size(); i++) {
+						read[i].resize(records[i].size());
+						engine.read(file, offsets[i], read[i].data(), read[i].size(), context,
+							[&, i](const boost::system::error_code& error, size_t bytes) {
+								Assert::IsFalse((bool)error);
+								Assert::AreEqual(bytes, records[i].size());
+							});
+					}
+					engine.submit();
+					context.restart();
+					context.run();
+					for (size_t i = 0; i < records.size(); i++) {
+						Assert::AreEqual(read[i], records[i]);
+					}
+
+					// Reopening finds the appends
+					file.open(path);
+					Assert::AreEqual(file.size(), (uint64_t)100010);
+				}
+				std::filesystem::remove(path);
+			});
+		}
+
+		TEST_METHOD(ShortTransfers)
+		{
+			forEachBackend([](IOEngine& engine) {
+				std::string path = tempPath("short");
+				{
+					boost::asio::io_context context;
+					StorageFile file;
+					file.open(path);
+					std::string data(100, 'd');
+					engine.append(file, data.data(), data.size(), context, [](const boost::system::error_code&, size_t) {});
+					engine.submit();
+					context.run();
+
+					// Past the end a read stops early, or returns nothing
+					std::string buffer(200, 0);
+					std::vector<size_t> sizes;
+					for (uint64_t offset : { (uint64_t)50, (uint64_t)100, (uint64_t)1000 }) {
+						engine.read(file, offset, buffer.data(), buffer.size(), context,
+							[&](const boost::system::error_code& error, size_t bytes) {
+								Assert::IsFalse((bool)error);
+								sizes.push_back(bytes);
+							});
+						engine.submit();
+						context.restart();
+						context.run();
+					}
+					Assert::AreEqual(sizes.size(), (size_t)3);
+					Assert::AreEqual(sizes[0], (size_t)50);
+					Assert::AreEqual(sizes[1], (size_t)0);
+					Assert::AreEqual(sizes[2], (size_t)0);
+					Assert::AreEqual(buffer.substr(0, 50), std::string(50, 'd'));
+				}
+				std::filesystem::remove(path);
+			});
+		}
+
+		TEST_METHOD(Batching)
+		{
+			forEachBackend([](IOEngine& engine) {
+				std::string path = tempPath("batching");
+				{
+					boost::asio::io_context context;
+					StorageFile file;
+					file.open(path);
+					std::vector<char> buffers(IOEngine::MAX_BATCH_SIZE);
+					size_t completed = 0;
+					auto handler = [&](const boost::system::error_code& error, size_t bytes) {
+						Assert::IsFalse((bool)error);
+						completed++;
+					};
+
+					// Nothing is handed to the backend until a batch fills up
+					for (size_t i = 0; i + 1 < IOEngine::MAX_BATCH_SIZE; i++) {
+						engine.append(file, &buffers[i], 1, context, handler);
+					}
+					context.run_for(std::chrono::milliseconds(50));
+					Assert::AreEqual(completed, (size_t)0);
+
+					engine.append(file, &buffers.back(), 1, context, handler);
+					auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+					while (completed < IOEngine::MAX_BATCH_SIZE && std::chrono::steady_clock::now() < deadline) {
+						context.restart();
+						context.run_for(std::chrono::milliseconds(10));
+					}
+					Assert::AreEqual(completed, IOEngine::MAX_BATCH_SIZE);
+				}
+				std::filesystem::remove(path);
+			});
+		}
+
+		TEST_METHOD(HandlersRunOnTheirContext)
+		{
+			forEachBackend([](IOEngine& engine) {
+				std::string path = tempPath("context");
+				{
+					boost::asio::io_context first;
+					boost::asio::io_context second;
+					StorageFile file;
+					file.open(path);
+					std::string data = "data";
+					std::thread::id firstThread;
+					std::thread::id secondThread;
+					engine.append(file, data.data(), data.size(), first,
+						[&](const boost::system::error_code&, size_t) { firstThread = std::this_thread::get_id(); });
+					engine.append(file, data.data(), data.size(), second,
+						[&](const boost::system::error_code&, size_t) { secondThread = std::this_thread::get_id(); });
+					engine.submit();
+
+					// Each handler waits for its own context to run
+					std::thread runner([&]() { second.run(); });
+					runner.join();
+					Assert::IsTrue(secondThread != std::this_thread::get_id() && secondThread != std::thread::id());
+					Assert::IsTrue(firstThread == std::thread::id());
+					first.run();
+					Assert::IsTrue(firstThread == std::this_thread::get_id());
+				}
+				std::filesystem::remove(path);
+			});
+		}
+
+		TEST_METHOD(DestructionCompletesQueued)
+		{
+			std::string path = tempPath("destruction");
+			std::vector<std::unique_ptr<IOEngine>> engines;
+			engines.push_back(std::make_unique<ThreadPoolIOEngine>(2));
+#if defined(__linux__)
+			if (auto engine = IOUringEngine::create(4)) engines.push_back(std::move(engine));
+#endif
+			for (auto& engine : engines) {
+				boost::asio::io_context context;
+				StorageFile file;
+				file.open(path);
+				// Queued but never submitted, and more than the ring holds
+				std::string data(1000, 'q');
+				size_t completed = 0;
+				for (int i = 0; i < 40; i++) {
+					engine->append(file, data.data(), data.size(), context, [&](const boost::system::error_code& error, size_t bytes) {
+						Assert::IsFalse((bool)error);
+						Assert::AreEqual(bytes, (size_t)1000);
+						completed++;
+					});
+				}
+				uint64_t size = file.size();
+				engine.reset();
+				context.run();
+				Assert::AreEqual(completed, (size_t)40);
+
+				std::string check(1000, 0);
+				boost::system::error_code error;
+				Assert::AreEqual(file.readAt(size - 1000, check.data(), check.size(), error), (size_t)1000);
+				Assert::AreEqual(check, data);
+			}
+			std::filesystem::remove(path);
+		}
+	};
+}
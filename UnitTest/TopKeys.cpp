@@ -0,0 +1,101 @@
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "../SimpleKVS/Database.h"
+#include "../SimpleKVS/HotKeys.h"
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(TopKeysTest)
+	{
+	public:
+
+		TEST_METHOD(SpaceSavingExact)
+		{
+			// Exact while there are no more keys than the capacity
+			SpaceSaving summary(8);
+			for (int i = 0; i < 8; i++) {
+				for (int j = 0; j <= i; j++) summary.add("key" + std::to_string(i), 1);
+			}
+			auto top = summary.top(3);
+			Assert::AreEqual(top.size(), (size_t)3);
+			Assert::AreEqual(top[0].key, std::string("key7"));
+			Assert::AreEqual(top[0].count, (uint64_t)8);
+			Assert::AreEqual(top[2].key, std::string("key5"));
+			Assert::AreEqual(top[2].error, (uint64_t)0);
+
+			// A new key evicts the least frequent one
+			summary.add("new", 1);
+			auto all = summary.top(100);
+			Assert::AreEqual(all.size(), (size_t)8);
+			Assert::IsTrue(std::none_of(all.begin(), all.end(), [](auto& e) { return e.key == "key0"; }));
+		}
+
+		TEST_METHOD(SketchOvercounts)
+		{
+			CountMinSketch sketch(256, 4);
+			std::map<uint64_t, uint64_t> counts;
+			std::mt19937_64 random(1);
+			for (int i = 0; i < 100000; i++) {
+				uint64_t key = random() % 5000;
+				sketch.add(std::hash<uint64_t>{}(key), 1);
+				counts[key]++;
+			}
+			for (auto& [key, count] : counts) {
+				Assert::IsTrue(sketch.estimate(std::hash<uint64_t>{}(key)) >= count);
+			}
+			sketch.decay();
+			Assert::IsTrue(sketch.estimate(std::hash<uint64_t>{}(counts.begin()->first)) >= counts.begin()->second / 2);
+		}
+
+		TEST_METHOD(HotKeysFromThreads)
+		{
+			HotKeyTracker tracker(4);
+			// Zipf-like traffic: key i is accessed about 1 / (i + 1) as often
+			auto traffic = [&tracker](int seed) {
+				std::mt19937 random(seed);
+				std::discrete_distribution<int> pick({ 1000, 500, 333, 250, 200, 166, 142, 125, 111, 100 });
+				std::uniform_int_distribution<int> cold(0, 100000);
+				for (int i = 0; i < 100000; i++) {
+					tracker.record(i % 2 ? "hot" + std::to_string(pick(random)) : "cold" + std::to_string(cold(random)));
+				}
+			};
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) threads.emplace_back(traffic, t);
+			for (auto& thread : threads) thread.join();
+
+			auto top = tracker.top(3);
+			Assert::AreEqual(top.size(), (size_t)3);
+			Assert::AreEqual(top[0].key, std::string("hot0"));
+			Assert::AreEqual(top[1].key, std::string("hot1"));
+			// About 200000 * 1000 / 2927 accesses, sampled
+			Assert::IsTrue(top[0].count > 50000 && top[0].count < 90000);
+		}
+
+		TEST_METHOD(CollectionTopKeys)
+		{
+			CollectionOptions options;
+			options.hotKeySampling = 1;
+			Collection collection("test", options);
+			collection.set("a", "1");
+			collection.set("b", "1");
+			for (int i = 0; i < 10; i++) collection.get("b");
+
+			auto top = collection.topKeys(10);
+			Assert::AreEqual(top.size(), (size_t)2);
+			Assert::AreEqual(top[0].key, std::string("b"));
+			Assert::AreEqual(top[0].count, (uint64_t)11);
+
+			options.hotKeySampling = 0;
+			Collection untracked("test", options);
+			untracked.set("a", "1");
+			Assert::IsTrue(untracked.topKeys(10).empty());
+		}
+	};
+}
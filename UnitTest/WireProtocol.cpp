@@ -0,0 +1,205 @@
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "../SimpleKVS/Protocol.h"
+#include <string>
+#include <vector>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(WireProtocolTest)
+	{
+	public:
+
+		TEST_METHOD(ParseText)
+		{
+			Request request;
+			std::string error;
+			Assert::IsTrue(parseRequest("GET users alice\r", request, error));
+			Assert::IsTrue(request.op == Opcode::Get);
+			Assert::AreEqual(request.collection, std::string("users"));
+			Assert::AreEqual(request.args.size(), (size_t)1);
+			Assert::AreEqual(request.args[0], std::string("alice"));
+
+			// Values are the rest of the line
+			Assert::IsTrue(parseRequest("SET users alice likes  spaces ", request, error));
+			Assert::AreEqual(request.args[1], std::string("likes  spaces "));
+			Assert::IsTrue(parseRequest("SET users alice", request, error));
+			Assert::AreEqual(request.args[1], std::string());
+			Assert::IsTrue(parseRequest("CAS users alice old new value", request, error));
+			Assert::AreEqual(request.args.size(), (size_t)3);
+			Assert::AreEqual(request.args[2], std::string("new value"));
+
+			Assert::IsTrue(parseRequest("MGET users a b c", request, error));
+			Assert::AreEqual(request.args.size(), (size_t)3);
+			// Arguments are reset between requests
+			Assert::IsTrue(parseRequest("COUNT users", request, error));
+			Assert::IsTrue(request.args.empty());
+		}
+
+		TEST_METHOD(ParseTextErrors)
+		{
+			Request request;
+			std::string error;
+			for (const char* line : { "", "\r", "FROB users key", "get users key", "GET", "GET users",
+				"GET users a b", "SET users", "CAS users key", "MSET users a", "MGET users",
+				"COUNT users a", "SELECT users", "HISTOGRAM users 1 a", "INCR users", "TOPKEYS users 1 2" })
+			{
+				error.clear();
+				Assert::IsFalse(parseRequest(line, request, error));
+				Assert::IsFalse(error.empty());
+			}
+		}
+
+		TEST_METHOD(BinaryHeader)
+		{
+			::BinaryHeader header;
+			header.code = (uint8_t)Opcode::MGet;
+			header.collectionLength = 0xbeef;
+			header.keyLength = 0x01020304;
+			header.valueLength = 7;
+			header.opaque = 0xfffffffe;
+			char bytes[BINARY_HEADER_SIZE];
+			encodeBinaryHeader(header, bytes);
+			::BinaryHeader decoded = decodeBinaryHeader(bytes);
+			Assert::AreEqual(decoded.magic, BINARY_REQUEST_MAGIC);
+			Assert::AreEqual(decoded.code, header.code);
+			Assert::AreEqual(decoded.collectionLength, header.collectionLength);
+			Assert::AreEqual(decoded.keyLength, header.keyLength);
+			Assert::AreEqual(decoded.valueLength, header.valueLength);
+			Assert::AreEqual(decoded.opaque, header.opaque);
+			Assert::IsTrue(isValidRequestHeader(decoded));
+
+			// Oversized or foreign frames can't be skipped safely
+			decoded.keyLength = (uint32_t)MAX_PAYLOAD_SIZE;
+			Assert::IsFalse(isValidRequestHeader(decoded));
+			decoded.keyLength = 0xffffffff;
+			decoded.valueLength = 0xffffffff;
+			Assert::IsFalse(isValidRequestHeader(decoded));
+			decoded = decodeBinaryHeader(bytes);
+			decoded.magic = BINARY_RESPONSE_MAGIC;
+			Assert::IsFalse(isValidRequestHeader(decoded));
+		}
+
+		TEST_METHOD(BinaryRequests)
+		{
+			// Every request survives encoding, header and payload
+			std::vector<Request> requests = {
+				{ Opcode::Get, "users", { "alice" } },
+				{ Opcode::Set, "users", { "alice", std::string("binary\n\0value", 13) } },
+				{ Opcode::MGet, "users", { "a", "", "c" } },
+				{ Opcode::MSet, "users", { "a", "1", "b", "2" } },
+				{ Opcode::Cas, "users", { "a", "1", "2" } },
+			};
+			for (const auto& request : requests) {
+				std::string frame;
+				encodeBinaryRequest(request, 42, frame);
+				::BinaryHeader header = decodeBinaryHeader(frame.data());
+				Assert::IsTrue(isValidRequestHeader(header));
+				Assert::AreEqual(header.opaque, (uint32_t)42);
+				Assert::AreEqual(frame.size(), BINARY_HEADER_SIZE + header.collectionLength + header.keyLength + header.valueLength);
+
+				Request decoded;
+				std::string error;
+				std::string_view payload(frame.data() + BINARY_HEADER_SIZE, (size_t)header.collectionLength + header.keyLength);
+				Assert::IsTrue(decodeBinaryRequest(header, payload, decoded, error));
+				Assert::IsTrue(decoded.op == request.op);
+				Assert::AreEqual(decoded.collection, request.collection);
+				Assert::AreEqual(decoded.args.size(), request.args.size());
+				// The value of a SET is read by the caller
+				size_t compared = request.op == Opcode::Set ? 1 : request.args.size();
+				for (size_t i = 0; i < compared; i++) {
+					Assert::AreEqual(decoded.args[i], request.args[i]);
+				}
+			}
+		}
+
+		TEST_METHOD(MalformedBinaryRequests)
+		{
+			auto decode = [](::BinaryHeader header, const std::string& payload) {
+				Request request;
+				std::string error;
+				bool valid = decodeBinaryRequest(header, payload, request, error);
+				Assert::AreEqual(valid, error.empty());
+				return valid;
+			};
+			::BinaryHeader header;
+			header.code = (uint8_t)Opcode::Get;
+			header.collectionLength = 5;
+			header.keyLength = 3;
+			Assert::IsTrue(decode(header, "userskey"));
+
+			// Truncated, overlong, and sections longer than the payload
+			Assert::IsFalse(decode(header, "users"));
+			Assert::IsFalse(decode(header, "userskeyextra"));
+			header.collectionLength = 0xffff;
+			Assert::IsFalse(decode(header, "userskey"));
+			header.collectionLength = 0;
+			Assert::IsFalse(decode(header, "key"));
+
+			// Values only go with SET
+			header.collectionLength = 5;
+			header.valueLength = 10;
+			Assert::IsFalse(decode(header, "userskey"));
+			header.code = (uint8_t)Opcode::MGet;
+			Assert::IsFalse(decode(header, "userskey"));
+			header.valueLength = 0;
+
+			// Items whose length runs past the key section
+			std::string items = "users";
+			items += std::string("\x05\x00\x00\x00" "abc", 7);
+			header.keyLength = 7;
+			Assert::IsFalse(decode(header, items));
+			items = "users";
+			items += std::string("\xff\xff\xff\xff", 4);
+			header.keyLength = 4;
+			Assert::IsFalse(decode(header, items));
+			items = "users";
+			items += std::string("\x01\x00", 2);
+			header.keyLength = 2;
+			Assert::IsFalse(decode(header, items));
+
+			header.code = 0xee;
+			header.keyLength = 3;
+			Assert::IsFalse(decode(header, "userskey"));
+		}
+
+		TEST_METHOD(BinaryResponses)
+		{
+			Response multi;
+			multi.isMulti = true;
+			multi.results = { { Status::Value, "first" }, { Status::NotFound, "" }, { Status::Value, std::string(10000, 'v') } };
+			Response single;
+			single.results = { { Status::Error, "Unknown command" } };
+
+			for (const Response* response : { &multi, &single }) {
+				std::string framing;
+				encodeBinaryResponseFraming(*response, 7, framing);
+				std::string frame;
+				binaryResponseLayout(*response, framing, [&](const char* data, size_t size) { frame.append(data, size); });
+
+				::BinaryHeader header = decodeBinaryHeader(frame.data());
+				Assert::AreEqual(header.magic, BINARY_RESPONSE_MAGIC);
+				Assert::AreEqual(header.opaque, (uint32_t)7);
+				Assert::AreEqual(frame.size(), BINARY_HEADER_SIZE + header.valueLength);
+
+				Response decoded;
+				std::string_view payload(frame.data() + BINARY_HEADER_SIZE, header.valueLength);
+				Assert::IsTrue(decodeBinaryResponse(header, payload, decoded));
+				Assert::AreEqual(decoded.isMulti, response->isMulti);
+				Assert::AreEqual(decoded.results.size(), response->results.size());
+				for (size_t i = 0; i < decoded.results.size(); i++) {
+					Assert::IsTrue(decoded.results[i].status == response->results[i].status);
+					Assert::AreEqual(decoded.results[i].data, response->results[i].data);
+				}
+
+				// Cut short anywhere, a multi-key payload doesn't decode
+				if (response->isMulti) {
+					Assert::IsFalse(decodeBinaryResponse(header, payload.substr(0, payload.size() - 1), decoded));
+					Assert::IsFalse(decodeBinaryResponse(header, payload.substr(0, 3), decoded));
+				}
+			}
+		}
+	};
+}
@@ -0,0 +1,245 @@
+#include "pch.h"
+#include "CppUnitTest.h"
+#include "../SimpleKVS/Database.h"
+#include "../SimpleKVS/MemoryBudget.h"
+#include <filesystem>
+#include <string>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+namespace UnitTest
+{
+	TEST_CLASS(WriteBufferTest)
+	{
+	public:
+
+		TEST_METHOD(Rotation)
+		{
+			DatabaseOptions options;
+			options.collectionDefaults.writeBufferSize = 64 * 1024;
+			Database db(options);
+			Collection& collection = db.addCollection("test");
+
+			// About 1 MB of writes, so the buffer is sealed many times over
+			std::string value(1000, 'v');
+			for (int i = 0; i < 1000; i++) {
+				collection.set("key" + std::to_string(i), value);
+			}
+			collection.del("key1");
+			db.waitForFlushes();
+
+			Assert::AreEqual(collection.sealedBuffers(), (size_t)0);
+			Assert::AreEqual(db.budget().pending(), (size_t)0);
+			Assert::IsTrue(db.budget().flushed() >= 900 * 1000);
+			Assert::IsTrue(collection.memoryUsage() >= 1000 * 1000);
+
+			// Flushing only drops the buffers, the collection still has it all
+			for (int i = 2; i < 1000; i++) {
+				Assert::AreEqual(*collection.get("key" + std::to_string(i)), value);
+			}
+			Assert::ExpectException<std::out_of_range>([&] { collection.get("key1"); });
+		}
+
+		TEST_METHOD(Update)
+		{
+			for (bool hashIndex : { false, true }) {
+				// Without a database, so sealed buffers wait for flush below
+				CollectionOptions options;
+				options.hashIndex = hashIndex;
+				options.writeBufferSize = 64 * 1024;
+				Collection collection("test", options);
+
+				// Enough new keys to split leaves, so the index has to follow
+				auto append = [](std::string& value, bool exists) { value += 'x'; return true; };
+				for (int round = 0; round < 3; round++) {
+					for (int i = 0; i < 2000; i++) {
+						Assert::IsTrue(collection.update("key" + std::to_string(i), append));
+					}
+				}
+				Assert::IsFalse(collection.update("key0", [](std::string& value, bool exists) { return false; }));
+				Assert::IsFalse(collection.update("missing", [](std::string& value, bool exists) { return exists; }));
+
+				Assert::AreEqual(collection.size(), (size_t)2000);
+				for (int i = 0; i < 2000; i++) {
+					Assert::AreEqual(*collection.get("key" + std::to_string(i)), std::string("xxx"));
+				}
+				Assert::ExpectException<std::out_of_range>([&] { collection.get("missing"); });
+
+				// Every change went through the write buffers
+				collection.seal();
+				size_t entries = 0;
+				while (collection.flush([&](const Collection::Map& buffer) { entries += buffer.size(); })) {}
+				Assert::IsTrue(entries >= 2000);
+			}
+		}
+
+		TEST_METHOD(SharedValues)
+		{
+			Collection collection("test");
+			collection.set("key", std::string(1000, 'v'));
+			// The cache, the write buffer and every reader hold the same value
+			auto value = collection.get("key");
+			Assert::IsTrue(value == collection.get("key"));
+			Assert::IsTrue(value == collection.multiGet({ "key" })[0]);
+			Assert::AreEqual(value.use_count(), (long)3);
+
+			// Readers keep theirs through overwrites and deletes
+			collection.set("key", "new");
+			collection.del("key");
+			Assert::AreEqual(*value, std::string(1000, 'v'));
+			Assert::AreEqual(value.use_count(), (long)1);
+		}
+
+		TEST_METHOD(Recovery)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "SimpleKVS-recovery";
+			std::filesystem::remove_all(directory);
+			DatabaseOptions options;
+			options.dataDirectory = directory.string();
+			options.collectionDefaults.writeBufferSize = 16 * 1024;
+			options.collectionDefaults.hashIndex = true;
+			std::string value(100, 'v');
+			{
+				Database db(options);
+				Collection& collection = db.addCollection("test");
+				for (int i = 0; i < 1000; i++) {
+					collection.set("key" + std::to_string(i), value + std::to_string(i));
+				}
+				collection.del("key1");
+				collection.set("key2", "overwritten");
+				db.addCollection("other").set("key", "other");
+				// The active buffers are saved on close
+			}
+			{
+				Database db(options);
+				Collection& collection = db.getCollection("test");
+				Assert::AreEqual(collection.size(), (size_t)999);
+				Assert::ExpectException<std::out_of_range>([&] { collection.get("key1"); });
+				Assert::AreEqual(*collection.get("key2"), std::string("overwritten"));
+				Assert::AreEqual(*collection.get("key999"), value + "999");
+				Assert::AreEqual(*db.getCollection("other").get("key"), std::string("other"));
+
+				// Recovered entries aren't written again, new runs follow the old ones
+				Assert::AreEqual(collection.sealedBuffers(), (size_t)0);
+				collection.set("key1", "back");
+			}
+			{
+				Database db(options);
+				Assert::AreEqual(*db.getCollection("test").get("key1"), std::string("back"));
+				Assert::AreEqual(db.getCollection("test").size(), (size_t)1000);
+			}
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(Compaction)
+		{
+			auto directory = std::filesystem::temp_directory_path() / "SimpleKVS-compaction";
+			std::filesystem::remove_all(directory);
+			DatabaseOptions options;
+			options.dataDirectory = directory.string();
+			options.collectionDefaults.writeBufferSize = 4 * 1024;
+			auto runFiles = [&]() {
+				size_t files = 0;
+				for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+					files += entry.path().extension() == ".run";
+				}
+				return files;
+			};
+			{
+				Database db(options);
+				Collection& collection = db.addCollection("test");
+				// The same keys over and over, in many more buffers than runs are kept
+				for (int round = 0; round < 20; round++) {
+					for (int i = 0; i < 100; i++) {
+						collection.set("key" + std::to_string(i), std::to_string(round));
+					}
+					for (int i = 0; i < 100; i += 10) {
+						collection.del("key" + std::to_string(i + round % 10));
+					}
+					collection.seal();
+				}
+				db.waitForFlushes();
+				Assert::IsTrue(runFiles() < Database::COMPACTION_RUNS);
+			}
+			{
+				Database db(options);
+				Collection& collection = db.getCollection("test");
+				Assert::AreEqual(collection.size(), (size_t)90);
+				for (int i = 0; i < 100; i++) {
+					if (i % 10 == 9) {
+						Assert::ExpectException<std::out_of_range>([&] { collection.get("key" + std::to_string(i)); });
+					}
+					else {
+						Assert::AreEqual(*collection.get("key" + std::to_string(i)), std::string("19"));
+					}
+				}
+			}
+			std::filesystem::remove_all(directory);
+		}
+
+		TEST_METHOD(ResidentMemory)
+		{
+			DatabaseOptions options;
+			options.memoryBudget = 1024 * 1024;
+			options.collectionDefaults.writeBufferSize = 64 * 1024;
+			Database db(options);
+			Collection& collection = db.addCollection("test");
+			std::string value(1000, 'v');
+			int i = 0;
+			while (!db.memoryExhausted()) {
+				collection.set("key" + std::to_string(i++), value);
+			}
+			db.waitForFlushes();
+			// Flushing only frees the sealed buffers
+			Assert::IsTrue(db.memoryExhausted());
+			Assert::IsFalse(db.writesStalled());
+			Assert::AreEqual(db.budget().resident(), collection.residentMemoryUsage());
+
+			// Deletes make room again
+			for (int j = 0; j < i / 2; j++) {
+				collection.del("key" + std::to_string(j));
+			}
+			collection.seal();
+			db.waitForFlushes();
+			Assert::IsFalse(db.memoryExhausted());
+			Assert::AreEqual(db.budget().resident(), collection.residentMemoryUsage());
+		}
+
+		TEST_METHOD(WriteDelay)
+		{
+			MemoryBudget budget(1000);
+			budget.seal(400);
+			Assert::AreEqual(budget.writeDelay().count(), 0LL);
+
+			budget.seal(200);
+			auto slow = budget.writeDelay();
+			Assert::IsTrue(slow.count() > 0 && slow < MemoryBudget::MAX_WRITE_DELAY);
+
+			budget.seal(200);
+			Assert::IsTrue(budget.writeDelay() > slow);
+			Assert::IsFalse(budget.isStalled());
+
+			budget.seal(200);
+			Assert::IsTrue(budget.isStalled());
+			Assert::IsTrue(budget.writeDelay() == MemoryBudget::MAX_WRITE_DELAY);
+
+			budget.release(1000);
+			Assert::IsFalse(budget.isStalled());
+			Assert::AreEqual(budget.writeDelay().count(), 0LL);
+			Assert::AreEqual(budget.flushed(), (size_t)1000);
+
+			// Sealed buffers get what resident memory leaves
+			budget.resize(0, 600);
+			budget.seal(300);
+			Assert::IsTrue(budget.writeDelay().count() > 0);
+			budget.seal(100);
+			Assert::IsTrue(budget.isStalled());
+			budget.resize(600, 1000);
+			Assert::IsTrue(budget.isExhausted());
+			Assert::IsFalse(budget.isStalled());
+			Assert::AreEqual(budget.writeDelay().count(), 0LL);
+			budget.resize(1000, 100);
+			Assert::IsFalse(budget.isExhausted());
+		}
+	};
+}